@@ -1,6 +1,23 @@
 #pragma once
 
 #include <string>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+struct DatabasePoolOptions
+{
+	uint32_t min_idle = 3; // 平时保持的空闲连接数
+	uint32_t max_size = 64; // 连接数上限
+	std::chrono::milliseconds grow_after = std::chrono::milliseconds(50); // 排队超过这个时间就在后台扩容
+	std::chrono::seconds idle_timeout = std::chrono::seconds(600); // 空闲超过这个时间的连接会被断开（保留min_idle个）
+	std::chrono::seconds keepalive_after = std::chrono::seconds(20); // 空闲超过这个时间的连接才发心跳
+	std::chrono::milliseconds reconnect_min = std::chrono::milliseconds(100); // 重连退避的初始间隔，每次失败翻倍
+	std::chrono::milliseconds reconnect_max = std::chrono::milliseconds(30000); // 重连退避的最大间隔
+	std::chrono::seconds resolve_ttl = std::chrono::seconds(300); // 地址解析结果的缓存时间，连不上缓存的地址时提前作废
+	std::chrono::milliseconds query_timeout = std::chrono::milliseconds(10000); // 排队等连接和每条语句（流式读取时每一批）各自的最长时间，语句超时关闭连接并重建，0表示不限制
+	uint32_t shards = 1; // 分片数，1表示所有连接共用GlobalContextSingleton；0表示每个核一个分片
+};
 
 struct DatabaseConfig
 {
@@ -9,6 +26,9 @@ struct DatabaseConfig
 	std::string user;
 	std::string pass;
 	std::string schema;
+	DatabasePoolOptions pool = {};
+	std::vector<DatabaseConfig> replicas; // 只读副本，为空时读也走主库
+	std::chrono::milliseconds read_your_writes = std::chrono::milliseconds(3000); // 玩家自己写入之后这么久之内，他的读走主库
 };
 
 const DatabaseConfig &GetDatabaseConfig();
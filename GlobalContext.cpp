@@ -6,10 +6,13 @@
 
 #include "boost/asio.hpp"
 
+static thread_local std::size_t current_shard = SIZE_MAX;
+
 struct Context : std::enable_shared_from_this<Context> {
     boost::asio::io_context io_context;
     boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_guard;
     std::vector<std::thread> thread_pool;
+    std::size_t shard = SIZE_MAX;
 
     Context() : work_guard(make_work_guard(io_context))
     {
@@ -37,11 +40,38 @@ struct Context : std::enable_shared_from_this<Context> {
 
     std::thread make_thread()
     {
-        return std::thread([&ioc = io_context]{ ioc.run(); });
+        return std::thread([&ioc = io_context, shard = shard]{ current_shard = shard; ioc.run(); });
     }
 };
 
 std::shared_ptr<boost::asio::io_context> GlobalContextSingleton() {
     static auto sp = std::make_shared<Context>()->start();
     return std::shared_ptr<boost::asio::io_context>(sp, &sp->io_context);
-}
\ No newline at end of file
+}
+
+static const std::vector<std::shared_ptr<Context>> &ShardedContexts() {
+    static auto v = [] {
+        std::vector<std::shared_ptr<Context>> v(std::max<unsigned>(std::thread::hardware_concurrency(), 1));
+        for (std::size_t i = 0; i < v.size(); ++i)
+        {
+            v[i] = std::make_shared<Context>();
+            v[i]->shard = i;
+            v[i]->start(1);
+        }
+        return v;
+    }();
+    return v;
+}
+
+std::size_t ShardedContextCount() {
+    return ShardedContexts().size();
+}
+
+std::shared_ptr<boost::asio::io_context> ShardedContextSingleton(std::size_t shard) {
+    auto &sp = ShardedContexts()[shard % ShardedContextCount()];
+    return std::shared_ptr<boost::asio::io_context>(sp, &sp->io_context);
+}
+
+std::size_t CurrentContextShard() {
+    return current_shard;
+}
@@ -6,6 +6,7 @@
 #define CQMIAO_GLOBALCONTEXT_H
 
 #include <memory>
+#include <cstddef>
 
 namespace boost::asio {
     class io_context;
@@ -13,5 +14,11 @@ namespace boost::asio {
 
 std::shared_ptr<boost::asio::io_context> GlobalContextSingleton();
 
+// 每个核一个io_context，每个只由一个线程运行
+std::size_t ShardedContextCount();
+std::shared_ptr<boost::asio::io_context> ShardedContextSingleton(std::size_t shard);
+// 当前线程运行的分片，不是分片线程时返回SIZE_MAX
+std::size_t CurrentContextShard();
+
 
 #endif //CQMIAO_GLOBALCONTEXT_H
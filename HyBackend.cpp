@@ -0,0 +1,67 @@
+#include "HyBackend.h"
+
+#include <algorithm>
+
+std::string HyIdentityKey(std::string_view idsrc, std::string_view auth)
+{
+	std::string key;
+	key.reserve(idsrc.size() + auth.size() + 1);
+	key.append(idsrc).push_back('\0');
+	key.append(auth);
+	return key;
+}
+
+int HySignRewardMultiply(int rank, bool op)
+{
+	int rewardmultiply = 1;
+	if (rank == 1)
+		rewardmultiply *= 3;
+	else if (rank == 2)
+		rewardmultiply *= 5;
+	else if (rank == 3)
+		rewardmultiply *= 0;
+	else if (rank == 4)
+		rewardmultiply *= 7;
+	else if (rank == 9)
+		rewardmultiply *= 0;
+	else if (rank == 10)
+		rewardmultiply *= 2;
+
+	if (op)
+		rewardmultiply *= 3;
+	return rewardmultiply;
+}
+
+std::vector<HyUserSignGetItemInfo> HyPickSignAwards(const std::vector<HyUserOwnItemInfo> &awards, int times, std::map<std::string, int32_t> &added)
+{
+	std::vector<HyUserSignGetItemInfo> vecItems;
+	if (awards.empty())
+		return vecItems;
+	std::mt19937 gen(std::random_device{}());
+	std::uniform_int_distribution<std::size_t> rg(0, awards.size() - 1);
+	for (int i = 0; i < times; ++i)
+	{
+		auto &reward = awards[rg(gen)];
+		vecItems.push_back(HyUserSignGetItemInfo{ reward.item, reward.amount, 0 });
+		added[reward.item.code] += reward.amount;
+	}
+	return vecItems;
+}
+
+static std::random_device &GoCodeRandomDevice()
+{
+	static std::random_device rd;
+	return rd;
+}
+
+HyGoCodeGenerator::HyGoCodeGenerator(const std::string &steamid) : digits(std::to_string(std::hash<std::string>()(steamid)))
+{
+	while (digits.size() < gocode.size())
+		digits.push_back(std::uniform_int_distribution<int>('0', '9')(GoCodeRandomDevice()));
+}
+
+std::string HyGoCodeGenerator::next()
+{
+	std::sample(digits.begin(), digits.end(), gocode.begin(), gocode.size(), std::mt19937(GoCodeRandomDevice()()));
+	return gocode;
+}
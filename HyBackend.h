@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+
+#include "HyDatabase.h"
+#include "HyCatalog.h"
+
+// 一个账号和绑定在同一个uid上的所有账号
+struct HyIdentitySet
+{
+	int64_t uid = 0; // 0表示不在idlink里，只有自己
+	std::vector<std::pair<std::string, std::string>> identities; // (idsrc, auth)，包括自己
+};
+
+struct HyBindResult
+{
+	std::string auth; // 注册码对应的游戏账号
+	int64_t uid = 0;
+	bool linked = false;
+};
+
+struct HyConsumeResult
+{
+	int32_t remain = 0; // 这个账号自己剩下的数量
+	bool merged = false; // 自己的不够，先把绑定账号的合并过来再扣的，remain就是新的合计数量
+};
+
+struct HySignOutcome
+{
+	HyUserSignResultType type = HyUserSignResultType::failure_unknown;
+	std::optional<HyUserSignResult> result;
+	std::map<std::string, int32_t> added; // 这次签到写入的奖励数量，按道具合并
+};
+
+// CHyDatabase下面的存储层，只负责读写数据，缓存、延迟写入和目录快照都在CHyDatabase里
+// 同名的同步和异步接口语义相同，多步的操作（绑定、注册、扣除、签到）要么全部生效要么没有效果
+class HyBackend
+{
+public:
+	virtual ~HyBackend() = default;
+
+	using item_rows = std::function<void(std::vector<HyItemInfo>)>;
+	using own_item_rows = std::function<void(std::vector<HyUserOwnItemInfo>)>;
+	using amount_map = std::unordered_map<std::string, int32_t>;
+
+	struct catalog_rows
+	{
+		std::vector<HyItemInfo> items;
+		std::vector<HyCatalog::shop_row> shop;
+	};
+
+	virtual void Start() = 0;
+	virtual void Hibernate() = 0;
+	virtual MySqlPoolSnapshot Metrics() = 0;
+	// 异步调用应该在哪个io_context上执行，preferred是完成回调关联的；nullptr表示不在意，由CHyDatabase决定
+	virtual boost::asio::io_context *ContextFor(boost::asio::execution_context &preferred) { return nullptr; }
+	// 这个账号的数据刚被修改过（包括在别处修改），之后一小段时间的读要看到最新的
+	virtual void NoteWrite(std::string_view idsrc, std::string_view auth) {}
+	// 只有执行SQL的存储需要实现
+	virtual void SetQueryTrace(MySqlQueryTraceOptions options) {}
+	virtual MySqlQueryTraceSnapshot QueryTrace() { return {}; }
+
+	// 账号，idsrc只支持qq和steam
+	virtual std::optional<HyUserAccountData> Account(std::string_view idsrc, const std::string &auth) = 0;
+	virtual boost::asio::awaitable<std::optional<HyUserAccountData>> async_Account(std::string_view idsrc, std::string auth) = 0;
+	virtual bool UpdateXSCode(int64_t qqid, int32_t xscode) = 0;
+	// 用注册码找到游戏账号（idsrc是name或steam），绑定到qqid所在的uid上并删掉注册记录，qqid没有注册过时先注册
+	// 注册码不存在时返回nullopt
+	virtual std::optional<HyBindResult> BindByRegCode(int64_t qqid, std::string_view idsrc, int32_t regcode) = 0;
+	// 换掉steamid原来的注册码，返回新的，失败时保留旧的并返回0
+	virtual boost::asio::awaitable<int32_t> async_StartRegistration(std::string steamid) = 0;
+
+	// latest为true时必须读到最新的数据
+	virtual catalog_rows LoadCatalog(bool latest) = 0;
+	virtual boost::asio::awaitable<catalog_rows> async_LoadCatalog() = 0;
+	virtual size_t StreamAllItemInfo(const item_rows &on_rows, size_t batch) = 0;
+	virtual boost::asio::awaitable<size_t> async_StreamAllItemInfo(const item_rows &on_rows, size_t batch) = 0;
+
+	virtual std::shared_ptr<const HyIdentitySet> Identities(std::string_view idsrc, const std::string &auth) = 0;
+	virtual boost::asio::awaitable<std::shared_ptr<const HyIdentitySet>> async_Identities(std::string_view idsrc, std::string auth) = 0;
+
+	// 以下道具数量都是绑定账号的合计，ids是这个账号的Identities
+	virtual amount_map ItemAmounts(std::string_view idsrc, const std::string &auth, const HyIdentitySet &ids) = 0;
+	virtual boost::asio::awaitable<amount_map> async_ItemAmounts(std::string_view idsrc, std::string auth, const HyIdentitySet &ids) = 0;
+	virtual std::vector<HyUserOwnItemInfo> UserOwnItemInfo(std::string_view idsrc, const std::string &auth) = 0;
+	virtual boost::asio::awaitable<std::vector<HyUserOwnItemInfo>> async_UserOwnItemInfo(std::string_view idsrc, std::string auth) = 0;
+	virtual size_t StreamUserOwnItemInfo(std::string_view idsrc, const std::string &auth, const own_item_rows &on_rows, size_t batch) = 0;
+	virtual boost::asio::awaitable<size_t> async_StreamUserOwnItemInfo(std::string_view idsrc, std::string auth, const own_item_rows &on_rows, size_t batch) = 0;
+
+	// 插入或累加
+	virtual bool GiveItem(std::string_view idsrc, const std::string &auth, const std::string &code, int add_amount) = 0;
+	virtual boost::asio::awaitable<bool> async_GiveItem(std::string_view idsrc, std::string auth, std::string code, int add_amount) = 0;
+	// 每个(idsrc, auth, code)只出现一次，结果和grants一一对应；调用被取消时抛出operation_aborted
+	virtual boost::asio::awaitable<std::vector<HyGrantResult>> async_GiveItems(std::vector<HyItemGrant> grants) = 0;
+	// 自己的不够扣时合并绑定账号的再扣，合计也不够时返回nullopt
+	virtual std::optional<HyConsumeResult> ConsumeItem(std::string_view idsrc, const std::string &auth, const std::string &code, int sub_amount) = 0;
+	virtual boost::asio::awaitable<std::optional<HyConsumeResult>> async_ConsumeItem(std::string_view idsrc, std::string auth, std::string code, int sub_amount) = 0;
+
+	virtual boost::asio::awaitable<HySignOutcome> async_DailySign(int64_t qqid, bool op) = 0;
+};
+
+// 缓存和索引用的key
+std::string HyIdentityKey(std::string_view idsrc, std::string_view auth);
+
+// 签到名次对应的奖励倍数
+int HySignRewardMultiply(int rank, bool op);
+
+// 从awards里随机抽times次，同一种道具的数量累加到added
+std::vector<HyUserSignGetItemInfo> HyPickSignAwards(const std::vector<HyUserOwnItemInfo> &awards, int times, std::map<std::string, int32_t> &added);
+
+// 从steamid的哈希里的数字抽出8位注册码，和别人重复时再抽一个
+class HyGoCodeGenerator
+{
+public:
+	explicit HyGoCodeGenerator(const std::string &steamid);
+	std::string next();
+
+private:
+	std::string digits;
+	std::string gocode = std::string(8, '0');
+};
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/system/system_error.hpp>
+
+// 带过期时间的缓存，按key分片加锁
+// 过期的项在读到时删除，写入时如果分片变大了也会顺便清理一遍
+template<class Key, class Value, class Hash = std::hash<Key>>
+class HyTtlCache
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	explicit HyTtlCache(clock::duration ttl) : ttl(ttl) {}
+
+	std::optional<Value> get(const Key &key)
+	{
+		auto &s = shard_of(key);
+		std::lock_guard l(s.m);
+		auto iter = s.entries.find(key);
+		if (iter == s.entries.end())
+			return std::nullopt;
+		if (iter->second.expire <= clock::now())
+		{
+			s.entries.erase(iter);
+			return std::nullopt;
+		}
+		return iter->second.value;
+	}
+
+	void put(const Key &key, Value value)
+	{
+		put(key, std::move(value), ttl.load(std::memory_order_relaxed));
+	}
+
+	// 单独指定这一项的过期时间
+	void put(const Key &key, Value value, clock::duration entry_ttl)
+	{
+		auto now = clock::now();
+		auto &s = shard_of(key);
+		std::lock_guard l(s.m);
+		s.entries.insert_or_assign(key, entry{ std::move(value), now + entry_ttl });
+		if (s.entries.size() >= s.next_sweep)
+		{
+			std::erase_if(s.entries, [now](const auto &kv) { return kv.second.expire <= now; });
+			s.next_sweep = std::max<size_t>(s.entries.size() * 2, min_sweep);
+		}
+	}
+
+	void erase(const Key &key)
+	{
+		auto &s = shard_of(key);
+		std::lock_guard l(s.m);
+		s.entries.erase(key);
+	}
+
+	// pred(key, value)返回true的都删掉，需要遍历所有分片
+	template<class Pred>
+	void erase_if(Pred pred)
+	{
+		for (auto &s : shards)
+		{
+			std::lock_guard l(s.m);
+			std::erase_if(s.entries, [&pred](const auto &kv) { return pred(kv.first, kv.second.value); });
+		}
+	}
+
+	void clear()
+	{
+		for (auto &s : shards)
+		{
+			std::lock_guard l(s.m);
+			s.entries.clear();
+		}
+	}
+
+	// 只影响之后写入的项
+	void set_ttl(clock::duration d) { ttl.store(d, std::memory_order_relaxed); }
+
+private:
+	static constexpr size_t shard_count = 16;
+	static constexpr size_t min_sweep = 64;
+
+	struct entry
+	{
+		Value value;
+		clock::time_point expire;
+	};
+
+	struct shard
+	{
+		std::mutex m;
+		std::unordered_map<Key, entry, Hash> entries;
+		size_t next_sweep = min_sweep;
+	};
+
+	shard &shard_of(const Key &key) { return shards[Hash()(key) % shard_count]; }
+
+	std::array<shard, shard_count> shards;
+	std::atomic<clock::duration> ttl;
+};
+
+// 同一个key同时只有一次加载，并发的请求等待同一个结果（包括异常）
+template<class Key, class Value, class Hash = std::hash<Key>>
+class HySingleFlight
+{
+public:
+	// loader是返回awaitable<Value>的可调用对象，只有第一个到达的请求会执行它
+	template<class Loader>
+	boost::asio::awaitable<Value> async_run(Key key, Loader loader)
+	{
+		std::shared_ptr<flight> f;
+		bool leader = false;
+		{
+			std::lock_guard l(m);
+			auto &slot = flights[key];
+			if (!slot)
+			{
+				slot = std::make_shared<flight>();
+				leader = true;
+			}
+			f = slot;
+		}
+
+		if (leader)
+		{
+			landing land{ *this, key, f };
+			try
+			{
+				f->value = co_await loader();
+			}
+			catch (...)
+			{
+				f->error = std::current_exception();
+			}
+		}
+		else
+		{
+			co_await boost::asio::async_initiate<const boost::asio::use_awaitable_t<> &, void()>([this, f](auto handler) {
+				std::unique_lock l(m);
+				if (f->done)
+				{
+					l.unlock();
+					auto ex = boost::asio::get_associated_executor(handler);
+					return boost::asio::post(ex, std::move(handler));
+				}
+				f->waiters.push_back(std::make_unique<waiter_impl<decltype(handler)>>(std::move(handler)));
+			}, boost::asio::use_awaitable);
+		}
+
+		if (f->error)
+			std::rethrow_exception(f->error);
+		co_return *f->value;
+	}
+
+private:
+	struct waiter
+	{
+		virtual ~waiter() = default;
+		virtual void complete() = 0;
+	};
+
+	template<class Handler>
+	struct waiter_impl : waiter
+	{
+		explicit waiter_impl(Handler h) : handler(std::move(h)) {}
+
+		void complete() override
+		{
+			auto ex = boost::asio::get_associated_executor(handler);
+			boost::asio::post(ex, std::move(handler));
+		}
+
+		Handler handler;
+	};
+
+	struct flight
+	{
+		std::optional<Value> value;
+		std::exception_ptr error;
+		bool done = false; // 受m保护
+		std::vector<std::unique_ptr<waiter>> waiters; // 受m保护
+	};
+
+	// 领头的请求结束时删掉这次加载并唤醒等待者
+	// 协程没有完成就被销毁（io_context停止、被取消）时也在析构里做，等待者得到operation_aborted，不会一直等下去
+	struct landing
+	{
+		HySingleFlight &self;
+		const Key &key;
+		std::shared_ptr<flight> f;
+
+		~landing()
+		{
+			if (!f->value && !f->error)
+				f->error = std::make_exception_ptr(boost::system::system_error(boost::asio::error::operation_aborted));
+			std::vector<std::unique_ptr<waiter>> waiters;
+			{
+				std::lock_guard l(self.m);
+				if (auto iter = self.flights.find(key); iter != self.flights.end() && iter->second == f)
+					self.flights.erase(iter);
+				f->done = true;
+				waiters.swap(f->waiters);
+			}
+			for (auto &w : waiters)
+				w->complete();
+		}
+	};
+
+	std::mutex m;
+	std::unordered_map<Key, std::shared_ptr<flight>, Hash> flights;
+};
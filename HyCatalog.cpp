@@ -0,0 +1,25 @@
+#include "HyCatalog.h"
+
+HyCatalog::HyCatalog(uint64_t version, std::vector<HyItemInfo> items_, const std::vector<shop_row> &shop_rows) :
+	version(version),
+	loaded_at(std::chrono::steady_clock::now()),
+	items(std::move(items_))
+{
+	index.reserve(items.size());
+	for (size_t i = 0; i < items.size(); ++i)
+		index.emplace(items[i].code, i);
+
+	auto item_of = [this](const std::string &code) {
+		auto item = find(code);
+		return item ? *item : HyItemInfo{ code };
+	};
+	shop.reserve(shop_rows.size());
+	for (auto &row : shop_rows)
+		shop.push_back(HyShopEntry{ row.shopid, item_of(row.target_code), row.target_amount, item_of(row.exchange_code), row.exchange_amount });
+}
+
+const HyItemInfo *HyCatalog::find(std::string_view code) const
+{
+	auto iter = index.find(code);
+	return iter != index.end() ? &items[iter->second] : nullptr;
+}
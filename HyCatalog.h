@@ -0,0 +1,39 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "HyDatabase.h"
+
+// iteminfo和itemshop的只读快照，加载完之后不再修改，可以被多个线程同时读
+// 更新时整个替换成新的快照
+struct HyCatalog
+{
+	uint64_t version = 0;
+	std::chrono::steady_clock::time_point loaded_at;
+
+	std::vector<HyItemInfo> items;
+	std::vector<HyShopEntry> shop;
+
+	// 找不到返回nullptr
+	const HyItemInfo *find(std::string_view code) const;
+
+	// 商店表里是道具code，在这里换成道具信息，不认识的道具只填code
+	struct shop_row
+	{
+		int32_t shopid;
+		std::string target_code;
+		int target_amount;
+		std::string exchange_code;
+		int exchange_amount;
+	};
+	HyCatalog(uint64_t version, std::vector<HyItemInfo> items, const std::vector<shop_row> &shop_rows);
+	HyCatalog(const HyCatalog &) = delete; // index指向自己的items
+
+private:
+	std::unordered_map<std::string_view, size_t> index; // 指向items里的code
+};
@@ -1,25 +1,110 @@
 #include "HyDatabase.h"
-#include "MySqlConnectionPool.h"
-
-#include <random>
+#include "HyBackend.h"
+#include "HyMySqlBackend.h"
+#include "HyMemoryBackend.h"
+#include "HyWriteBehind.h"
+#include "HyCatalog.h"
+#include "HyCache.h"
+#include "HyInventoryCache.h"
+
+#include <algorithm>
 #include <atomic>
+#include <deque>
 #include <string>
 #include <future>
 #include <string_view>
-#include <numeric>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <unordered_map>
 #include <assert.h>
 
 #include "GlobalContext.h"
 #include <boost/asio.hpp>
 #include <boost/asio/use_awaitable.hpp>
 
-#include "VariantVisitor.h"
-
 struct CHyDatabase::impl_t
 {
 public:
+	~impl_t()
+	{
+		// 退出前把没写入的增量写进去
+		if (write_behind.exchange(false))
+		{
+			flush_timer.cancel();
+			try
+			{
+				FlushWriteBehind();
+			}
+			catch (...)
+			{
+			}
+		}
+	}
+
     std::shared_ptr<boost::asio::io_context> ioc = GlobalContextSingleton();
-	MySqlConnectionPool pool;
+	// 存储层，Start之前可以换成别的实现
+	std::unique_ptr<HyBackend> backend = std::make_unique<HyMySqlBackend>();
+	void Start();
+
+	// 延迟合并写入
+	std::atomic<bool> write_behind = false;
+	std::atomic<bool> flush_scheduled = false;
+	HyWriteBehindOptions write_behind_options;
+	HyWriteBehindQueue pending_grants;
+	boost::asio::steady_timer flush_timer{ *ioc };
+	HySingleFlight<int, bool> flush_flight; // 同一时间只有一次批量写入，扣除时等正在写入的那一次
+
+	// 道具和商店目录的快照，整个替换
+	std::shared_ptr<const HyCatalog> catalog; // 只通过std::atomic_load/atomic_compare_exchange访问，GCC 11的libstdc++还没有atomic<shared_ptr>
+	std::atomic<uint64_t> catalog_version = 0;
+	std::atomic<bool> catalog_refreshing = false;
+	std::atomic<std::chrono::steady_clock::duration> catalog_ttl = std::chrono::steady_clock::duration(std::chrono::minutes(10));
+
+	std::shared_ptr<const HyCatalog> LoadCatalog(bool latest = false);
+	boost::asio::awaitable<std::shared_ptr<const HyCatalog>> async_LoadCatalog();
+	std::shared_ptr<const HyCatalog> PublishCatalog(std::shared_ptr<const HyCatalog> next);
+	std::shared_ptr<const HyCatalog> CurrentCatalog(); // 过期时在后台刷新，还没有加载过时返回nullptr
+	std::shared_ptr<const HyCatalog> Catalog();
+	boost::asio::awaitable<std::shared_ptr<const HyCatalog>> async_Catalog();
+
+	// 账号信息，查不到的结果也短暂缓存，防止反复查询未注册的账号
+	HyTtlCache<std::string, std::optional<HyUserAccountData>> account_cache{ std::chrono::minutes(5) };
+	// 绑定了steam的账号会以qq和steam两个key缓存，记下对方的key，失效时直接删不用遍历缓存
+	HyTtlCache<std::string, std::string> account_links{ std::chrono::minutes(5) };
+	HySingleFlight<std::string, std::optional<HyUserAccountData>> account_flights;
+	std::atomic<uint64_t> account_generation = 0; // 每次失效加一
+	const std::chrono::steady_clock::duration account_ttl = std::chrono::minutes(5);
+	const std::chrono::steady_clock::duration account_negative_ttl = std::chrono::seconds(10);
+
+	std::optional<HyUserAccountData> Account(std::string_view idsrc, const std::string &auth);
+	boost::asio::awaitable<std::optional<HyUserAccountData>> async_Account(std::string_view idsrc, std::string auth);
+	void CacheAccount(const std::string &key, const std::optional<HyUserAccountData> &account, uint64_t generation);
+	void InvalidateAccount(int64_t qqid, std::initializer_list<std::pair<std::string, std::string>> also);
+	void EraseAccount(const std::string &key);
+
+	// 玩家道具合计数量，本进程的写入成功后原地修改
+	HyInventoryCache inventory_cache{ 4096, std::chrono::minutes(5) };
+
+	std::unordered_map<std::string, int32_t> LoadInventory(std::string_view idsrc, const std::string &auth);
+	boost::asio::awaitable<std::unordered_map<std::string, int32_t>> async_LoadInventory(std::string_view idsrc, const std::string &auth);
+	int32_t GetItemAmount(std::string_view idsrc, const std::string &auth, const std::string &code);
+
+	void AddPendingGrant(const std::string &idsrc, const std::string &auth, const std::string &code, int32_t delta);
+	boost::asio::awaitable<void> async_FlushWriteBehind();
+	boost::asio::awaitable<bool> async_FlushOnce();
+	boost::asio::awaitable<void> async_WaitInFlightGrant(std::string_view idsrc, const std::string &auth, const std::string &code);
+	boost::asio::awaitable<void> async_FlushLoop();
+	void FlushWriteBehind();
+
+	// 参数按值传递，协程可能在调用者返回之后才执行
+	boost::asio::awaitable<int32_t> async_GetItemAmount(std::string_view idsrc, std::string auth, std::string code);
+	boost::asio::awaitable<void> async_FlushPendingGrant(std::string_view idsrc, const std::string &auth, const std::string &code);
+	boost::asio::awaitable<bool> async_GiveItem(std::string_view idsrc, std::string auth, std::string code, int add_amount);
+	boost::asio::awaitable<std::vector<HyGrantResult>> async_GiveItemsBatch(std::vector<HyItemGrant> grants);
+	boost::asio::awaitable<std::optional<int32_t>> async_ConsumeItem(std::string_view idsrc, std::string auth, std::string code, int sub_amount); // 返回剩余数量，不够时返回nullopt
+
+	boost::asio::awaitable<std::pair<HyUserSignResultType, std::optional<HyUserSignResult>>> async_DailySign(int64_t qqid, bool op);
 };
 
 CHyDatabase CHyDatabase::instance;
@@ -32,533 +117,708 @@ CHyDatabase::CHyDatabase() : pimpl(std::make_shared<impl_t>()) {}
 
 CHyDatabase::~CHyDatabase() = default;
 
-// qqid, name, steamid, xscode, access, tag
-static HyUserAccountData UserAccountDataFromSqlResult(const std::vector<boost::mysql::row> &res)
+std::optional<HyUserAccountData> CHyDatabase::impl_t::Account(std::string_view idsrc, const std::string &auth)
 {
-	if (res.empty())
-		throw InvalidUserAccountDataException();
-	const auto &line = res[0].values();
-	return HyUserAccountData{
-            visit(IntegerVisitor<int64_t>(), line[0].to_variant()),
-            visit(StringVisitor(), line[1].to_variant()),
-            visit(StringVisitor(), line[2].to_variant()),
-            visit(IntegerVisitor<int32_t>(), line[3].to_variant()),
-            visit(StringVisitor(), line[4].to_variant()),
-            visit(StringVisitor(), line[5].to_variant())
-	};
+	auto key = HyIdentityKey(idsrc, auth);
+	if (auto cached = account_cache.get(key))
+		return *cached;
+	auto generation = account_generation.load();
+	auto result = backend->Account(idsrc, auth);
+	CacheAccount(key, result, generation);
+	return result;
+}
+
+boost::asio::awaitable<std::optional<HyUserAccountData>> CHyDatabase::impl_t::async_Account(std::string_view idsrc, std::string auth)
+{
+	auto key = HyIdentityKey(idsrc, auth);
+	if (auto cached = account_cache.get(key))
+		co_return *cached;
+	// 同一个账号同时只查一次，其他人等同一个结果
+	co_return co_await account_flights.async_run(key, [this, key, idsrc, auth]() -> boost::asio::awaitable<std::optional<HyUserAccountData>> {
+		auto generation = account_generation.load();
+		auto result = co_await backend->async_Account(idsrc, auth);
+		CacheAccount(key, result, generation);
+		co_return result;
+	});
+}
+
+// 查询期间如果有过失效，结果可能已经过时，不放进缓存
+void CHyDatabase::impl_t::CacheAccount(const std::string &key, const std::optional<HyUserAccountData> &account, uint64_t generation)
+{
+	if (account_generation.load() != generation)
+		return;
+	if (account && account->qqid && !account->steamid.empty())
+	{
+		// 比缓存的项晚过期，保证失效时能找到另一个key
+		auto qq = HyIdentityKey("qq", std::to_string(account->qqid));
+		auto steam = HyIdentityKey("steam", account->steamid);
+		account_links.put(qq, steam, account_ttl + std::chrono::seconds(1));
+		account_links.put(steam, qq, account_ttl + std::chrono::seconds(1));
+	}
+	account_cache.put(key, account, account ? account_ttl : account_negative_ttl);
+}
+
+void CHyDatabase::impl_t::EraseAccount(const std::string &key)
+{
+	if (auto linked = account_links.get(key))
+	{
+		account_cache.erase(*linked);
+		account_links.erase(*linked);
+	}
+	account_cache.erase(key);
+	account_links.erase(key);
+}
+
+void CHyDatabase::impl_t::InvalidateAccount(int64_t qqid, std::initializer_list<std::pair<std::string, std::string>> also)
+{
+	++account_generation;
+	if (qqid)
+	{
+		backend->NoteWrite("qq", std::to_string(qqid));
+		EraseAccount(HyIdentityKey("qq", std::to_string(qqid)));
+	}
+	for (auto &[idsrc, auth] : also)
+	{
+		backend->NoteWrite(idsrc, auth);
+		EraseAccount(HyIdentityKey(idsrc, auth));
+	}
 }
 
 HyUserAccountData CHyDatabase::QueryUserAccountDataByQQID(int64_t fromQQ)
 {
-	return UserAccountDataFromSqlResult(pimpl->pool.acquire()->query(
-		"SELECT qqid, name, steamid, xscode, access, tag FROM qqlogin "
-		"NATURAL LEFT OUTER JOIN (SELECT auth AS qqid, uid FROM idlink WHERE idsrc = 'qq') AS T1 "
-		"NATURAL LEFT OUTER JOIN (SELECT auth AS name, uid FROM idlink WHERE idsrc = 'name') AS T2 "
-		"NATURAL LEFT OUTER JOIN (SELECT auth AS steamid, uid FROM idlink WHERE idsrc = 'steam') AS T3 "
-		"WHERE `qqid` = '" + std::to_string(fromQQ) + "';"
-	).read_all());
+	auto account = pimpl->Account("qq", std::to_string(fromQQ));
+	if (!account)
+		throw InvalidUserAccountDataException();
+	return *account;
 }
 
 boost::asio::awaitable<HyUserAccountData> CHyDatabase::async_QueryUserAccountDataByQQID(int64_t fromQQ)
 {
-	auto sql = std::string(
-		"SELECT qqid, name, steamid, xscode, access, tag FROM qqlogin "
-		"NATURAL LEFT OUTER JOIN (SELECT auth AS qqid, uid FROM idlink WHERE idsrc = 'qq') AS T1 "
-		"NATURAL LEFT OUTER JOIN (SELECT auth AS name, uid FROM idlink WHERE idsrc = 'name') AS T2 "
-		"NATURAL LEFT OUTER JOIN (SELECT auth AS steamid, uid FROM idlink WHERE idsrc = 'steam') AS T3 "
-		"WHERE `qqid` = '" + std::to_string(fromQQ) + "';"
-	);
-	auto conn = pimpl->pool.acquire();
-    boost::mysql::tcp_resultset resultset = co_await conn->async_query(sql, boost::asio::use_awaitable);
-
-    auto res = co_await resultset.async_read_all(boost::asio::use_awaitable);
-    co_return UserAccountDataFromSqlResult(res);
+	auto account = co_await pimpl->async_Account("qq", std::to_string(fromQQ));
+	if (!account)
+		throw InvalidUserAccountDataException();
+	co_return *account;
 }
 
 HyUserAccountData CHyDatabase::QueryUserAccountDataBySteamID(const std::string& steamid) noexcept(false)
 {
-	return UserAccountDataFromSqlResult(pimpl->pool.acquire()->query(
-		"SELECT qqid, name, steamid, xscode, access, tag FROM qqlogin "
-		"NATURAL LEFT OUTER JOIN (SELECT auth AS qqid, uid FROM idlink WHERE idsrc = 'qq') AS T1 "
-		"NATURAL LEFT OUTER JOIN (SELECT auth AS name, uid FROM idlink WHERE idsrc = 'name') AS T2 "
-		"NATURAL LEFT OUTER JOIN (SELECT auth AS steamid, uid FROM idlink WHERE idsrc = 'steam') AS T3 "
-		"WHERE `steamid` = '" + steamid + "';"
-	).read_all());
+	auto account = pimpl->Account("steam", steamid);
+	if (!account)
+		throw InvalidUserAccountDataException();
+	return *account;
 }
 
 boost::asio::awaitable<HyUserAccountData> CHyDatabase::async_QueryUserAccountDataBySteamID(const std::string &steamid)
 {
-	auto sql = std::string(
-		"SELECT qqid, name, steamid, xscode, access, tag FROM qqlogin "
-		"NATURAL LEFT OUTER JOIN (SELECT auth AS qqid, uid FROM idlink WHERE idsrc = 'qq') AS T1 "
-		"NATURAL LEFT OUTER JOIN (SELECT auth AS name, uid FROM idlink WHERE idsrc = 'name') AS T2 "
-		"NATURAL LEFT OUTER JOIN (SELECT auth AS steamid, uid FROM idlink WHERE idsrc = 'steam') AS T3 "
-		"WHERE `steamid` = '" + steamid + "';"
-		);
-    auto conn = pimpl->pool.acquire();
-    boost::mysql::tcp_resultset resultset = co_await conn->async_query(sql, boost::asio::use_awaitable);
-    auto res = co_await resultset.async_read_all(boost::asio::use_awaitable);
-    co_return UserAccountDataFromSqlResult(res);
+	auto account = co_await pimpl->async_Account("steam", steamid);
+	if (!account)
+		throw InvalidUserAccountDataException();
+	co_return *account;
+}
+
+void CHyDatabase::InvalidateUserAccountData(int64_t qqid)
+{
+	pimpl->InvalidateAccount(qqid, {});
+}
+
+void CHyDatabase::InvalidateUserAccountData(const std::string &steamid)
+{
+	pimpl->InvalidateAccount(0, { { "steam", steamid } });
 }
 
 bool CHyDatabase::UpdateXSCodeByQQID(int64_t qqid, int32_t xscode)
 {
-	auto res1 = pimpl->pool.acquire()->query("UPDATE qqlogin SET `xscode` = '" + std::to_string(xscode) + "' WHERE `qqid` = '" + std::to_string(qqid) + "';").affected_rows();
-	return res1 == 1;
+	bool result = pimpl->backend->UpdateXSCode(qqid, xscode);
+	pimpl->InvalidateAccount(qqid, {});
+	return result;
 }
 
 bool CHyDatabase::BindQQToCS16Name(int64_t new_qqid, int32_t xscode)
 {
-    auto conn = pimpl->pool.acquire();
-	auto res1 = conn->query("SELECT `name` FROM cs16reg WHERE `xscode` = '" + std::to_string(xscode) + "';").read_all();
-	if (res1.empty())
+	// 绑定之后合计数量的分组变了，期间开始的加载不能放进缓存
+	HyInventoryCache::write_guard guard(pimpl->inventory_cache, "qq", std::to_string(new_qqid));
+	auto bound = pimpl->backend->BindByRegCode(new_qqid, "name", xscode);
+	if (!bound)
 		return false;
-	
-	const std::string name = visit(StringVisitor(), res1[0].values()[0].to_variant());
-	int uid = 0;
-	while (1)
-	{
-		auto res2 = conn->query("SELECT `uid` FROM idlink WHERE `idsrc` = 'qq' AND `auth` = '" + std::to_string(new_qqid) + "';").read_all();
-		if (res2.empty())
-		{
-			//没有注册过，插入新的uid
-            conn->query("INSERT IGNORE INTO idlink(idsrc, auth) VALUES('qq', '" + std::to_string(new_qqid) + "');");
-            conn->query("INSERT IGNORE INTO qqlogin(qqid) VALUES('" + std::to_string(new_qqid) + "');");
-			continue;
-		}
-		//已经注册过，得到原先的uid 
-		uid = visit(IntegerVisitor<int>(), res2[0].values()[0].to_variant());
-		break;
-	}
-	//用uid和steamid注册
-	auto res3 = conn->query("INSERT IGNORE INTO idlink(idsrc, auth, uid) VALUES('name', '" + name + "', '" + std::to_string(uid) + "');").affected_rows();
-	//删掉cs16reg里面的表项，不管成不成功都无所谓了
-    conn->query("DELETE FROM cs16reg WHERE `name` = '" + name + "';");
-	return res3 == 1;
+	const auto &name = bound->auth;
+	pimpl->InvalidateAccount(new_qqid, {});
+	pimpl->inventory_cache.evict("qq", std::to_string(new_qqid));
+	pimpl->inventory_cache.evict("name", name);
+	return bound->linked;
 }
 
 bool CHyDatabase::BindQQToSteamID(int64_t new_qqid, int32_t gocode)
 {
-    auto conn = pimpl->pool.acquire();
-	auto res1 = conn->query("SELECT `steamid` FROM csgoreg WHERE `gocode` = '" + std::to_string(gocode) + "';").read_all();
-	if (res1.empty())
+	HyInventoryCache::write_guard guard(pimpl->inventory_cache, "qq", std::to_string(new_qqid));
+	auto bound = pimpl->backend->BindByRegCode(new_qqid, "steam", gocode);
+	if (!bound)
 		return false; // 没有记录的注册id
-
-	const std::string steamid = visit(StringVisitor(), res1[0].values()[0].to_variant());
-	int uid = 0; 
-	while (1)
-	{
-		auto res2 = conn->query("SELECT `uid` FROM idlink WHERE `idsrc` = 'qq' AND `auth` = '" + std::to_string(new_qqid) + "';").read_all();
-		if (res2.empty())
-		{
-			//没有注册过，插入新的uid
-            conn->query("INSERT IGNORE INTO idlink(idsrc, auth) VALUES('qq', '" + std::to_string(new_qqid) + "');").read_all();
-            conn->query("INSERT IGNORE INTO qqlogin(qqid) VALUES('" + std::to_string(new_qqid) + "');").read_all();
-			continue;
-		}
-		//已经注册过，得到原先的uid 
-		uid = visit(IntegerVisitor<int>(), res2[0].values()[0].to_variant());
-		break;
-	}
-	//用uid和steamid注册
-	auto res3 = conn->query("INSERT IGNORE INTO idlink(idsrc, auth, uid) VALUES('steam', '" + steamid + "', '" + std::to_string(uid) + "');").affected_rows();
-	//删掉csgoreg里面的表项，不管成不成功都无所谓了
-    conn->query("DELETE FROM csgoreg WHERE `steamid` = '" + steamid + "';");
-	return res3 == 1;
+	const auto &steamid = bound->auth;
+	pimpl->InvalidateAccount(new_qqid, { { "steam", steamid } });
+	pimpl->inventory_cache.evict("qq", std::to_string(new_qqid));
+	pimpl->inventory_cache.evict("steam", steamid);
+	return bound->linked;
 }
 
 boost::asio::awaitable<int32_t> CHyDatabase::async_StartRegistrationWithSteamID(const std::string& steamid)
 {
-	auto ioc = pimpl->ioc;
-	auto conn = pimpl->pool.acquire();
+	co_return co_await pimpl->backend->async_StartRegistration(steamid);
+}
 
-    static std::random_device rd;
-    std::string steamid_hash = std::to_string(std::hash<std::string>()(steamid));
-    std::string gocode(8, '0');
-    while(steamid_hash.size() < gocode.size())
-        steamid_hash.push_back(std::uniform_int_distribution<int>('0', '9')(rd));
-    int iMaxTries = 10;
-    do {
-        if (--iMaxTries == 0)
-            co_return 0;
-        co_await conn->async_query("DELETE FROM csgoreg WHERE `steamid` = '" + steamid + "';", boost::asio::use_awaitable);
-        std::sample(steamid_hash.begin(), steamid_hash.end(), gocode.begin(), gocode.size(), std::mt19937(rd()));
-    } while ((co_await conn->async_query("INSERT IGNORE INTO csgoreg(steamid, gocode) VALUES('" + steamid + "', '" + gocode+ "');", boost::asio::use_awaitable)).affected_rows() != 1);
-    co_return std::stoi(gocode);
+std::shared_ptr<const HyCatalog> CHyDatabase::impl_t::LoadCatalog(bool latest)
+{
+	auto rows = backend->LoadCatalog(latest);
+	return PublishCatalog(std::make_shared<const HyCatalog>(++catalog_version, std::move(rows.items), rows.shop));
 }
 
-// `code`, `name`, `desc`, `quantifier`
-static HyItemInfo HyItemInfoFromSqlLine(const std::vector<boost::mysql::value> &line)
+boost::asio::awaitable<std::shared_ptr<const HyCatalog>> CHyDatabase::impl_t::async_LoadCatalog()
 {
-	return HyItemInfo{
-            visit(StringVisitor(), line[0].to_variant()),
-            visit(StringVisitor(), line[1].to_variant()),
-            visit(StringVisitor(), line[2].to_variant()),
-            visit(StringVisitor(), line[3].to_variant())
-	};
+	auto rows = co_await backend->async_LoadCatalog();
+	co_return PublishCatalog(std::make_shared<const HyCatalog>(++catalog_version, std::move(rows.items), rows.shop));
 }
 
-static std::vector<HyItemInfo> InfoListFromSqlResult(const std::vector<boost::mysql::row> & res)
+// 同时有多次加载时只保留版本号最大的
+std::shared_ptr<const HyCatalog> CHyDatabase::impl_t::PublishCatalog(std::shared_ptr<const HyCatalog> next)
 {
-	std::vector<HyItemInfo> result;
-	for(auto &l : res)
+	auto current = std::atomic_load(&catalog);
+	while (!current || current->version < next->version)
 	{
-		result.push_back(HyItemInfoFromSqlLine(l.values()));
+		if (std::atomic_compare_exchange_weak(&catalog, &current, next))
+			return next;
 	}
-	return result;
+	return current;
 }
 
-// `code`, `name`, `desc`, `quantifier`, `amount`
-static std::vector<HyUserOwnItemInfo> UserOwnItemInfoListFromSqlResult(const std::vector<boost::mysql::row> &res)
+std::shared_ptr<const HyCatalog> CHyDatabase::impl_t::CurrentCatalog()
 {
-    std::vector<HyUserOwnItemInfo> result;
-	for(auto &l : res)
+	auto current = std::atomic_load(&catalog);
+	if (current && std::chrono::steady_clock::now() - current->loaded_at > catalog_ttl.load() && !catalog_refreshing.exchange(true))
 	{
-		result.push_back({ HyItemInfoFromSqlLine(l.values()), visit(IntegerVisitor<int>(), l.values()[4].to_variant()) });
+		// 刷新期间继续使用旧的快照
+		boost::asio::co_spawn(*ioc, async_LoadCatalog(), [this](std::exception_ptr, std::shared_ptr<const HyCatalog>) {
+			catalog_refreshing = false;
+		});
 	}
-    return result;
+	return current;
+}
+
+std::shared_ptr<const HyCatalog> CHyDatabase::impl_t::Catalog()
+{
+	if (auto current = CurrentCatalog())
+		return current;
+	return LoadCatalog();
+}
+
+boost::asio::awaitable<std::shared_ptr<const HyCatalog>> CHyDatabase::impl_t::async_Catalog()
+{
+	if (auto current = CurrentCatalog())
+		co_return current;
+	co_return co_await async_LoadCatalog();
 }
 
 std::vector<HyItemInfo> CHyDatabase::AllItemInfoAvailable() noexcept(false)
 {
-	return InfoListFromSqlResult(pimpl->pool.acquire()->query(
-		"SELECT `code`, `name`, `desc`, `quantifier` FROM iteminfo;"
-	).read_all());
+	return pimpl->Catalog()->items;
 }
 
 boost::asio::awaitable<std::vector<HyItemInfo>> CHyDatabase::async_AllItemInfoAvailable()
 {
-	auto conn = pimpl->pool.acquire();
-	boost::mysql::tcp_resultset resultset = co_await conn->async_query("SELECT `code`, `name`, `desc`, `quantifier` FROM iteminfo;", boost::asio::use_awaitable);
-	std::vector<boost::mysql::row> res = co_await resultset.async_read_all(boost::asio::use_awaitable);
+	co_return (co_await pimpl->async_Catalog())->items;
+}
+
+boost::asio::awaitable<std::vector<HyShopEntry>> CHyDatabase::async_QueryShopEntry()
+{
+	co_return (co_await pimpl->async_Catalog())->shop;
+}
 
-	co_return InfoListFromSqlResult(res);
+void CHyDatabase::SetCatalogTTL(std::chrono::seconds ttl)
+{
+	pimpl->catalog_ttl = std::chrono::duration_cast<std::chrono::steady_clock::duration>(ttl);
+}
+
+void CHyDatabase::RefreshCatalog()
+{
+	pimpl->LoadCatalog(true); // 刚修改过目录，副本可能还没同步
+}
+
+size_t CHyDatabase::StreamAllItemInfo(std::function<void(std::vector<HyItemInfo>)> on_rows, size_t batch)
+{
+	return pimpl->backend->StreamAllItemInfo(on_rows, batch);
+}
+
+boost::asio::awaitable<size_t> CHyDatabase::async_StreamAllItemInfo(std::function<void(std::vector<HyItemInfo>)> on_rows, size_t batch)
+{
+	co_return co_await pimpl->backend->async_StreamAllItemInfo(on_rows, batch);
+}
+
+size_t CHyDatabase::StreamUserOwnItemInfoByQQID(int64_t qqid, std::function<void(std::vector<HyUserOwnItemInfo>)> on_rows, size_t batch)
+{
+	return pimpl->backend->StreamUserOwnItemInfo("qq", std::to_string(qqid), on_rows, batch);
+}
+
+boost::asio::awaitable<size_t> CHyDatabase::async_StreamUserOwnItemInfoByQQID(int64_t qqid, std::function<void(std::vector<HyUserOwnItemInfo>)> on_rows, size_t batch)
+{
+	co_return co_await pimpl->backend->async_StreamUserOwnItemInfo("qq", std::to_string(qqid), on_rows, batch);
+}
+
+size_t CHyDatabase::StreamUserOwnItemInfoBySteamID(const std::string &steamid, std::function<void(std::vector<HyUserOwnItemInfo>)> on_rows, size_t batch)
+{
+	return pimpl->backend->StreamUserOwnItemInfo("steam", steamid, on_rows, batch);
+}
+
+boost::asio::awaitable<size_t> CHyDatabase::async_StreamUserOwnItemInfoBySteamID(const std::string &steamid, std::function<void(std::vector<HyUserOwnItemInfo>)> on_rows, size_t batch)
+{
+	co_return co_await pimpl->backend->async_StreamUserOwnItemInfo("steam", steamid, on_rows, batch);
 }
 
 std::vector<HyUserOwnItemInfo> CHyDatabase::QueryUserOwnItemInfoByQQID(int64_t qqid)
 {
-	return UserOwnItemInfoListFromSqlResult(pimpl->pool.acquire()->query(
-		"SELECT `code`, `name`, `desc`, `quantifier`, `amount` FROM iteminfo NATURAL JOIN ("
-			"SELECT code, CAST(SUM(amount) AS SIGNED INTEGER) AS amount FROM itemown NATURAL JOIN (SELECT idl1.idsrc, idl1.auth FROM idlink AS idl1 JOIN idlink AS idl2 ON idl1.uid = idl2.uid "
-			"WHERE idl2.idsrc = 'qq' AND idl2.auth = '" + std::to_string(qqid) + "' UNION (SELECT 'qq', '" + std::to_string(qqid) + "') ) AS idl GROUP BY code "
-		") AS itemlst;"
-	).read_all());
+	return pimpl->backend->UserOwnItemInfo("qq", std::to_string(qqid));
 }
 
 boost::asio::awaitable<std::vector<HyUserOwnItemInfo>> CHyDatabase::async_QueryUserOwnItemInfoByQQID(int64_t qqid)
 {
-	auto conn = pimpl->pool.acquire();
-    std::string sql(
-			"SELECT `code`, `name`, `desc`, `quantifier`, `amount` FROM iteminfo NATURAL JOIN ("
-			"SELECT code, CAST(SUM(amount) AS SIGNED INTEGER) AS amount FROM itemown NATURAL JOIN (SELECT idl1.idsrc, idl1.auth FROM idlink AS idl1 JOIN idlink AS idl2 ON idl1.uid = idl2.uid "
-			"WHERE idl2.idsrc = 'qq' AND idl2.auth = '" + std::to_string(qqid) + "' UNION (SELECT 'qq', '" + std::to_string(qqid) + "') ) AS idl GROUP BY code "
-			") AS itemlst;"
-		);
-    boost::mysql::tcp_resultset resultset = co_await conn->async_query(sql, boost::asio::use_awaitable);
-    std::vector<boost::mysql::row> res = co_await resultset.async_read_all(boost::asio::use_awaitable);
-    co_return UserOwnItemInfoListFromSqlResult(std::move(res));
+	co_return co_await pimpl->backend->async_UserOwnItemInfo("qq", std::to_string(qqid));
 }
 
 std::vector<HyUserOwnItemInfo> CHyDatabase::QueryUserOwnItemInfoBySteamID(const std::string &steamid) noexcept(false)
 {
-	return UserOwnItemInfoListFromSqlResult(pimpl->pool.acquire()->query(
-			"SELECT `code`, `name`, `desc`, `quantifier`, `amount` FROM iteminfo NATURAL JOIN ("
-			"SELECT code, CAST(SUM(amount) AS SIGNED INTEGER) AS amount FROM itemown NATURAL JOIN (SELECT idl1.idsrc, idl1.auth FROM idlink AS idl1 JOIN idlink AS idl2 ON idl1.uid = idl2.uid "
-			"WHERE idl2.idsrc = 'steam' AND idl2.auth = '" + steamid + "' UNION (SELECT 'steam', '" + steamid + "') ) AS idl GROUP BY code "
-			") AS itemlst;"
-	).read_all());
+	return pimpl->backend->UserOwnItemInfo("steam", steamid);
 }
 
 boost::asio::awaitable<std::vector<HyUserOwnItemInfo>> CHyDatabase::async_QueryUserOwnItemInfoBySteamID(const std::string &steamid)
 {
-	auto conn = pimpl->pool.acquire();
-    std::string sql(
-			"SELECT `code`, `name`, `desc`, `quantifier`, `amount` FROM iteminfo NATURAL JOIN ("
-			"SELECT code, CAST(SUM(amount) AS SIGNED INTEGER) AS amount FROM itemown NATURAL JOIN (SELECT idl1.idsrc, idl1.auth FROM idlink AS idl1 JOIN idlink AS idl2 ON idl1.uid = idl2.uid "
-			"WHERE idl2.idsrc = 'steam' AND idl2.auth = '" + steamid + "' UNION (SELECT 'steam', '" + steamid + "') ) AS idl GROUP BY code "
-			") AS itemlst;"
-	);
-    boost::mysql::tcp_resultset resultset = co_await conn->async_query(sql, boost::asio::use_awaitable);
-    std::vector<boost::mysql::row> res = co_await resultset.async_read_all(boost::asio::use_awaitable);
-    co_return UserOwnItemInfoListFromSqlResult(std::move(res));
+	co_return co_await pimpl->backend->async_UserOwnItemInfo("steam", steamid);
 }
 
-int32_t CHyDatabase::GetItemAmountByQQID(int64_t qqid, const std::string &code) noexcept(false)
+// 读出这组账号所有道具的合计数量，没有人在加载的话放进缓存
+std::unordered_map<std::string, int32_t> CHyDatabase::impl_t::LoadInventory(std::string_view idsrc, const std::string &auth)
 {
-	auto res = pimpl->pool.acquire()->query(
-			"SELECT CAST(SUM(amount) AS SIGNED INTEGER) AS amount FROM itemown NATURAL JOIN (SELECT idl1.idsrc, idl1.auth FROM idlink AS idl1 JOIN idlink AS idl2 ON idl1.uid = idl2.uid "
-			"WHERE idl2.idsrc = 'qq' AND idl2.auth = '" + std::to_string(qqid) + "' UNION (SELECT 'qq', '" + std::to_string(qqid) + "') ) AS idl WHERE `code` = '" + code + "';"
-	).read_all();
+	auto ids = backend->Identities(idsrc, auth);
+	uint64_t ticket = inventory_cache.begin_load(ids->identities);
+	try
+	{
+		auto amounts = backend->ItemAmounts(idsrc, auth, *ids);
+		if (ticket)
+			inventory_cache.finish_load(idsrc, auth, ticket, amounts);
+		return amounts;
+	}
+	catch (...)
+	{
+		if (ticket)
+			inventory_cache.abort_load(idsrc, auth, ticket);
+		throw;
+	}
+}
 
-	if (!res.empty()){
-		return visit(IntegerVisitor<int32_t>(), res[0].values()[0].to_variant());
+boost::asio::awaitable<std::unordered_map<std::string, int32_t>> CHyDatabase::impl_t::async_LoadInventory(std::string_view idsrc, const std::string &auth)
+{
+	auto ids = co_await backend->async_Identities(idsrc, auth);
+	uint64_t ticket = inventory_cache.begin_load(ids->identities);
+	std::unordered_map<std::string, int32_t> amounts;
+	std::exception_ptr e;
+	try
+	{
+		amounts = co_await backend->async_ItemAmounts(idsrc, auth, *ids);
 	}
-	return 0;
-}
-
-void CHyDatabase::async_GetItemAmountByQQID(int64_t qqid, const std::string& code, std::function<void(int32_t)> fn)
-{
-	auto conn = pimpl->pool.acquire();
-	auto sql = std::make_shared<std::string>(
-		"SELECT CAST(SUM(amount) AS SIGNED INTEGER) AS amount FROM itemown NATURAL JOIN (SELECT idl1.idsrc, idl1.auth FROM idlink AS idl1 JOIN idlink AS idl2 ON idl1.uid = idl2.uid "
-		"WHERE idl2.idsrc = 'steam' AND idl2.auth = '" + std::to_string(qqid) + "' UNION (SELECT 'qq', '" + std::to_string(qqid) + "') ) AS idl WHERE `code` = '" + code + "';"
-		);
-	conn->async_query(*sql, [fn, conn, sql](boost::system::error_code ec, boost::mysql::tcp_resultset&& resultset) {
-		if (ec || !resultset.valid())
-			return fn(0);
-		auto resultset_keep = std::make_shared<boost::mysql::tcp_resultset>(std::move(resultset));
-		resultset_keep->async_read_all([fn, conn, resultset_keep](boost::system::error_code ec, std::vector<boost::mysql::row> res) {
-			if (ec)
-				return fn(0);
-			return fn(!res.empty() ? visit(IntegerVisitor<int32_t>(), res[0].values()[0].to_variant()) : 0);
-			});
-		});
+	catch (...)
+	{
+		e = std::current_exception();
+	}
+	if (e)
+	{
+		if (ticket)
+			inventory_cache.abort_load(idsrc, auth, ticket);
+		std::rethrow_exception(e);
+	}
+	if (ticket)
+		inventory_cache.finish_load(idsrc, auth, ticket, amounts);
+	co_return amounts;
+}
+
+static int32_t AmountOf(const std::unordered_map<std::string, int32_t> &amounts, const std::string &code)
+{
+	auto iter = amounts.find(code);
+	return iter != amounts.end() ? iter->second : 0;
+}
+
+// 缓存命中时不需要访问存储
+int32_t CHyDatabase::impl_t::GetItemAmount(std::string_view idsrc, const std::string &auth, const std::string &code)
+{
+	const int32_t pending = pending_grants.peek(idsrc, auth, code);
+	if (auto cached = inventory_cache.amount(idsrc, auth, code))
+		return *cached + pending;
+	return AmountOf(LoadInventory(idsrc, auth), code) + pending;
+}
+
+int32_t CHyDatabase::GetItemAmountByQQID(int64_t qqid, const std::string &code) noexcept(false)
+{
+	return pimpl->GetItemAmount("qq", std::to_string(qqid), code);
+}
+
+boost::asio::awaitable<int32_t> CHyDatabase::impl_t::async_GetItemAmount(std::string_view idsrc, std::string auth, std::string code)
+{
+	const int32_t pending = pending_grants.peek(idsrc, auth, code);
+	if (auto cached = inventory_cache.amount(idsrc, auth, code))
+		co_return *cached + pending;
+	co_return AmountOf(co_await async_LoadInventory(idsrc, auth), code) + pending;
 }
 
 int32_t CHyDatabase::GetItemAmountBySteamID(const std::string &steamid, const std::string & code) noexcept(false)
 {
-	auto res = pimpl->pool.acquire()->query(
-			"SELECT CAST(SUM(amount) AS SIGNED INTEGER) AS amount FROM itemown NATURAL JOIN (SELECT idl1.idsrc, idl1.auth FROM idlink AS idl1 JOIN idlink AS idl2 ON idl1.uid = idl2.uid "
-			"WHERE idl2.idsrc = 'steam' AND idl2.auth = '" + steamid + "' UNION (SELECT 'steam', '" + steamid + "') ) AS idl WHERE `code` = '" + code + "';"
-	).read_all();
+	return pimpl->GetItemAmount("steam", steamid, code);
+}
 
-	if (!res.empty()){
-		return visit(IntegerVisitor<int32_t>(), res[0].values()[0].to_variant());
-	}
-	return 0;
-}
-
-void CHyDatabase::async_GetItemAmountBySteamID(const std::string& steamid, const std::string& code, std::function<void(int32_t)> fn)
-{
-	auto conn = pimpl->pool.acquire();
-	auto sql = std::make_shared<std::string>(
-		"SELECT CAST(SUM(amount) AS SIGNED INTEGER) AS amount FROM itemown NATURAL JOIN (SELECT idl1.idsrc, idl1.auth FROM idlink AS idl1 JOIN idlink AS idl2 ON idl1.uid = idl2.uid "
-		"WHERE idl2.idsrc = 'steam' AND idl2.auth = '" + steamid + "' UNION (SELECT 'steam', '" + steamid + "') ) AS idl WHERE `code` = '" + code + "';"
-		);
-	conn->async_query(*sql, [fn, conn, sql](boost::system::error_code ec, boost::mysql::tcp_resultset&& resultset) {
-		if (ec || !resultset.valid())
-			return fn(0);
-		auto resultset_keep = std::make_shared<boost::mysql::tcp_resultset>(std::move(resultset));
-		resultset_keep->async_read_all([fn, conn, resultset_keep](boost::system::error_code ec, std::vector<boost::mysql::row> res) {
-			if (ec)
-				return fn(0);
-			return fn(!res.empty() ? visit(IntegerVisitor<int32_t>(), res[0].values()[0].to_variant()) : 0);
-		});
-	});
+boost::asio::awaitable<int32_t> CHyDatabase::GetItemAmountTask(std::string_view idsrc, std::string auth, std::string code)
+{
+	return pimpl->async_GetItemAmount(idsrc, std::move(auth), std::move(code));
+}
+
+boost::asio::awaitable<bool> CHyDatabase::impl_t::async_GiveItem(std::string_view idsrc, std::string auth, std::string code, int add_amount)
+{
+	HyInventoryCache::write_guard guard(inventory_cache, idsrc, auth);
+	bool result = co_await backend->async_GiveItem(idsrc, auth, code, add_amount);
+	inventory_cache.add(idsrc, auth, code, add_amount);
+	co_return result;
 }
 
 bool CHyDatabase::GiveItemByQQID(int64_t qqid, const std::string & code, int add_amount)
 {
-    auto conn = pimpl->pool.acquire();
-    conn->query("INSERT IGNORE INTO itemown(idsrc, auth, code, amount) VALUES('qq', '" + std::to_string(qqid) + "', '" + code + "', '0');");
-	return conn->query("UPDATE itemown SET `amount`=`amount`+'" + std::to_string(add_amount) + "' WHERE `idsrc` = 'qq' AND `auth` ='" + std::to_string(qqid) + "' AND `code` = '" + code + "'").affected_rows() > 0;
+	const std::string auth = std::to_string(qqid);
+	HyInventoryCache::write_guard guard(pimpl->inventory_cache, "qq", auth);
+	bool result = pimpl->backend->GiveItem("qq", auth, code, add_amount);
+	pimpl->inventory_cache.add("qq", auth, code, add_amount);
+	return result;
 }
 
-void CHyDatabase::async_GiveItemByQQID(int64_t qqid, const std::string &code, int add_amount, std::function<void(bool success)> fn)
+bool CHyDatabase::GiveItemBySteamID(const std::string &steamid, const std::string & code, int add_amount)
 {
-	auto conn = pimpl->pool.acquire();
-	auto sql1 = std::make_shared<std::string>("INSERT IGNORE INTO itemown(idsrc, auth, code, amount) VALUES('qq', '" + std::to_string(qqid) + "', '" + code + "', '0'); ");
-	auto sql2 = std::make_shared<std::string>("UPDATE itemown SET `amount`=`amount`+'" + std::to_string(add_amount) + "' WHERE `idsrc` = 'qq' AND `auth` ='" + std::to_string(qqid) + "' AND `code` = '" + code + "'");
+	HyInventoryCache::write_guard guard(pimpl->inventory_cache, "steam", steamid);
+	bool result = pimpl->backend->GiveItem("steam", steamid, code, add_amount);
+	pimpl->inventory_cache.add("steam", steamid, code, add_amount);
+	return result;
+}
 
-	conn->async_query(*sql1, [fn, conn, sql1, sql2](boost::system::error_code ec, boost::mysql::tcp_resultset &&resultset){
-		if (ec || !resultset.valid())
-			return fn(false);
-		conn->async_query(*sql2, [fn, conn, sql2](boost::system::error_code ec, boost::mysql::tcp_resultset &&resultset){
-			fn(!ec && resultset.affected_rows() > 0);
-		});
-	});
+template<class T>
+static boost::asio::awaitable<T> Ready(T value)
+{
+	co_return value;
 }
 
-bool CHyDatabase::GiveItemBySteamID(const std::string &steamid, const std::string & code, int add_amount)
+// 延迟写入的增量在调用时就放进队列，保证和之后的查询、扣除的顺序
+boost::asio::awaitable<bool> CHyDatabase::GiveItemTask(std::string_view idsrc, std::string auth, std::string code, int add_amount)
 {
-    auto conn = pimpl->pool.acquire();
-    conn->query("INSERT IGNORE INTO itemown(idsrc, auth, code, amount) VALUES('steam', '" + steamid + "', '" + code + "', '0'); ");
-	return conn->query("UPDATE itemown SET `amount`=`amount`+'" + std::to_string(add_amount) + "' WHERE `idsrc` = 'steam' AND `auth` ='" + steamid + "' AND `code` = '" + code + "'").affected_rows() > 0;
+	if (pimpl->write_behind)
+	{
+		pimpl->AddPendingGrant(std::string(idsrc), auth, code, add_amount);
+		return Ready(true);
+	}
+	return pimpl->async_GiveItem(idsrc, std::move(auth), std::move(code), add_amount);
 }
 
-void CHyDatabase::async_GiveItemBySteamID(const std::string &steamid, const std::string &code, int add_amount, std::function<void(bool success)> fn)
+boost::asio::awaitable<std::vector<HyGrantResult>> CHyDatabase::impl_t::async_GiveItemsBatch(std::vector<HyItemGrant> grants)
 {
-	auto conn = pimpl->pool.acquire();
-	auto sql1 = std::make_shared<std::string>("INSERT IGNORE INTO itemown(idsrc, auth, code, amount) VALUES('steam', '" + steamid + "', '" + code + "', '0'); ");
-	auto sql2 = std::make_shared<std::string>("UPDATE itemown SET `amount`=`amount`+'" + std::to_string(add_amount) + "' WHERE `idsrc` = 'steam' AND `auth` ='" + steamid + "' AND `code` = '" + code + "'");
+	// 同一个人同一种道具合并成一行
+	std::vector<HyItemGrant> merged;
+	std::vector<std::vector<size_t>> sources;
+	std::map<std::tuple<std::string_view, std::string_view, std::string_view>, size_t> index;
+	for (size_t i = 0; i < grants.size(); ++i)
+	{
+		const auto &g = grants[i];
+		auto [iter, inserted] = index.try_emplace({ g.idsrc, g.auth, g.code }, merged.size());
+		if (inserted)
+		{
+			merged.push_back({ g.idsrc, g.auth, g.code, 0 });
+			sources.emplace_back();
+		}
+		merged[iter->second].add_amount += g.add_amount;
+		sources[iter->second].push_back(i);
+	}
 
-	conn->async_query(*sql1, [fn, conn, sql1, sql2](boost::system::error_code ec, boost::mysql::tcp_resultset &&resultset){
-		if (ec || !resultset.valid())
-			return fn(false);
-		conn->async_query(*sql2, [fn, conn, sql2](boost::system::error_code ec, boost::mysql::tcp_resultset &&resultset){
-			fn(!ec && resultset.affected_rows() > 0);
-		});
-	});
+	std::vector<HyGrantResult> result(grants.size(), HyGrantResult::failed);
+	if (merged.empty())
+		co_return result;
+
+	std::deque<HyInventoryCache::write_guard> guards;
+	for (auto &g : merged)
+		guards.emplace_back(inventory_cache, g.idsrc, g.auth);
+	auto outcome = co_await backend->async_GiveItems(merged);
+	for (size_t i = 0; i < merged.size(); ++i)
+	{
+		if (outcome[i] == HyGrantResult::applied)
+			inventory_cache.add(merged[i].idsrc, merged[i].auth, merged[i].code, merged[i].add_amount);
+		else if (outcome[i] == HyGrantResult::unknown)
+			inventory_cache.evict(merged[i].idsrc, merged[i].auth); // 不知道写没写进去，下次重新加载
+		for (size_t source : sources[i])
+			result[source] = outcome[i];
+	}
+	co_return result;
 }
 
-bool CHyDatabase::ConsumeItemBySteamID(const std::string &steamid, const std::string & code, int sub_amount)
+boost::asio::awaitable<std::vector<bool>> CHyDatabase::GiveItemsBatchTask(std::vector<HyItemGrant> grants)
 {
-    auto conn = pimpl->pool.acquire();
-	if(conn->query("UPDATE itemown SET `amount` = `amount` - '" + std::to_string(sub_amount) + "' WHERE `idsrc` = 'steam' AND `auth` = '" + steamid + "' AND `code` = '" + code + "' AND `amount` > '" + std::to_string(sub_amount) + "'; ").affected_rows() == 1)
-		return true;
+	auto outcome = co_await pimpl->async_GiveItemsBatch(std::move(grants));
+	std::vector<bool> result(outcome.size());
+	for (size_t i = 0; i < outcome.size(); ++i)
+		result[i] = outcome[i] == HyGrantResult::applied;
+	co_return result;
+}
 
-	int iHasAmount = GetItemAmountBySteamID(steamid, code);
-	if(iHasAmount < sub_amount)
+bool CHyDatabase::ConsumeItemBySteamID(const std::string &steamid, const std::string & code, int sub_amount)
+{
+	const std::string_view idsrc = "steam";
+	HyInventoryCache::write_guard guard(pimpl->inventory_cache, idsrc, steamid);
+	// 这一项正在批量写入时先等它写完，否则存储里还没有这部分，够扣的也会扣除失败
+	while (pimpl->pending_grants.in_flight(idsrc, steamid, code))
+		pimpl->FlushWriteBehind();
+	if (int32_t pending = pimpl->pending_grants.take(idsrc, steamid, code))
+	{
+		try
+		{
+			pimpl->backend->GiveItem(idsrc, steamid, code, pending);
+			pimpl->inventory_cache.add(idsrc, steamid, code, pending);
+		}
+		catch (...)
+		{
+			pimpl->pending_grants.add(std::string(idsrc), steamid, code, pending);
+			throw;
+		}
+	}
+	auto consumed = pimpl->backend->ConsumeItem(idsrc, steamid, code, sub_amount);
+	if (!consumed)
 		return false;
-	iHasAmount -= sub_amount;
-    conn->query("DELETE FROM itemown WHERE (itemown.idsrc, itemown.auth) IN (SELECT idl0.idsrc AS idsrc, idl0.auth AS auth FROM idlink AS idl0 JOIN idlink AS idl1 ON idl0.uid = idl1.uid WHERE idl1.idsrc = 'steam' AND idl1.auth = '" + steamid + "') AND `code` = '" + code + "';");
-	return GiveItemBySteamID(steamid, code, static_cast<unsigned>(iHasAmount));
-}
-
-void CHyDatabase::async_ConsumeItemBySteamID(const std::string& steamid, const std::string& code, int sub_amount, std::function<void(bool success)> fn)
-{
-	auto ioc = pimpl->ioc;
-	auto conn = pimpl->pool.acquire();
-	auto sql1 = std::make_shared<std::string>("UPDATE itemown SET `amount` = `amount` - '" + std::to_string(sub_amount) + "' WHERE `idsrc` = 'steam' AND `auth` = '" + steamid + "' AND `code` = '" + code + "' AND `amount` > '" + std::to_string(sub_amount) + "'; ");
-	conn->async_query(*sql1, [fn, conn, steamid, code, sql1, sub_amount](boost::system::error_code ec, boost::mysql::tcp_resultset&& resultset) {
-		if (ec || !resultset.valid())
-			return fn(false);
-		
-		if (resultset.affected_rows() > 0)
-			return fn(true);
-
-		HyDatabase().async_GetItemAmountBySteamID(steamid, code, [fn, conn, steamid, code, sub_amount](int32_t iHasAmount) {
-			iHasAmount -= sub_amount;
-			auto sql2 = std::make_shared<std::string>("DELETE FROM itemown WHERE (itemown.idsrc, itemown.auth) IN (SELECT idl0.idsrc AS idsrc, idl0.auth AS auth FROM idlink AS idl0 JOIN idlink AS idl1 ON idl0.uid = idl1.uid WHERE idl1.idsrc = 'steam' AND idl1.auth = '" + steamid + "') AND `code` = '" + code + "';");
-			conn->async_query(*sql2, [fn, conn, steamid, code, sql2, iHasAmount](boost::system::error_code ec, boost::mysql::tcp_resultset&& resultset) {
-				HyDatabase().async_GiveItemBySteamID(steamid, code, iHasAmount, fn);
-			});
-		});
-	});
+	if (consumed->merged)
+		pimpl->inventory_cache.evict(idsrc, steamid); // remain是事务里的值，可能已经被别的写入超过
+	else
+		pimpl->inventory_cache.add(idsrc, steamid, code, -sub_amount);
+	return true;
+}
+
+boost::asio::awaitable<std::optional<int32_t>> CHyDatabase::impl_t::async_ConsumeItem(std::string_view idsrc, std::string auth, std::string code, int sub_amount)
+{
+	co_await async_FlushPendingGrant(idsrc, auth, code);
+	HyInventoryCache::write_guard guard(inventory_cache, idsrc, auth);
+	auto consumed = co_await backend->async_ConsumeItem(idsrc, auth, code, sub_amount);
+	if (!consumed)
+		co_return std::nullopt;
+	if (consumed->merged)
+		inventory_cache.evict(idsrc, auth);
+	else
+		inventory_cache.add(idsrc, auth, code, -sub_amount);
+	co_return consumed->remain;
+}
+
+boost::asio::awaitable<bool> CHyDatabase::ConsumeItemTask(std::string_view idsrc, std::string auth, std::string code, int sub_amount)
+{
+	co_return (co_await pimpl->async_ConsumeItem(idsrc, std::move(auth), std::move(code), sub_amount)).has_value();
+}
+
+boost::asio::io_context &CHyDatabase::Context()
+{
+	return *pimpl->ioc;
+}
+
+boost::asio::io_context &CHyDatabase::SpawnContext(boost::asio::execution_context &preferred)
+{
+	if (auto context = pimpl->backend->ContextFor(preferred))
+		return *context;
+	return *pimpl->ioc;
+}
+
+// 存储层在一个事务里完成签到和发奖励，这里只需要补上还没写入的增量并更新缓存
+boost::asio::awaitable<std::pair<HyUserSignResultType, std::optional<HyUserSignResult>>> CHyDatabase::impl_t::async_DailySign(int64_t qqid_value, bool op)
+{
+	const std::string_view idsrc = "qq";
+	const std::string qqid = std::to_string(qqid_value);
+
+	// 事务里读到的合计数量可能已经被之后的写入超过，缓存只加上这次的增量
+	HyInventoryCache::write_guard guard(inventory_cache, idsrc, qqid);
+	auto outcome = co_await backend->async_DailySign(qqid_value, op);
+	if (outcome.type == HyUserSignResultType::success)
+	{
+		for (auto &info : outcome.result->vecItems)
+			info.cur_amount += pending_grants.peek(idsrc, qqid, info.item.code);
+		for (auto &[code, amount] : outcome.added)
+			inventory_cache.add(idsrc, qqid, code, amount);
+	}
+	co_return std::make_pair(outcome.type, std::move(outcome.result));
 }
 
 boost::asio::awaitable<std::pair<HyUserSignResultType, std::optional<HyUserSignResult>>> CHyDatabase::async_DoUserDailySign(const HyUserAccountData &user)
 {
 	if(!user.qqid)
 		throw InvalidUserAccountDataException();
+	co_return co_await pimpl->async_DailySign(user.qqid, user.access.find('o') != std::string::npos);
+}
 
-	auto ioc = pimpl->ioc;
-    auto conn = pimpl->pool.acquire();
-    auto pro = std::make_shared<std::promise<std::pair<HyUserSignResultType, std::optional<HyUserSignResult>>>>();
-
-    int rewardmultiply = 1;
-    int signcount = 0;
-
-    // 判断是否重复签到
-    {
-        auto res = co_await (co_await conn->async_query("SELECT TO_DAYS(NOW()) - TO_DAYS(`signdate`) AS signdelta, `signcount` FROM qqevent WHERE `qqid` ='" + std::to_string(user.qqid) + "';", boost::asio::use_awaitable)).async_read_all(boost::asio::use_awaitable);
-        if (!res.empty())
-        {
-            int signdelta = visit(IntegerVisitor<int>(), res[0].values()[0].to_variant());
-
-            if (!res[0].values()[0].is_null() && signdelta == 0 )
-            {
-                // 已经签到过
-                co_return std::pair<HyUserSignResultType, std::optional<HyUserSignResult>>{ HyUserSignResultType::failure_already_signed , std::nullopt };
-            }
-            if (signdelta == 1)
-                signcount = visit(IntegerVisitor<int>(), res[0].values()[1].to_variant());
-            co_await conn->async_query("UPDATE qqevent SET `signdate`=NOW(), `signcount`='" + std::to_string(signcount + 1) + "' WHERE `qqid`='" + std::to_string(user.qqid) + "';", boost::asio::use_awaitable);
-        }
-        else
-        {
-            co_await conn->async_query("INSERT INTO qqevent(qqid) VALUES('" + std::to_string(user.qqid) + "');", boost::asio::use_awaitable);
-        }
-    }
-
-    // 计算签到名次
-    boost::mysql::tcp_resultset res = co_await conn->async_query("SELECT COUNT(*) FROM qqevent WHERE TO_DAYS(`signdate`) = TO_DAYS(NOW());", boost::asio::use_awaitable);
-    int rank = visit(IntegerVisitor(), (co_await res.async_read_all(boost::asio::use_awaitable))[0].values()[0].to_variant());
-
-    if (rank == 1)
-        rewardmultiply *= 3;
-    else if (rank == 2)
-        rewardmultiply *= 5;
-    else if (rank == 3)
-        rewardmultiply *= 0;
-    else if (rank == 4)
-        rewardmultiply *= 7;
-    else if (rank == 9)
-        rewardmultiply *= 0;
-    else if (rank == 10)
-        rewardmultiply *= 2;
-
-    if (user.access.find('o') != std::string::npos)
-        rewardmultiply *= 3;
-
-    ++signcount;
-
-    // 填充签到奖励表
-    std::vector<std::pair<HyItemInfo, int32_t>> awards;
-    auto res2 = co_await (co_await conn->async_query("SELECT `code`, `name`, `desc`, `quantifier`, `amount` FROM itemaward NATURAL JOIN iteminfo WHERE '" + std::to_string(signcount) + "' BETWEEN `minfrags` AND `maxfrags`;", boost::asio::use_awaitable)).async_read_all(boost::asio::use_awaitable);
-
-    for(auto & l : res2)
-    {
-        HyItemInfo item = HyItemInfoFromSqlLine(l.values());
-
-        int add_amount = visit(IntegerVisitor(), l.values()[4].to_variant());
-
-        awards.emplace_back(std::move(item), add_amount);
-    }
-
-    auto f = [&awards, &user]() -> HyUserSignGetItemInfo {
-        // 随机选择签到奖励
-        std::random_device rd;
-        std::uniform_int_distribution<std::size_t> rg(0, awards.size() - 1);
-
-        auto &reward = awards[rg(rd)];
-        auto &item = reward.first;
-        auto add_amount = reward.second;
-
-        // 查询已有数量
-        auto cur_amount = HyDatabase().GetItemAmountByQQID(user.qqid, item.code);
-        cur_amount += add_amount;
-        return HyUserSignGetItemInfo{ item, add_amount, cur_amount };
-    };
-    std::vector<HyUserSignGetItemInfo> vecItems(rewardmultiply);
-    std::generate(vecItems.begin(), vecItems.end(), f);
-
-    // 设置新奖励
-    for(auto &info : vecItems)
-    {
-        co_await conn->async_query("INSERT IGNORE INTO itemown(idsrc, auth, code, amount) VALUES('qq', '" + std::to_string(user.qqid) + "', '" + info.item.code + "', '0');", boost::asio::use_awaitable);
-        bool result = (co_await conn->async_query("UPDATE itemown SET `amount`=`amount`+'" + std::to_string(info.add_amount) + "' WHERE `idsrc` = 'qq' AND `auth` ='" + std::to_string(user.qqid) + "' AND `code` = '" + info.item.code + "'", boost::asio::use_awaitable)).affected_rows() > 0;
-    }
-    co_return std::pair<HyUserSignResultType, std::optional<HyUserSignResult>>{ HyUserSignResultType::success, HyUserSignResult{ rank, signcount, rewardmultiply, std::move(vecItems)} };
+void CHyDatabase::impl_t::AddPendingGrant(const std::string &idsrc, const std::string &auth, const std::string &code, int32_t delta)
+{
+	if (pending_grants.add(idsrc, auth, code, delta) >= write_behind_options.flush_size && !flush_scheduled.exchange(true))
+		boost::asio::co_spawn(*ioc, async_FlushWriteBehind(), boost::asio::detached);
 }
 
-boost::asio::awaitable<std::vector<HyShopEntry>> CHyDatabase::async_QueryShopEntry()
+// 这一项正在批量写入时等它写完；等的时候可能又开始了新的一次，直到没有为止
+boost::asio::awaitable<void> CHyDatabase::impl_t::async_WaitInFlightGrant(std::string_view idsrc, const std::string &auth, const std::string &code)
 {
-	auto ioc = pimpl->ioc;
-	auto conn = pimpl->pool.acquire();
+	while (pending_grants.in_flight(idsrc, auth, code))
+		co_await async_FlushWriteBehind();
+}
 
-    auto code_to_item = [&conn](const std::string &code) -> boost::asio::awaitable<HyItemInfo> {
-        co_return HyItemInfoFromSqlLine(
-                (co_await (co_await conn->async_query("SELECT `code`, `name`, `desc`, `quantifier` FROM iteminfo WHERE `code` = '" + code + "';", boost::asio::use_awaitable)).async_read_all(boost::asio::use_awaitable)).front().values()
-        );
-    };
+// 扣除之前先把这一项还没写入的增量写进去，失败时放回队列
+boost::asio::awaitable<void> CHyDatabase::impl_t::async_FlushPendingGrant(std::string_view idsrc, const std::string &auth, const std::string &code)
+{
+	co_await async_WaitInFlightGrant(idsrc, auth, code);
+	int32_t pending = pending_grants.take(idsrc, auth, code);
+	if (!pending)
+		co_return;
+	HyInventoryCache::write_guard guard(inventory_cache, idsrc, auth);
+	std::exception_ptr e;
+	try
+	{
+		co_await backend->async_GiveItem(idsrc, auth, code, pending);
+		inventory_cache.add(idsrc, auth, code, pending);
+	}
+	catch (...)
+	{
+		e = std::current_exception();
+	}
+	if (e)
+	{
+		pending_grants.add(std::string(idsrc), auth, code, pending);
+		std::rethrow_exception(e);
+	}
+}
+
+boost::asio::awaitable<void> CHyDatabase::impl_t::async_FlushWriteBehind()
+{
+	co_await flush_flight.async_run(0, [this] { return async_FlushOnce(); });
+}
+
+boost::asio::awaitable<bool> CHyDatabase::impl_t::async_FlushOnce()
+{
+	flush_scheduled = false;
+	auto grants = pending_grants.drain();
+	if (grants.empty())
+		co_return true;
+
+	std::vector<HyGrantResult> outcome;
+	try
+	{
+		outcome = co_await async_GiveItemsBatch(grants);
+	}
+	catch (...)
+	{
+		// 存储层只在发出语句之前抛出（取不到连接等），全部放回去；这里不会被取消
+		outcome.assign(grants.size(), HyGrantResult::failed);
+	}
+
+	// 结果未知的可能已经写入，重试会重复发放，只放回确定没有写入的
+	std::vector<bool> requeue(grants.size());
+	for (size_t i = 0; i < grants.size(); ++i)
+		requeue[i] = outcome[i] == HyGrantResult::failed;
+	pending_grants.settle(grants, requeue);
+
+	if (write_behind_options.on_flush)
+		write_behind_options.on_flush(grants, outcome);
+	co_return true;
+}
+
+boost::asio::awaitable<void> CHyDatabase::impl_t::async_FlushLoop()
+{
+	while (write_behind)
+	{
+		flush_timer.expires_after(write_behind_options.flush_interval);
+		boost::system::error_code ec;
+		co_await flush_timer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+		if (ec)
+			co_return;
+		co_await async_FlushWriteBehind();
+	}
+}
+
+void CHyDatabase::impl_t::FlushWriteBehind()
+{
+	// 赶上正在进行的那一次时，它是在这次调用之前取出的，之后积累的还要再写一次
+	boost::asio::co_spawn(*ioc, [this]() -> boost::asio::awaitable<void> {
+		co_await async_FlushWriteBehind();
+		if (pending_grants.size())
+			co_await async_FlushWriteBehind();
+	}, boost::asio::use_future).get();
+}
+
+void CHyDatabase::EvictPlayerInventory(int64_t qqid)
+{
+	pimpl->inventory_cache.evict("qq", std::to_string(qqid));
+}
 
-    std::vector<boost::mysql::row> shopres = co_await (co_await conn->async_query(
-        "SELECT `shopid`, `target_code`, `target_amount`, `exchange_code`, `exchange_amount` FROM itemshop;"
-        , boost::asio::use_awaitable)).async_read_all(boost::asio::use_awaitable);
+void CHyDatabase::EvictPlayerInventory(const std::string &steamid)
+{
+	pimpl->inventory_cache.evict("steam", steamid);
+}
 
-    std::vector<HyShopEntry> result;
-    for(const boost::mysql::row &l : shopres)
-    {
-        HyShopEntry item {
-            visit(IntegerVisitor(), l.values()[0].to_variant()),
-            co_await code_to_item(visit(StringVisitor(), l.values()[1].to_variant())),
-            visit(IntegerVisitor(), l.values()[2].to_variant()),
-            co_await code_to_item(visit(StringVisitor(), l.values()[3].to_variant())),
-            visit(IntegerVisitor(), l.values()[4].to_variant())
-        };
-        result.push_back(item);
-    }
+void CHyDatabase::EnableWriteBehind(HyWriteBehindOptions options)
+{
+	if (pimpl->write_behind)
+		return;
+	pimpl->write_behind_options = std::move(options);
+	pimpl->write_behind = true;
+	boost::asio::co_spawn(*pimpl->ioc, pimpl->async_FlushLoop(), boost::asio::detached);
+}
 
-    co_return result;
+void CHyDatabase::FlushWriteBehind()
+{
+	pimpl->FlushWriteBehind();
 }
 
-void CHyDatabase::Start()
+void CHyDatabase::Start(HyBackendType type)
 {
-	pimpl->pool.reserve(3);
+	if (type == HyBackendType::memory)
+		pimpl->backend = std::make_unique<HyMemoryBackend>();
+	pimpl->Start();
+}
+
+void CHyDatabase::Start(const DatabaseConfig &config)
+{
+	pimpl->backend = std::make_unique<HyMySqlBackend>(config);
+	pimpl->Start();
+}
+
+void CHyDatabase::impl_t::Start()
+{
+	backend->Start();
+	try
+	{
+		LoadCatalog();
+	}
+	catch (const boost::system::system_error &)
+	{
+		// 第一次查询时再加载
+	}
 }
 
 void CHyDatabase::Hibernate()
 {
-	pimpl->pool.clear();
+	FlushWriteBehind();
+	pimpl->backend->Hibernate();
+}
+
+// 主库和副本合计，内存存储没有连接池，全是0
+MySqlPoolSnapshot CHyDatabase::PoolMetrics()
+{
+	return pimpl->backend->Metrics();
+}
+
+void CHyDatabase::SetQueryTrace(MySqlQueryTraceOptions options)
+{
+	pimpl->backend->SetQueryTrace(std::move(options));
+}
+
+MySqlQueryTraceSnapshot CHyDatabase::QueryTrace()
+{
+	return pimpl->backend->QueryTrace();
+}
+
+HyMemoryBackend *CHyDatabase::MemoryBackend()
+{
+	return dynamic_cast<HyMemoryBackend *>(pimpl->backend.get());
 }
\ No newline at end of file
@@ -5,12 +5,25 @@
 #include <chrono>
 #include <optional>
 #include <vector>
+#include <span>
 #include <future>
 #include <functional>
 #include <stdexcept>
 #include <system_error>
 
+#include <boost/asio/async_result.hpp>
 #include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/version.hpp>
+#if BOOST_VERSION >= 107700
+#include <boost/asio/associated_cancellation_slot.hpp>
+#include <boost/asio/bind_cancellation_slot.hpp>
+#endif
+
+#include "MySqlPoolMetrics.h"
+#include "MySqlQueryTrace.h"
 
 struct HyUserAccountData
 {
@@ -42,6 +55,34 @@ struct HyUserOwnItemInfo
 	int32_t amount;
 };
 
+// 批量赠送的一项
+struct HyItemGrant
+{
+	std::string idsrc = "steam"; // qq / steam / name
+	std::string auth;
+	std::string code;
+	int32_t add_amount = 0;
+};
+
+// 批量写入时每一项的结果
+enum class HyGrantResult
+{
+	applied, // 已经写入
+	unchanged, // 语句执行了但这一行没有变化（已有的一行加0）
+	failed, // 确定没有写入（服务器拒绝或者没有发出去），可以重试
+	unknown, // 超时或者连接断开时语句可能已经执行了，重试可能重复发放
+};
+
+// 道具增量延迟合并写入的设置
+struct HyWriteBehindOptions
+{
+	size_t flush_size = 512; // 积累这么多项(idsrc, auth, code)就立即写入
+	std::chrono::milliseconds flush_interval{ 1000 }; // 最多积累这么久
+	// 每次写入之后调用，result和grants一一对应
+	// failed的项会放回队列下次重试；unknown的可能已经写入，不会重试，由这里决定怎么处理（比如记日志对账）
+	std::function<void(const std::vector<HyItemGrant> &grants, const std::vector<HyGrantResult> &result)> on_flush;
+};
+
 struct HyUserSignGetItemInfo
 {
 	HyItemInfo item;
@@ -73,6 +114,16 @@ struct HyShopEntry
 	int exchange_amount;
 };
 
+// CHyDatabase下面用哪种存储
+enum class HyBackendType
+{
+	mysql, // 见DatabaseConfig
+	memory, // 进程内，不持久化，给测试和性能测试用
+};
+
+class HyMemoryBackend;
+struct DatabaseConfig;
+
 class InvalidUserAccountDataException : std::invalid_argument {
 public:
 	InvalidUserAccountDataException() : std::invalid_argument("InvalidUserAccountDataException : 此账号未注册。") {}
@@ -99,6 +150,11 @@ public:
 	HyUserAccountData QueryUserAccountDataBySteamID(const std::string &steamid) noexcept(false); // 可能抛出InvalidUserAccountDataException
     boost::asio::awaitable<HyUserAccountData> async_QueryUserAccountDataBySteamID(const std::string &steamid);
 
+	// 账号信息会缓存几分钟（查不到的缓存几秒），同一账号的并发查询共用一次数据库查询
+	// 本库里修改账号的接口会自动失效，在其他地方修改了账号后需要手动调用
+	void InvalidateUserAccountData(int64_t qqid);
+	void InvalidateUserAccountData(const std::string &steamid);
+
 	// CS1.6支持
 	bool UpdateXSCodeByQQID(int64_t qqid, int32_t xscode);
 	bool BindQQToCS16Name(int64_t qqid, int32_t xscode);
@@ -119,38 +175,166 @@ public:
 	std::vector<HyUserOwnItemInfo> QueryUserOwnItemInfoBySteamID(const std::string &steamid);
     boost::asio::awaitable<std::vector<HyUserOwnItemInfo>>  async_QueryUserOwnItemInfoBySteamID(const std::string &steamid);
 
+	// 上面几个的流式版本，给需要列出大量数据的管理工具用，返回总行数
+	// 每从数据库读到最多batch行就转换好交给on_rows，期间一直占着一个连接，on_rows里不要阻塞太久
+	// 道具列表直接读iteminfo表，不经过目录缓存
+	size_t StreamAllItemInfo(std::function<void(std::vector<HyItemInfo> rows)> on_rows, size_t batch = 256);
+	boost::asio::awaitable<size_t> async_StreamAllItemInfo(std::function<void(std::vector<HyItemInfo> rows)> on_rows, size_t batch = 256);
+	size_t StreamUserOwnItemInfoByQQID(int64_t qqid, std::function<void(std::vector<HyUserOwnItemInfo> rows)> on_rows, size_t batch = 256);
+	boost::asio::awaitable<size_t> async_StreamUserOwnItemInfoByQQID(int64_t qqid, std::function<void(std::vector<HyUserOwnItemInfo> rows)> on_rows, size_t batch = 256);
+	size_t StreamUserOwnItemInfoBySteamID(const std::string &steamid, std::function<void(std::vector<HyUserOwnItemInfo> rows)> on_rows, size_t batch = 256);
+	boost::asio::awaitable<size_t> async_StreamUserOwnItemInfoBySteamID(const std::string &steamid, std::function<void(std::vector<HyUserOwnItemInfo> rows)> on_rows, size_t batch = 256);
+
+	// 以下async_*接受任意asio完成令牌（回调、use_awaitable、use_future等），完成签名是void(结果)
+	// 出错时和原来的回调接口一样给出0或false，回调在它关联的executor上执行
+	// Boost 1.77以上可以给令牌绑定取消槽，取消时正在进行的查询被中断，用到的连接会被丢弃重建
+
 	// 根据qqid查询名下某道具数量
 	int32_t GetItemAmountByQQID(int64_t qqid, const std::string & code) noexcept(false);
-	void async_GetItemAmountByQQID(int64_t qqid, const std::string& code, std::function<void(int32_t)> fn);
+	template<class CompletionToken>
+	auto async_GetItemAmountByQQID(int64_t qqid, const std::string &code, CompletionToken &&token)
+	{
+		return boost::asio::async_initiate<CompletionToken, void(int32_t)>([this](auto handler, int64_t qqid, const std::string &code) {
+			Launch(GetItemAmountTask("qq", std::to_string(qqid), code), std::move(handler), 0);
+		}, token, qqid, code);
+	}
 
 	// 根据steamid查询名下某道具数量
 	int32_t GetItemAmountBySteamID(const std::string &steamid, const std::string & code) noexcept(false);
-	void async_GetItemAmountBySteamID(const std::string& steamid, const std::string& code, std::function<void(int32_t)> fn);
+	template<class CompletionToken>
+	auto async_GetItemAmountBySteamID(const std::string &steamid, const std::string &code, CompletionToken &&token)
+	{
+		return boost::asio::async_initiate<CompletionToken, void(int32_t)>([this](auto handler, const std::string &steamid, const std::string &code) {
+			Launch(GetItemAmountTask("steam", steamid, code), std::move(handler), 0);
+		}, token, steamid, code);
+	}
+
+	// 道具数量会按玩家（包括绑定的账号）缓存，玩家离开服务器时调用可以提前释放
+	void EvictPlayerInventory(int64_t qqid);
+	void EvictPlayerInventory(const std::string &steamid);
 
 	// 给玩家qqid赠送道具
 	bool GiveItemByQQID(int64_t qqid, const std::string & code, int add_amount);
-	void async_GiveItemByQQID(int64_t qqid, const std::string & code, int add_amount, std::function<void(bool success)> fn);
+	template<class CompletionToken>
+	auto async_GiveItemByQQID(int64_t qqid, const std::string &code, int add_amount, CompletionToken &&token)
+	{
+		return boost::asio::async_initiate<CompletionToken, void(bool)>([this](auto handler, int64_t qqid, const std::string &code, int add_amount) {
+			Launch(GiveItemTask("qq", std::to_string(qqid), code, add_amount), std::move(handler), false);
+		}, token, qqid, code, add_amount);
+	}
 
 	// 给玩家steamid赠送道具
 	bool GiveItemBySteamID(const std::string &steamid, const std::string & code, int add_amount);
-	void async_GiveItemBySteamID(const std::string &steamid, const std::string & code, int add_amount, std::function<void(bool success)> fn);
+	template<class CompletionToken>
+	auto async_GiveItemBySteamID(const std::string &steamid, const std::string &code, int add_amount, CompletionToken &&token)
+	{
+		return boost::asio::async_initiate<CompletionToken, void(bool)>([this](auto handler, const std::string &steamid, const std::string &code, int add_amount) {
+			Launch(GiveItemTask("steam", steamid, code, add_amount), std::move(handler), false);
+		}, token, steamid, code, add_amount);
+	}
+
+	// 批量赠送道具（比如回合结束给所有玩家发奖励），在一个连接上用几条多行语句完成
+	// 结果和grants一一对应，表示每一项是否成功；超时或连接断开时可能已经写入了但给出false，不要直接重试
+	template<class CompletionToken>
+	auto async_GiveItemsBatch(std::span<const HyItemGrant> grants, CompletionToken &&token)
+	{
+		return boost::asio::async_initiate<CompletionToken, void(std::vector<bool>)>([this](auto handler, std::span<const HyItemGrant> grants) {
+			Launch(GiveItemsBatchTask(std::vector<HyItemGrant>(grants.begin(), grants.end())), std::move(handler), std::vector<bool>(grants.size(), false));
+		}, token, grants);
+	}
+
+	// 开启后async_GiveItemBy*只在内存里累加，按数量或时间批量写入，回调立即得到true
+	// 查询单个道具数量时会加上还没写入（包括正在写入）的部分，扣除之前会先写入这一项
+	void EnableWriteBehind(HyWriteBehindOptions options = {});
+	// 立即写入所有积累的增量，Hibernate和退出时也会调用
+	void FlushWriteBehind();
 
 	bool ConsumeItemBySteamID(const std::string &steamid, const std::string & code, int sub_amount);
-	void async_ConsumeItemBySteamID(const std::string& steamid, const std::string& code, int sub_amount, std::function<void(bool success)> fn);
+	template<class CompletionToken>
+	auto async_ConsumeItemBySteamID(const std::string &steamid, const std::string &code, int sub_amount, CompletionToken &&token)
+	{
+		return boost::asio::async_initiate<CompletionToken, void(bool)>([this](auto handler, const std::string &steamid, const std::string &code, int sub_amount) {
+			Launch(ConsumeItemTask("steam", steamid, code, sub_amount), std::move(handler), false);
+		}, token, steamid, code, sub_amount);
+	}
 
-	// 签到用（确保QQID存在）
+	// 签到用（确保QQID存在），整个过程在一个事务里完成，cur_amount是发完所有奖励之后的数量
 	std::pair<HyUserSignResultType, std::optional<HyUserSignResult>> DoUserDailySign(const HyUserAccountData &user);
     boost::asio::awaitable<std::pair<HyUserSignResultType, std::optional<HyUserSignResult>>> async_DoUserDailySign(const HyUserAccountData &user);
 
 	// 道具商店
     boost::asio::awaitable<std::vector<HyShopEntry>> async_QueryShopEntry();
 
-	// 自动连接
-	void Start();
+	// 道具和商店目录缓存在内存里，过期（默认10分钟）后下一次查询时在后台刷新，刷新完成前继续用旧的
+	void SetCatalogTTL(std::chrono::seconds ttl);
+	// 立即重新加载，修改了iteminfo或itemshop之后调用
+	void RefreshCatalog();
+
+	// 排队等连接和每条语句的截止时间见DatabasePoolOptions::query_timeout，一次调用最多等1 + 语句条数个query_timeout
+	// 超时时同步和返回awaitable的接口抛出MySqlTimeoutError（code是boost::asio::error::timed_out），语句超时用到的连接会被丢弃重建
+
+	// 自动连接，必须在其他接口之前调用
+	void Start(HyBackendType backend = HyBackendType::mysql);
+	// 连接指定的MySQL而不是内置的设置，比如性能测试连本地的库
+	void Start(const DatabaseConfig &config);
+
+	// Start(HyBackendType::memory)之后用来导入数据，其他存储返回nullptr
+	HyMemoryBackend *MemoryBackend();
 
 	// 断开所有空闲连接
 	void Hibernate();
 
+	// 连接池统计，MySqlPoolSnapshot::to_string()可以转成文本
+	MySqlPoolSnapshot PoolMetrics();
+
+	// 语句跟踪，默认开启：每16条语句采样1条按指纹统计延迟、行数和字节数，超过阈值的语句都进慢查询日志
+	// 在Start之后调用；内存存储不执行语句，返回空的统计
+	void SetQueryTrace(MySqlQueryTraceOptions options);
+	// MySqlQueryTraceSnapshot::to_string()可以转成文本
+	MySqlQueryTraceSnapshot QueryTrace();
+
+private:
+	// 模板接口里不依赖令牌类型的部分，参数按值传递
+	boost::asio::io_context &Context();
+	// 分片连接池时是调用者所在分片的io_context，协程和它用到的连接在同一个线程上
+	boost::asio::io_context &SpawnContext(boost::asio::execution_context &preferred);
+
+	// use_future等关联的executor不一定能查询所属的context，查不到的当作没有关联
+	template<class Executor>
+	boost::asio::execution_context &ContextOf(const Executor &ex)
+	{
+		if constexpr (boost::asio::can_query<const Executor &, boost::asio::execution::context_t>::value)
+			return boost::asio::query(ex, boost::asio::execution::context);
+		else
+			return Context();
+	}
+	boost::asio::awaitable<int32_t> GetItemAmountTask(std::string_view idsrc, std::string auth, std::string code);
+	boost::asio::awaitable<bool> GiveItemTask(std::string_view idsrc, std::string auth, std::string code, int add_amount); // 开启延迟写入时只放进队列
+	boost::asio::awaitable<std::vector<bool>> GiveItemsBatchTask(std::vector<HyItemGrant> grants);
+	boost::asio::awaitable<bool> ConsumeItemTask(std::string_view idsrc, std::string auth, std::string code, int sub_amount);
+
+	// 出错时给handler传fallback，在handler关联的executor上完成
+	template<class T, class Handler>
+	void Launch(boost::asio::awaitable<T> task, Handler handler, T fallback)
+	{
+		auto ex = boost::asio::get_associated_executor(handler, Context().get_executor());
+		auto &spawn_on = SpawnContext(ContextOf(ex));
+#if BOOST_VERSION >= 107700
+		auto slot = boost::asio::get_associated_cancellation_slot(handler);
+#endif
+		auto completion = [handler = std::move(handler), ex, fallback = std::move(fallback)](std::exception_ptr e, T value) mutable {
+			boost::asio::dispatch(ex, [handler = std::move(handler), result = e ? std::move(fallback) : std::move(value)]() mutable {
+				std::move(handler)(std::move(result));
+			});
+		};
+#if BOOST_VERSION >= 107700
+		// 取消信号通过co_spawn传给协程里正在等待的操作
+		if (slot.is_connected())
+			return boost::asio::co_spawn(spawn_on, std::move(task), boost::asio::bind_cancellation_slot(slot, std::move(completion)));
+#endif
+		boost::asio::co_spawn(spawn_on, std::move(task), std::move(completion));
+	}
+
 private:
 	struct impl_t;
 	std::shared_ptr<impl_t> pimpl;
@@ -0,0 +1,153 @@
+#include "HyInventoryCache.h"
+
+HyInventoryCache::HyInventoryCache(size_t capacity, std::chrono::steady_clock::duration ttl) :
+	capacity(capacity),
+	ttl(ttl)
+{
+
+}
+
+std::string HyInventoryCache::key_of(std::string_view idsrc, std::string_view auth)
+{
+	std::string key;
+	key.reserve(idsrc.size() + auth.size() + 1);
+	key.append(idsrc).push_back('\0');
+	key.append(auth);
+	return key;
+}
+
+std::shared_ptr<HyInventoryCache::inventory> HyInventoryCache::find(std::string_view idsrc, std::string_view auth)
+{
+	auto iter = index.find(key_of(idsrc, auth));
+	return iter != index.end() ? iter->second : nullptr;
+}
+
+void HyInventoryCache::remove(const std::shared_ptr<inventory> &inv)
+{
+	for (auto &key : inv->keys)
+	{
+		auto iter = index.find(key);
+		if (iter != index.end() && iter->second == inv)
+			index.erase(iter);
+	}
+	lru.erase(inv->lru);
+}
+
+std::optional<int32_t> HyInventoryCache::amount(std::string_view idsrc, std::string_view auth, std::string_view code)
+{
+	std::lock_guard l(m);
+	auto inv = find(idsrc, auth);
+	if (!inv || inv->loading)
+		return std::nullopt;
+	if (inv->expire <= std::chrono::steady_clock::now())
+	{
+		remove(inv);
+		return std::nullopt;
+	}
+	lru.splice(lru.begin(), lru, inv->lru);
+	auto iter = inv->amounts.find(std::string(code));
+	return iter != inv->amounts.end() ? iter->second : 0;
+}
+
+HyInventoryCache::write_guard::write_guard(HyInventoryCache &cache, std::string_view idsrc, std::string_view auth) :
+	cache(cache),
+	key(key_of(idsrc, auth))
+{
+	std::lock_guard l(cache.m);
+	++cache.writing[key];
+	auto iter = cache.index.find(key);
+	if (iter != cache.index.end() && iter->second->loading)
+		iter->second->dirty = true;
+}
+
+HyInventoryCache::write_guard::~write_guard()
+{
+	std::lock_guard l(cache.m);
+	auto iter = cache.writing.find(key);
+	if (iter != cache.writing.end() && !--iter->second)
+		cache.writing.erase(iter);
+}
+
+uint64_t HyInventoryCache::begin_load(const identity_list &identities)
+{
+	std::lock_guard l(m);
+	auto inv = std::make_shared<inventory>();
+	for (auto &[idsrc, auth] : identities)
+	{
+		// 写入可能已经提交但还没有add，读到的值会被重复计算
+		if (writing.contains(key_of(idsrc, auth)))
+			return 0;
+	}
+	for (auto &[idsrc, auth] : identities)
+	{
+		if (auto old = find(idsrc, auth))
+		{
+			if (old->loading || old->expire > std::chrono::steady_clock::now())
+				return 0;
+			remove(old);
+		}
+		inv->keys.push_back(key_of(idsrc, auth));
+	}
+	// 绑定关系变了的话旧的一组里可能只有一部分账号，上面已经整组删掉了
+	for (auto &key : inv->keys)
+		index[key] = inv;
+	inv->ticket = next_ticket++;
+	lru.push_front(inv);
+	inv->lru = lru.begin();
+	while (lru.size() > capacity)
+		remove(lru.back());
+	return inv->ticket;
+}
+
+void HyInventoryCache::finish_load(std::string_view idsrc, std::string_view auth, uint64_t ticket, std::unordered_map<std::string, int32_t> amounts)
+{
+	std::lock_guard l(m);
+	auto inv = find(idsrc, auth);
+	if (!inv || inv->ticket != ticket || !inv->loading)
+		return;
+	if (inv->dirty)
+		return remove(inv);
+	inv->amounts = std::move(amounts);
+	inv->loading = false;
+	inv->expire = std::chrono::steady_clock::now() + ttl;
+}
+
+void HyInventoryCache::abort_load(std::string_view idsrc, std::string_view auth, uint64_t ticket)
+{
+	std::lock_guard l(m);
+	auto inv = find(idsrc, auth);
+	if (inv && inv->ticket == ticket && inv->loading)
+		remove(inv);
+}
+
+template<class Fn>
+void HyInventoryCache::modify(std::string_view idsrc, std::string_view auth, Fn fn)
+{
+	std::lock_guard l(m);
+	auto inv = find(idsrc, auth);
+	if (!inv)
+		return;
+	if (inv->loading)
+		inv->dirty = true;
+	else
+		fn(*inv);
+}
+
+void HyInventoryCache::add(std::string_view idsrc, std::string_view auth, std::string_view code, int32_t delta)
+{
+	modify(idsrc, auth, [&](inventory &inv) { inv.amounts[std::string(code)] += delta; });
+}
+
+void HyInventoryCache::evict(std::string_view idsrc, std::string_view auth)
+{
+	std::lock_guard l(m);
+	if (auto inv = find(idsrc, auth))
+		remove(inv);
+}
+
+void HyInventoryCache::clear()
+{
+	std::lock_guard l(m);
+	index.clear();
+	lru.clear();
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// 玩家道具数量的缓存，绑定在一起的账号共用一份合计数量，按LRU淘汰
+// 只反映本进程的写入，其他进程的修改要等过期后重新加载才能看到
+class HyInventoryCache
+{
+public:
+	using identity_list = std::vector<std::pair<std::string, std::string>>; // (idsrc, auth)
+
+	HyInventoryCache(size_t capacity, std::chrono::steady_clock::duration ttl);
+
+	// 命中时返回合计数量（没有这种道具时是0），没有缓存、正在加载或已经过期时返回nullopt
+	std::optional<int32_t> amount(std::string_view idsrc, std::string_view auth, std::string_view code);
+
+	// 写入数据库之前创建，更新完缓存之后销毁；期间这个账号的加载结果都不放进缓存
+	// 否则写入提交之后开始的加载会读到新的值，随后的add又加一次
+	class write_guard
+	{
+	public:
+		write_guard(HyInventoryCache &cache, std::string_view idsrc, std::string_view auth);
+		write_guard(const write_guard &) = delete;
+		write_guard &operator=(const write_guard &) = delete;
+		~write_guard();
+
+	private:
+		HyInventoryCache &cache;
+		std::string key;
+	};
+
+	// 加载前占位，返回非0的令牌交给finish_load；已经有人在加载、已经缓存或者有账号正在写入时返回0
+	uint64_t begin_load(const identity_list &identities);
+	// 加载期间有写入的话结果可能过时，直接丢弃
+	void finish_load(std::string_view idsrc, std::string_view auth, uint64_t ticket, std::unordered_map<std::string, int32_t> amounts);
+	void abort_load(std::string_view idsrc, std::string_view auth, uint64_t ticket);
+
+	// 本进程写入数据库成功之后、销毁write_guard之前调用，缓存了的话原地修改
+	void add(std::string_view idsrc, std::string_view auth, std::string_view code, int32_t delta);
+
+	// 淘汰包含这个账号的整组缓存
+	void evict(std::string_view idsrc, std::string_view auth);
+	void clear();
+
+private:
+	struct inventory
+	{
+		std::vector<std::string> keys; // 这组账号在index里的key
+		std::unordered_map<std::string, int32_t> amounts;
+		uint64_t ticket = 0;
+		bool loading = true;
+		bool dirty = false; // 加载期间有写入开始
+		std::chrono::steady_clock::time_point expire;
+		std::list<std::shared_ptr<inventory>>::iterator lru;
+	};
+
+	static std::string key_of(std::string_view idsrc, std::string_view auth);
+	std::shared_ptr<inventory> find(std::string_view idsrc, std::string_view auth); // 需要持有m
+	void remove(const std::shared_ptr<inventory> &inv); // 需要持有m
+	template<class Fn>
+	void modify(std::string_view idsrc, std::string_view auth, Fn fn);
+
+	const size_t capacity;
+	const std::chrono::steady_clock::duration ttl;
+
+	std::mutex m;
+	std::unordered_map<std::string, std::shared_ptr<inventory>> index;
+	std::list<std::shared_ptr<inventory>> lru; // 最近用过的在前面
+	std::unordered_map<std::string, int> writing; // 账号 -> 正在进行的写入数，为0时删除
+	uint64_t next_ticket = 1;
+};
@@ -0,0 +1,483 @@
+#include "HyMemoryBackend.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <ctime>
+#include <mutex>
+
+int64_t HyMemoryBackend::Today()
+{
+	std::time_t t = std::time(nullptr);
+	std::tm tm = {};
+#ifdef _WIN32
+	localtime_s(&tm, &t);
+#else
+	localtime_r(&t, &tm);
+#endif
+	using namespace std::chrono;
+	return sys_days(year(tm.tm_year + 1900) / month(unsigned(tm.tm_mon + 1)) / day(unsigned(tm.tm_mday))).time_since_epoch().count();
+}
+
+void HyMemoryBackend::PutItemInfo(HyItemInfo info)
+{
+	std::unique_lock l(m);
+	if (auto iter = iteminfo_index.find(info.code); iter != iteminfo_index.end())
+		iteminfo[iter->second] = std::move(info);
+	else
+	{
+		iteminfo_index.emplace(info.code, iteminfo.size());
+		iteminfo.push_back(std::move(info));
+	}
+}
+
+void HyMemoryBackend::PutShopEntry(HyCatalog::shop_row row)
+{
+	std::unique_lock l(m);
+	itemshop.insert_or_assign(row.shopid, std::move(row));
+}
+
+void HyMemoryBackend::PutSignAward(std::string code, int32_t amount, int32_t minfrags, int32_t maxfrags)
+{
+	std::unique_lock l(m);
+	itemaward.push_back({ std::move(code), amount, minfrags, maxfrags });
+}
+
+int64_t HyMemoryBackend::PutAccount(int64_t qqid, int32_t xscode, std::string access, std::string tag)
+{
+	std::unique_lock l(m);
+	qqlogin.insert_or_assign(qqid, login_row{ xscode, std::move(access), std::move(tag) });
+	return QueryOrRegisterUid(qqid);
+}
+
+int64_t HyMemoryBackend::PutIdLink(std::string idsrc, std::string auth, int64_t uid)
+{
+	std::unique_lock l(m);
+	if (!uid)
+		uid = next_uid;
+	auto key = HyIdentityKey(idsrc, auth);
+	if (auto iter = idlink.find(key); iter != idlink.end())
+	{
+		// 换到新的uid下
+		auto &members = uid_members[iter->second];
+		std::erase(members, std::make_pair(idsrc, auth));
+		idlink.erase(iter);
+	}
+	Link(idsrc, auth, uid);
+	return uid;
+}
+
+void HyMemoryBackend::PutItemOwn(std::string idsrc, std::string auth, std::string code, int32_t amount)
+{
+	std::unique_lock l(m);
+	itemown[HyIdentityKey(idsrc, auth)].insert_or_assign(std::move(code), amount);
+}
+
+void HyMemoryBackend::PutCS16Reg(std::string name, int32_t xscode)
+{
+	std::unique_lock l(m);
+	if (auto iter = cs16reg.find(name); iter != cs16reg.end())
+		cs16reg_by_code.erase(iter->second);
+	cs16reg_by_code.insert_or_assign(xscode, name);
+	cs16reg.insert_or_assign(std::move(name), xscode);
+}
+
+void HyMemoryBackend::PutSignEvent(int64_t qqid, int64_t day, int32_t signcount)
+{
+	std::unique_lock l(m);
+	qqevent.insert_or_assign(qqid, sign_row{ day, signcount });
+	sign_rank_day = 0; // 下次签到时重新数
+}
+
+// 和SQL里一样，按qq查时只需要qqlogin有这一行，按steam查时需要steam账号绑定在有qqlogin的qq账号上
+std::optional<HyUserAccountData> HyMemoryBackend::AccountOf(int64_t qqid, const std::string *steamid) const
+{
+	auto login = qqlogin.find(qqid);
+	if (login == qqlogin.end())
+		return std::nullopt;
+	HyUserAccountData result;
+	result.qqid = qqid;
+	result.xscode = login->second.xscode;
+	result.access = login->second.access;
+	result.tag = login->second.tag;
+	if (auto link = idlink.find(HyIdentityKey("qq", std::to_string(qqid))); link != idlink.end())
+	{
+		for (auto &[idsrc, auth] : uid_members.at(link->second))
+		{
+			if (idsrc == "name" && result.name.empty())
+				result.name = auth;
+			else if (idsrc == "steam" && result.steamid.empty())
+				result.steamid = auth;
+		}
+	}
+	if (steamid)
+		result.steamid = *steamid;
+	return result;
+}
+
+std::optional<HyUserAccountData> HyMemoryBackend::Account(std::string_view idsrc, const std::string &auth)
+{
+	std::shared_lock l(m);
+	if (idsrc == "qq")
+	{
+		int64_t qqid = 0;
+		auto [end, ec] = std::from_chars(auth.data(), auth.data() + auth.size(), qqid);
+		if (ec != std::errc() || end != auth.data() + auth.size())
+			return std::nullopt;
+		return AccountOf(qqid, nullptr);
+	}
+	if (idsrc == "steam")
+	{
+		auto link = idlink.find(HyIdentityKey(idsrc, auth));
+		if (link == idlink.end())
+			return std::nullopt;
+		for (auto &[linked_idsrc, linked_auth] : uid_members.at(link->second))
+		{
+			int64_t qqid = 0;
+			if (linked_idsrc != "qq" || std::from_chars(linked_auth.data(), linked_auth.data() + linked_auth.size(), qqid).ec != std::errc())
+				continue;
+			if (auto result = AccountOf(qqid, &auth))
+				return result;
+		}
+	}
+	return std::nullopt;
+}
+
+boost::asio::awaitable<std::optional<HyUserAccountData>> HyMemoryBackend::async_Account(std::string_view idsrc, std::string auth)
+{
+	co_return Account(idsrc, auth);
+}
+
+// 和UPDATE的affected_rows一样，数值没变时返回false
+bool HyMemoryBackend::UpdateXSCode(int64_t qqid, int32_t xscode)
+{
+	std::unique_lock l(m);
+	auto login = qqlogin.find(qqid);
+	if (login == qqlogin.end() || login->second.xscode == xscode)
+		return false;
+	login->second.xscode = xscode;
+	return true;
+}
+
+bool HyMemoryBackend::Link(std::string_view idsrc, const std::string &auth, int64_t uid)
+{
+	if (!idlink.try_emplace(HyIdentityKey(idsrc, auth), uid).second)
+		return false;
+	uid_members[uid].emplace_back(idsrc, auth);
+	next_uid = std::max(next_uid, uid + 1);
+	return true;
+}
+
+int64_t HyMemoryBackend::QueryOrRegisterUid(int64_t qqid)
+{
+	const std::string auth = std::to_string(qqid);
+	if (auto iter = idlink.find(HyIdentityKey("qq", auth)); iter != idlink.end())
+		return iter->second;
+	const int64_t uid = next_uid;
+	Link("qq", auth, uid);
+	qqlogin.try_emplace(qqid);
+	return uid;
+}
+
+std::optional<HyBindResult> HyMemoryBackend::BindByRegCode(int64_t qqid, std::string_view idsrc, int32_t regcode)
+{
+	std::unique_lock l(m);
+	const bool steam = idsrc == "steam";
+	auto &by_auth = steam ? csgoreg : cs16reg;
+	auto &by_code = steam ? csgoreg_by_code : cs16reg_by_code;
+	auto reg = by_code.find(regcode);
+	if (reg == by_code.end())
+		return std::nullopt;
+	HyBindResult result;
+	result.auth = reg->second;
+	result.uid = QueryOrRegisterUid(qqid);
+	result.linked = Link(idsrc, result.auth, result.uid);
+	by_auth.erase(result.auth);
+	by_code.erase(reg);
+	return result;
+}
+
+int32_t HyMemoryBackend::StartRegistration(const std::string &steamid)
+{
+	std::unique_lock l(m);
+	std::optional<int32_t> old;
+	if (auto iter = csgoreg.find(steamid); iter != csgoreg.end())
+	{
+		old = iter->second;
+		csgoreg_by_code.erase(iter->second);
+		csgoreg.erase(iter);
+	}
+	HyGoCodeGenerator codes(steamid);
+	for (int iTries = 0; iTries < 9; ++iTries)
+	{
+		const int32_t gocode = std::stoi(codes.next());
+		if (csgoreg_by_code.try_emplace(gocode, steamid).second)
+		{
+			csgoreg.insert_or_assign(steamid, gocode);
+			return gocode;
+		}
+	}
+	if (old)
+	{
+		csgoreg_by_code.insert_or_assign(*old, steamid);
+		csgoreg.insert_or_assign(steamid, *old);
+	}
+	return 0;
+}
+
+boost::asio::awaitable<int32_t> HyMemoryBackend::async_StartRegistration(std::string steamid)
+{
+	co_return StartRegistration(steamid);
+}
+
+auto HyMemoryBackend::LoadCatalog(bool) -> catalog_rows
+{
+	std::shared_lock l(m);
+	catalog_rows result;
+	result.items = iteminfo;
+	result.shop.reserve(itemshop.size());
+	for (auto &[shopid, row] : itemshop)
+		result.shop.push_back(row);
+	return result;
+}
+
+auto HyMemoryBackend::async_LoadCatalog() -> boost::asio::awaitable<catalog_rows>
+{
+	co_return LoadCatalog(false);
+}
+
+// 先复制出来再分批交给on_rows，回调期间不持有锁
+template<class T, class Fn>
+size_t HyMemoryBackend::Stream(std::vector<T> rows, size_t batch, const Fn &on_rows)
+{
+	batch = std::max<size_t>(batch, 1);
+	for (size_t begin = 0; begin < rows.size(); begin += batch)
+	{
+		auto end = std::min(begin + batch, rows.size());
+		on_rows(std::vector<T>(std::make_move_iterator(rows.begin() + begin), std::make_move_iterator(rows.begin() + end)));
+	}
+	return rows.size();
+}
+
+size_t HyMemoryBackend::StreamAllItemInfo(const item_rows &on_rows, size_t batch)
+{
+	return Stream(LoadCatalog(false).items, batch, on_rows);
+}
+
+boost::asio::awaitable<size_t> HyMemoryBackend::async_StreamAllItemInfo(const item_rows &on_rows, size_t batch)
+{
+	co_return StreamAllItemInfo(on_rows, batch);
+}
+
+HyIdentitySet HyMemoryBackend::IdentitiesOf(std::string_view idsrc, const std::string &auth) const
+{
+	HyIdentitySet result;
+	if (auto link = idlink.find(HyIdentityKey(idsrc, auth)); link != idlink.end())
+	{
+		result.uid = link->second;
+		result.identities = uid_members.at(link->second);
+	}
+	else
+	{
+		result.identities.emplace_back(idsrc, auth);
+	}
+	return result;
+}
+
+std::shared_ptr<const HyIdentitySet> HyMemoryBackend::Identities(std::string_view idsrc, const std::string &auth)
+{
+	std::shared_lock l(m);
+	return std::make_shared<const HyIdentitySet>(IdentitiesOf(idsrc, auth));
+}
+
+boost::asio::awaitable<std::shared_ptr<const HyIdentitySet>> HyMemoryBackend::async_Identities(std::string_view idsrc, std::string auth)
+{
+	co_return Identities(idsrc, auth);
+}
+
+auto HyMemoryBackend::AmountsOf(const identity_list &identities) const -> amount_map
+{
+	amount_map result;
+	for (auto &[idsrc, auth] : identities)
+	{
+		auto own = itemown.find(HyIdentityKey(idsrc, auth));
+		if (own == itemown.end())
+			continue;
+		for (auto &[code, amount] : own->second)
+			result[code] += amount;
+	}
+	return result;
+}
+
+auto HyMemoryBackend::ItemAmounts(std::string_view, const std::string &, const HyIdentitySet &ids) -> amount_map
+{
+	std::shared_lock l(m);
+	return AmountsOf(ids.identities);
+}
+
+auto HyMemoryBackend::async_ItemAmounts(std::string_view idsrc, std::string auth, const HyIdentitySet &ids) -> boost::asio::awaitable<amount_map>
+{
+	co_return ItemAmounts(idsrc, auth, ids);
+}
+
+// 只列出iteminfo里有的道具，按iteminfo的顺序
+std::vector<HyUserOwnItemInfo> HyMemoryBackend::OwnItemInfoOf(std::string_view idsrc, const std::string &auth) const
+{
+	std::vector<std::pair<size_t, int32_t>> found;
+	for (auto &[code, amount] : AmountsOf(IdentitiesOf(idsrc, auth).identities))
+	{
+		if (auto iter = iteminfo_index.find(code); iter != iteminfo_index.end())
+			found.emplace_back(iter->second, amount);
+	}
+	std::sort(found.begin(), found.end());
+	std::vector<HyUserOwnItemInfo> result;
+	result.reserve(found.size());
+	for (auto &[index, amount] : found)
+		result.push_back({ iteminfo[index], amount });
+	return result;
+}
+
+std::vector<HyUserOwnItemInfo> HyMemoryBackend::UserOwnItemInfo(std::string_view idsrc, const std::string &auth)
+{
+	std::shared_lock l(m);
+	return OwnItemInfoOf(idsrc, auth);
+}
+
+boost::asio::awaitable<std::vector<HyUserOwnItemInfo>> HyMemoryBackend::async_UserOwnItemInfo(std::string_view idsrc, std::string auth)
+{
+	co_return UserOwnItemInfo(idsrc, auth);
+}
+
+size_t HyMemoryBackend::StreamUserOwnItemInfo(std::string_view idsrc, const std::string &auth, const own_item_rows &on_rows, size_t batch)
+{
+	return Stream(UserOwnItemInfo(idsrc, auth), batch, on_rows);
+}
+
+boost::asio::awaitable<size_t> HyMemoryBackend::async_StreamUserOwnItemInfo(std::string_view idsrc, std::string auth, const own_item_rows &on_rows, size_t batch)
+{
+	co_return StreamUserOwnItemInfo(idsrc, auth, on_rows, batch);
+}
+
+// 和INSERT ... ON DUPLICATE KEY UPDATE的affected_rows一样，已有的一行加0时返回false
+bool HyMemoryBackend::Give(std::string_view idsrc, const std::string &auth, const std::string &code, int add_amount)
+{
+	auto [iter, inserted] = itemown[HyIdentityKey(idsrc, auth)].try_emplace(code, 0);
+	iter->second += add_amount;
+	return inserted || add_amount != 0;
+}
+
+bool HyMemoryBackend::GiveItem(std::string_view idsrc, const std::string &auth, const std::string &code, int add_amount)
+{
+	std::unique_lock l(m);
+	return Give(idsrc, auth, code, add_amount);
+}
+
+boost::asio::awaitable<bool> HyMemoryBackend::async_GiveItem(std::string_view idsrc, std::string auth, std::string code, int add_amount)
+{
+	co_return GiveItem(idsrc, auth, code, add_amount);
+}
+
+boost::asio::awaitable<std::vector<HyGrantResult>> HyMemoryBackend::async_GiveItems(std::vector<HyItemGrant> grants)
+{
+	std::vector<HyGrantResult> result(grants.size());
+	{
+		std::unique_lock l(m);
+		for (size_t i = 0; i < grants.size(); ++i)
+			result[i] = Give(grants[i].idsrc, grants[i].auth, grants[i].code, grants[i].add_amount) ? HyGrantResult::applied : HyGrantResult::unchanged;
+	}
+	co_return result;
+}
+
+// 自己的够扣就直接扣；不够的话把绑定账号的这种道具合并到自己名下再扣
+std::optional<HyConsumeResult> HyMemoryBackend::Consume(std::string_view idsrc, const std::string &auth, const std::string &code, int sub_amount)
+{
+	auto key = HyIdentityKey(idsrc, auth);
+	if (auto own = itemown.find(key); own != itemown.end())
+	{
+		if (auto iter = own->second.find(code); iter != own->second.end() && iter->second >= sub_amount)
+		{
+			iter->second -= sub_amount;
+			return HyConsumeResult{ iter->second, false };
+		}
+	}
+	auto ids = IdentitiesOf(idsrc, auth);
+	auto total = AmountsOf(ids.identities)[code];
+	if (total < sub_amount)
+		return std::nullopt;
+	for (auto &[linked_idsrc, linked_auth] : ids.identities)
+	{
+		if (auto linked = itemown.find(HyIdentityKey(linked_idsrc, linked_auth)); linked != itemown.end())
+			linked->second.erase(code);
+	}
+	// 够扣了才建自己的那一行
+	itemown[key].insert_or_assign(code, total - sub_amount);
+	return HyConsumeResult{ total - sub_amount, true };
+}
+
+std::optional<HyConsumeResult> HyMemoryBackend::ConsumeItem(std::string_view idsrc, const std::string &auth, const std::string &code, int sub_amount)
+{
+	std::unique_lock l(m);
+	return Consume(idsrc, auth, code, sub_amount);
+}
+
+boost::asio::awaitable<std::optional<HyConsumeResult>> HyMemoryBackend::async_ConsumeItem(std::string_view idsrc, std::string auth, std::string code, int sub_amount)
+{
+	co_return ConsumeItem(idsrc, auth, code, sub_amount);
+}
+
+HySignOutcome HyMemoryBackend::DailySign(int64_t qqid, bool op)
+{
+	std::unique_lock l(m);
+	HySignOutcome outcome;
+	const int64_t today = Today();
+	auto [event, registered] = qqevent.try_emplace(qqid);
+	registered = !registered;
+	if (registered && event->second.day == today)
+	{
+		outcome.type = HyUserSignResultType::failure_already_signed;
+		return outcome;
+	}
+
+	// 名次不包括自己，所以在更新签到记录之前数
+	if (sign_rank_day != today)
+	{
+		sign_rank_day = today;
+		sign_rank_count = static_cast<int>(std::count_if(qqevent.begin(), qqevent.end(), [today](const auto &e) { return e.second.day == today; }));
+	}
+	const int rank = ++sign_rank_count;
+
+	int signcount = registered && event->second.day == today - 1 ? event->second.count : 0; // 连续签到
+	++signcount;
+	event->second = sign_row{ today, signcount };
+
+	std::vector<HyUserOwnItemInfo> awards;
+	for (auto &a : itemaward)
+	{
+		auto info = iteminfo_index.find(a.code);
+		if (info != iteminfo_index.end() && a.minfrags <= signcount && signcount <= a.maxfrags)
+			awards.push_back({ iteminfo[info->second], a.amount });
+	}
+	const int rewardmultiply = HySignRewardMultiply(rank, op);
+	std::map<std::string, int32_t> added;
+	auto vecItems = HyPickSignAwards(awards, rewardmultiply, added);
+
+	const std::string auth = std::to_string(qqid);
+	if (!added.empty())
+	{
+		for (auto &[code, amount] : added)
+			Give("qq", auth, code, amount);
+		auto amounts = AmountsOf(IdentitiesOf("qq", auth).identities);
+		for (auto &info : vecItems)
+			info.cur_amount = amounts[info.item.code];
+	}
+	outcome.added = std::move(added);
+
+	outcome.type = HyUserSignResultType::success;
+	outcome.result = HyUserSignResult{ rank, signcount, rewardmultiply, std::move(vecItems) };
+	return outcome;
+}
+
+boost::asio::awaitable<HySignOutcome> HyMemoryBackend::async_DailySign(int64_t qqid, bool op)
+{
+	co_return DailySign(qqid, op);
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "HyBackend.h"
+
+// 进程内的存储，每张表一个哈希表，语义和MySQL的一致，数据不持久化
+// 给本地测试服、CI和性能测试用；读共享锁，写独占锁，多步的操作在一次加锁里完成，相当于事务
+class HyMemoryBackend : public HyBackend
+{
+public:
+	// 导入数据，同一行已经存在时覆盖；导入目录之后需要CHyDatabase::RefreshCatalog
+	void PutItemInfo(HyItemInfo info);
+	void PutShopEntry(HyCatalog::shop_row row);
+	void PutSignAward(std::string code, int32_t amount, int32_t minfrags, int32_t maxfrags);
+	int64_t PutAccount(int64_t qqid, int32_t xscode = 0, std::string access = "", std::string tag = ""); // 和注册一样同时写入idlink，返回uid
+	int64_t PutIdLink(std::string idsrc, std::string auth, int64_t uid = 0); // uid为0时分配新的，返回uid
+	void PutItemOwn(std::string idsrc, std::string auth, std::string code, int32_t amount);
+	void PutCS16Reg(std::string name, int32_t xscode);
+	void PutSignEvent(int64_t qqid, int64_t day, int32_t signcount); // day和Today()一样按本地日期计
+	static int64_t Today();
+
+	void Start() override {}
+	void Hibernate() override {}
+	MySqlPoolSnapshot Metrics() override { return {}; }
+
+	std::optional<HyUserAccountData> Account(std::string_view idsrc, const std::string &auth) override;
+	boost::asio::awaitable<std::optional<HyUserAccountData>> async_Account(std::string_view idsrc, std::string auth) override;
+	bool UpdateXSCode(int64_t qqid, int32_t xscode) override;
+	std::optional<HyBindResult> BindByRegCode(int64_t qqid, std::string_view idsrc, int32_t regcode) override;
+	boost::asio::awaitable<int32_t> async_StartRegistration(std::string steamid) override;
+
+	catalog_rows LoadCatalog(bool latest) override;
+	boost::asio::awaitable<catalog_rows> async_LoadCatalog() override;
+	size_t StreamAllItemInfo(const item_rows &on_rows, size_t batch) override;
+	boost::asio::awaitable<size_t> async_StreamAllItemInfo(const item_rows &on_rows, size_t batch) override;
+
+	std::shared_ptr<const HyIdentitySet> Identities(std::string_view idsrc, const std::string &auth) override;
+	boost::asio::awaitable<std::shared_ptr<const HyIdentitySet>> async_Identities(std::string_view idsrc, std::string auth) override;
+
+	amount_map ItemAmounts(std::string_view idsrc, const std::string &auth, const HyIdentitySet &ids) override;
+	boost::asio::awaitable<amount_map> async_ItemAmounts(std::string_view idsrc, std::string auth, const HyIdentitySet &ids) override;
+	std::vector<HyUserOwnItemInfo> UserOwnItemInfo(std::string_view idsrc, const std::string &auth) override;
+	boost::asio::awaitable<std::vector<HyUserOwnItemInfo>> async_UserOwnItemInfo(std::string_view idsrc, std::string auth) override;
+	size_t StreamUserOwnItemInfo(std::string_view idsrc, const std::string &auth, const own_item_rows &on_rows, size_t batch) override;
+	boost::asio::awaitable<size_t> async_StreamUserOwnItemInfo(std::string_view idsrc, std::string auth, const own_item_rows &on_rows, size_t batch) override;
+
+	bool GiveItem(std::string_view idsrc, const std::string &auth, const std::string &code, int add_amount) override;
+	boost::asio::awaitable<bool> async_GiveItem(std::string_view idsrc, std::string auth, std::string code, int add_amount) override;
+	boost::asio::awaitable<std::vector<HyGrantResult>> async_GiveItems(std::vector<HyItemGrant> grants) override;
+	std::optional<HyConsumeResult> ConsumeItem(std::string_view idsrc, const std::string &auth, const std::string &code, int sub_amount) override;
+	boost::asio::awaitable<std::optional<HyConsumeResult>> async_ConsumeItem(std::string_view idsrc, std::string auth, std::string code, int sub_amount) override;
+
+	boost::asio::awaitable<HySignOutcome> async_DailySign(int64_t qqid, bool op) override;
+
+private:
+	struct login_row
+	{
+		int32_t xscode = 0;
+		std::string access;
+		std::string tag;
+	};
+
+	struct award_row
+	{
+		std::string code;
+		int32_t amount = 0;
+		int32_t minfrags = 0;
+		int32_t maxfrags = 0;
+	};
+
+	struct sign_row
+	{
+		int64_t day = 0;
+		int32_t count = 0;
+	};
+
+	using identity_list = std::vector<std::pair<std::string, std::string>>;
+
+	// 以下都需要持有m
+	std::optional<HyUserAccountData> AccountOf(int64_t qqid, const std::string *steamid) const;
+	HyIdentitySet IdentitiesOf(std::string_view idsrc, const std::string &auth) const;
+	amount_map AmountsOf(const identity_list &identities) const;
+	std::vector<HyUserOwnItemInfo> OwnItemInfoOf(std::string_view idsrc, const std::string &auth) const;
+	bool Link(std::string_view idsrc, const std::string &auth, int64_t uid); // INSERT IGNORE
+	int64_t QueryOrRegisterUid(int64_t qqid);
+	int32_t StartRegistration(const std::string &steamid);
+	bool Give(std::string_view idsrc, const std::string &auth, const std::string &code, int add_amount);
+	std::optional<HyConsumeResult> Consume(std::string_view idsrc, const std::string &auth, const std::string &code, int sub_amount);
+	HySignOutcome DailySign(int64_t qqid, bool op);
+
+	template<class T, class Fn>
+	static size_t Stream(std::vector<T> rows, size_t batch, const Fn &on_rows);
+
+private:
+	mutable std::shared_mutex m;
+
+	std::unordered_map<int64_t, login_row> qqlogin;
+	std::unordered_map<std::string, int64_t> idlink; // HyIdentityKey -> uid
+	std::unordered_map<int64_t, identity_list> uid_members; // 按绑定的顺序
+	int64_t next_uid = 1;
+	std::unordered_map<std::string, int32_t> cs16reg; // name -> xscode
+	std::unordered_map<int32_t, std::string> cs16reg_by_code;
+	std::unordered_map<std::string, int32_t> csgoreg; // steamid -> gocode
+	std::unordered_map<int32_t, std::string> csgoreg_by_code;
+	std::vector<HyItemInfo> iteminfo;
+	std::unordered_map<std::string, size_t> iteminfo_index; // code -> iteminfo里的下标
+	std::map<int32_t, HyCatalog::shop_row> itemshop;
+	std::vector<award_row> itemaward;
+	std::unordered_map<std::string, std::unordered_map<std::string, int32_t>> itemown; // HyIdentityKey -> code -> amount
+	std::unordered_map<int64_t, sign_row> qqevent;
+
+	// 今天的签到名次计数，每天第一次签到时数一遍qqevent
+	int64_t sign_rank_day = 0;
+	int sign_rank_count = 0;
+};
@@ -0,0 +1,1015 @@
+#include "HyMySqlBackend.h"
+#include "MySqlConnection.h"
+#include "MySqlRowMapper.h"
+#include "MySqlTransaction.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+
+#include <boost/asio.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+// 用到的所有语句，每个连接第一次用到时预编译并缓存，参数全部绑定
+enum class HyStatement : uint32_t
+{
+	UserAccountDataByQQID,
+	UserAccountDataBySteamID,
+	UpdateXSCodeByQQID,
+	CS16RegNameByXSCode,
+	CSGORegSteamIDByGOCode,
+	UidByAuth,
+	InsertIdLink,
+	InsertQQLogin,
+	InsertIdLinkWithUid,
+	DeleteCS16RegByName,
+	DeleteCSGORegBySteamID,
+	InsertCSGOReg,
+	AllItemInfo,
+	IdentitiesByAuth,
+	UpsertItemOwn,
+	SubItemOwnAmount,
+	// 以下参数个数不固定，见DynamicStatementSql
+	UpsertItemOwnBatch,
+	UserOwnItemInfoOfSet,
+	ItemAmountsOfSet,
+	ShareItemAmountsOfSet,
+	LockItemAmountOfSet,
+	DeleteItemOwnOfSet,
+	SignState,
+	UpdateSign,
+	InsertSign,
+	TodaySignCount,
+	SignAwards,
+	AllShopEntry,
+};
+
+static std::string_view StatementSql(HyStatement id)
+{
+	switch (id)
+	{
+	case HyStatement::UserAccountDataByQQID:
+		return "SELECT qqid, name, steamid, xscode, access, tag FROM qqlogin "
+			"NATURAL LEFT OUTER JOIN (SELECT auth AS qqid, uid FROM idlink WHERE idsrc = 'qq') AS T1 "
+			"NATURAL LEFT OUTER JOIN (SELECT auth AS name, uid FROM idlink WHERE idsrc = 'name') AS T2 "
+			"NATURAL LEFT OUTER JOIN (SELECT auth AS steamid, uid FROM idlink WHERE idsrc = 'steam') AS T3 "
+			"WHERE `qqid` = ?";
+	case HyStatement::UserAccountDataBySteamID:
+		return "SELECT qqid, name, steamid, xscode, access, tag FROM qqlogin "
+			"NATURAL LEFT OUTER JOIN (SELECT auth AS qqid, uid FROM idlink WHERE idsrc = 'qq') AS T1 "
+			"NATURAL LEFT OUTER JOIN (SELECT auth AS name, uid FROM idlink WHERE idsrc = 'name') AS T2 "
+			"NATURAL LEFT OUTER JOIN (SELECT auth AS steamid, uid FROM idlink WHERE idsrc = 'steam') AS T3 "
+			"WHERE `steamid` = ?";
+	case HyStatement::UpdateXSCodeByQQID:
+		return "UPDATE qqlogin SET `xscode` = ? WHERE `qqid` = ?";
+	case HyStatement::CS16RegNameByXSCode:
+		return "SELECT `name` FROM cs16reg WHERE `xscode` = ? FOR UPDATE";
+	case HyStatement::CSGORegSteamIDByGOCode:
+		return "SELECT `steamid` FROM csgoreg WHERE `gocode` = ? FOR UPDATE";
+	case HyStatement::UidByAuth:
+		return "SELECT `uid` FROM idlink WHERE `idsrc` = ? AND `auth` = ? FOR UPDATE";
+	case HyStatement::InsertIdLink:
+		return "INSERT IGNORE INTO idlink(idsrc, auth) VALUES(?, ?)";
+	case HyStatement::InsertQQLogin:
+		return "INSERT IGNORE INTO qqlogin(qqid) VALUES(?)";
+	case HyStatement::InsertIdLinkWithUid:
+		return "INSERT IGNORE INTO idlink(idsrc, auth, uid) VALUES(?, ?, ?)";
+	case HyStatement::DeleteCS16RegByName:
+		return "DELETE FROM cs16reg WHERE `name` = ?";
+	case HyStatement::DeleteCSGORegBySteamID:
+		return "DELETE FROM csgoreg WHERE `steamid` = ?";
+	case HyStatement::InsertCSGOReg:
+		return "INSERT IGNORE INTO csgoreg(steamid, gocode) VALUES(?, ?)";
+	case HyStatement::AllItemInfo:
+		return "SELECT `code`, `name`, `desc`, `quantifier` FROM iteminfo";
+	case HyStatement::IdentitiesByAuth:
+		return "SELECT idl1.idsrc, idl1.auth, idl1.uid FROM idlink AS idl1 JOIN idlink AS idl2 ON idl1.uid = idl2.uid WHERE idl2.idsrc = ? AND idl2.auth = ?";
+	case HyStatement::UpsertItemOwn: // idsrc, auth, code, add
+		return "INSERT INTO itemown(idsrc, auth, code, amount) VALUES(?, ?, ?, ?) "
+			"ON DUPLICATE KEY UPDATE `amount` = `amount` + VALUES(`amount`)";
+	case HyStatement::SubItemOwnAmount: // sub, idsrc, auth, code, sub
+		// 扣除后的数量通过LAST_INSERT_ID随OK包返回，不需要再查一次
+		return "UPDATE itemown SET `amount` = LAST_INSERT_ID(`amount` - ?) WHERE `idsrc` = ? AND `auth` = ? AND `code` = ? AND `amount` >= ?";
+	case HyStatement::UpsertItemOwnBatch:
+	case HyStatement::UserOwnItemInfoOfSet:
+	case HyStatement::ItemAmountsOfSet:
+	case HyStatement::ShareItemAmountsOfSet:
+	case HyStatement::LockItemAmountOfSet:
+	case HyStatement::DeleteItemOwnOfSet:
+		break;
+	case HyStatement::SignState: // qqid
+		// 总是返回一行，带上数据库的日期；锁住这个人的签到记录（没有的话锁住间隙），防止同时签到两次
+		return "SELECT t.today, qqevent.qqid IS NOT NULL AS registered, t.today - TO_DAYS(qqevent.`signdate`) AS signdelta, qqevent.`signcount` "
+			"FROM (SELECT TO_DAYS(NOW()) AS today) AS t LEFT JOIN qqevent ON qqevent.`qqid` = ? FOR UPDATE";
+	case HyStatement::UpdateSign:
+		return "UPDATE qqevent SET `signdate` = NOW(), `signcount` = ? WHERE `qqid` = ?";
+	case HyStatement::InsertSign:
+		return "INSERT INTO qqevent(qqid, signdate, signcount) VALUES(?, NOW(), 1)";
+	case HyStatement::TodaySignCount: // today, qqid
+		// 只在每天第一次签到时用来初始化名次计数，不包括自己
+		return "SELECT COUNT(*) FROM qqevent WHERE `signdate` >= FROM_DAYS(?) AND `qqid` <> ?";
+	case HyStatement::SignAwards:
+		return "SELECT `code`, `name`, `desc`, `quantifier`, `amount` FROM itemaward NATURAL JOIN iteminfo WHERE ? BETWEEN `minfrags` AND `maxfrags`";
+	case HyStatement::AllShopEntry:
+		return "SELECT `shopid`, `target_code`, `target_amount`, `exchange_code`, `exchange_amount` FROM itemshop";
+	}
+	return {};
+}
+
+static boost::mysql::tcp_prepared_statement &Prepare(MySqlConnection &conn, HyStatement id)
+{
+	return conn.prepare(static_cast<uint32_t>(id), StatementSql(id));
+}
+
+// 所有语句都经过下面这些函数执行，每条语句一个MySqlQuerySpan，从发出语句算到读完结果，不包括预编译
+template<class... Args>
+static boost::mysql::tcp_resultset Execute(MySqlConnection &conn, HyStatement id, const Args &...args)
+{
+	auto &stmt = Prepare(conn, id);
+	MySqlQuerySpan span(conn, StatementSql(id));
+	auto resultset = conn.guard([&] { return stmt.execute(boost::mysql::make_values(args...)); });
+	span.finish();
+	return resultset;
+}
+
+template<class... Args>
+static std::vector<boost::mysql::row> Query(MySqlConnection &conn, HyStatement id, const Args &...args)
+{
+	auto &stmt = Prepare(conn, id);
+	MySqlQuerySpan span(conn, StatementSql(id));
+	auto resultset = conn.guard([&] { return stmt.execute(boost::mysql::make_values(args...)); });
+	auto rows = conn.guard([&] { return resultset.read_all(); });
+	span.add_rows(rows);
+	span.finish();
+	return rows;
+}
+
+// 参数只在co_await期间被引用，调用者传临时对象也没问题
+// 连接上的所有操作都经过guard，超时时抛出MySqlTimeoutError
+template<class... Args>
+static boost::asio::awaitable<boost::mysql::tcp_resultset> async_Execute(MySqlConnection &conn, HyStatement id, const Args &...args)
+{
+	auto stmt = co_await conn.async_prepare(static_cast<uint32_t>(id), StatementSql(id));
+	const auto params = boost::mysql::make_values(args...);
+	MySqlQuerySpan span(conn, StatementSql(id));
+	auto resultset = co_await conn.guard(stmt->async_execute(params, boost::asio::use_awaitable));
+	span.finish();
+	co_return resultset;
+}
+
+template<class... Args>
+static boost::asio::awaitable<std::vector<boost::mysql::row>> async_Query(MySqlConnection &conn, HyStatement id, const Args &...args)
+{
+	auto stmt = co_await conn.async_prepare(static_cast<uint32_t>(id), StatementSql(id));
+	const auto params = boost::mysql::make_values(args...);
+	MySqlQuerySpan span(conn, StatementSql(id));
+	auto resultset = co_await conn.guard(stmt->async_execute(params, boost::asio::use_awaitable));
+	auto rows = co_await conn.guard(resultset.async_read_all(boost::asio::use_awaitable));
+	span.add_rows(rows);
+	span.finish();
+	co_return rows;
+}
+
+// 批量语句每条最多的行数
+static constexpr size_t max_batch_rows = 64;
+
+// 参数个数不固定的语句（多行插入、一组账号），每种个数单独生成SQL并预编译
+// key的最高位和固定语句区分开
+static uint32_t DynamicStatementKey(HyStatement id, size_t n)
+{
+	return 0x80000000u | (static_cast<uint32_t>(id) << 16) | static_cast<uint32_t>(n);
+}
+
+static std::string RepeatPlaceholders(std::string_view one, size_t n)
+{
+	std::string result;
+	for (size_t i = 0; i < n; ++i)
+		result.append(i ? ", " : "").append(one);
+	return result;
+}
+
+static std::string BuildDynamicSql(HyStatement id, size_t n)
+{
+	switch (id)
+	{
+	case HyStatement::UpsertItemOwnBatch: // (idsrc, auth, code, add) * n
+		return "INSERT INTO itemown(idsrc, auth, code, amount) VALUES" + RepeatPlaceholders("(?, ?, ?, ?)", n) +
+			" ON DUPLICATE KEY UPDATE `amount` = `amount` + VALUES(`amount`)";
+	case HyStatement::UserOwnItemInfoOfSet: // (idsrc, auth) * n
+		return "SELECT `code`, `name`, `desc`, `quantifier`, `amount` FROM iteminfo NATURAL JOIN ("
+			"SELECT code, CAST(SUM(amount) AS SIGNED INTEGER) AS amount FROM itemown WHERE (idsrc, auth) IN (" + RepeatPlaceholders("(?, ?)", n) + ") GROUP BY code"
+			") AS itemlst";
+	case HyStatement::ItemAmountsOfSet: // (idsrc, auth) * n
+		return "SELECT code, CAST(SUM(amount) AS SIGNED INTEGER) AS amount FROM itemown WHERE (idsrc, auth) IN (" + RepeatPlaceholders("(?, ?)", n) + ") GROUP BY code";
+	case HyStatement::ShareItemAmountsOfSet: // (idsrc, auth) * n
+		// 事务里读最新提交的数据而不是事务开始时的快照；LOCK IN SHARE MODE在5.7和8.0上都能用
+		return "SELECT code, CAST(SUM(amount) AS SIGNED INTEGER) AS amount FROM itemown WHERE (idsrc, auth) IN (" + RepeatPlaceholders("(?, ?)", n) + ") GROUP BY code LOCK IN SHARE MODE";
+	case HyStatement::LockItemAmountOfSet: // code, (idsrc, auth) * n
+		return "SELECT CAST(SUM(amount) AS SIGNED INTEGER) AS amount FROM itemown WHERE `code` = ? AND (idsrc, auth) IN (" + RepeatPlaceholders("(?, ?)", n) + ") FOR UPDATE";
+	case HyStatement::DeleteItemOwnOfSet: // code, (idsrc, auth) * n
+		return "DELETE FROM itemown WHERE `code` = ? AND (idsrc, auth) IN (" + RepeatPlaceholders("(?, ?)", n) + ")";
+	default:
+		return {};
+	}
+}
+
+static const std::string &DynamicStatementSql(HyStatement id, size_t n)
+{
+	static std::mutex m;
+	static std::unordered_map<uint32_t, std::string> sqls; // 生成之后不会删除，引用一直有效
+	auto key = DynamicStatementKey(id, n);
+	std::lock_guard l(m);
+	auto iter = sqls.find(key);
+	if (iter == sqls.end())
+		iter = sqls.emplace(key, BuildDynamicSql(id, n)).first;
+	return iter->second;
+}
+
+static boost::mysql::tcp_prepared_statement &PrepareDynamic(MySqlConnection &conn, HyStatement id, size_t n)
+{
+	auto key = DynamicStatementKey(id, n);
+	if (auto iter = conn.statements.find(key); iter != conn.statements.end())
+		return iter->second;
+	return conn.prepare(key, DynamicStatementSql(id, n));
+}
+
+static boost::asio::awaitable<boost::mysql::tcp_prepared_statement *> async_PrepareDynamic(MySqlConnection &conn, HyStatement id, size_t n)
+{
+	auto key = DynamicStatementKey(id, n);
+	if (auto iter = conn.statements.find(key); iter != conn.statements.end())
+		co_return &iter->second;
+	co_return co_await conn.async_prepare(key, DynamicStatementSql(id, n));
+}
+
+static boost::mysql::tcp_resultset ExecuteDynamic(MySqlConnection &conn, HyStatement id, size_t n, const std::vector<boost::mysql::value> &params)
+{
+	auto &stmt = PrepareDynamic(conn, id, n);
+	MySqlQuerySpan span(conn, DynamicStatementSql(id, n));
+	auto resultset = conn.guard([&] { return stmt.execute(params); });
+	span.finish();
+	return resultset;
+}
+
+static std::vector<boost::mysql::row> QueryDynamic(MySqlConnection &conn, HyStatement id, size_t n, const std::vector<boost::mysql::value> &params)
+{
+	auto &stmt = PrepareDynamic(conn, id, n);
+	MySqlQuerySpan span(conn, DynamicStatementSql(id, n));
+	auto resultset = conn.guard([&] { return stmt.execute(params); });
+	auto rows = conn.guard([&] { return resultset.read_all(); });
+	span.add_rows(rows);
+	span.finish();
+	return rows;
+}
+
+static boost::asio::awaitable<boost::mysql::tcp_resultset> async_ExecuteDynamic(MySqlConnection &conn, HyStatement id, size_t n, const std::vector<boost::mysql::value> &params)
+{
+	auto stmt = co_await async_PrepareDynamic(conn, id, n);
+	MySqlQuerySpan span(conn, DynamicStatementSql(id, n));
+	auto resultset = co_await conn.guard(stmt->async_execute(params, boost::asio::use_awaitable));
+	span.finish();
+	co_return resultset;
+}
+
+static boost::asio::awaitable<std::vector<boost::mysql::row>> async_QueryDynamic(MySqlConnection &conn, HyStatement id, size_t n, const std::vector<boost::mysql::value> &params)
+{
+	auto stmt = co_await async_PrepareDynamic(conn, id, n);
+	MySqlQuerySpan span(conn, DynamicStatementSql(id, n));
+	auto resultset = co_await conn.guard(stmt->async_execute(params, boost::asio::use_awaitable));
+	auto rows = co_await conn.guard(resultset.async_read_all(boost::asio::use_awaitable));
+	span.add_rows(rows);
+	span.finish();
+	co_return rows;
+}
+
+// 执行一条查询，每次最多读batch行，转换后交给on_rows，返回总行数
+// 读到一半出错或者on_rows抛出异常时结果还没读完，连接不能再用，标记为失败让连接池重建
+template<class T>
+static size_t StreamRows(MySqlConnection &conn, std::string_view sql, boost::mysql::tcp_prepared_statement &stmt, const std::vector<boost::mysql::value> &params, size_t batch, const std::function<void(std::vector<T>)> &on_rows)
+{
+	batch = std::max<size_t>(batch, 1); // read_many(0)什么都不读，会把没读完的结果留在连接上
+	MySqlQuerySpan span(conn, sql);
+	auto resultset = conn.guard([&] { return stmt.execute(params); });
+	size_t total = 0;
+	try
+	{
+		while (!resultset.complete())
+		{
+			auto rows = conn.guard([&] { return resultset.read_many(batch); });
+			if (rows.empty())
+				break;
+			total += rows.size();
+			span.add_rows(rows);
+			span.pause();
+			on_rows(MySqlRowsAs<T>(rows));
+			span.resume();
+		}
+	}
+	catch (...)
+	{
+		conn.fail(boost::asio::error::operation_aborted, "stream");
+		throw;
+	}
+	span.finish();
+	return total;
+}
+
+template<class T>
+static boost::asio::awaitable<size_t> async_StreamRows(MySqlConnection &conn, std::string_view sql, boost::mysql::tcp_prepared_statement &stmt, const std::vector<boost::mysql::value> &params, size_t batch, const std::function<void(std::vector<T>)> &on_rows)
+{
+	batch = std::max<size_t>(batch, 1);
+	MySqlQuerySpan span(conn, sql);
+	auto resultset = co_await conn.guard(stmt.async_execute(params, boost::asio::use_awaitable));
+	size_t total = 0;
+	try
+	{
+		while (!resultset.complete())
+		{
+			auto rows = co_await conn.guard(resultset.async_read_many(batch, boost::asio::use_awaitable));
+			if (rows.empty())
+				break;
+			total += rows.size();
+			span.add_rows(rows);
+			span.pause();
+			on_rows(MySqlRowsAs<T>(rows));
+			span.resume();
+		}
+	}
+	catch (...)
+	{
+		conn.fail(boost::asio::error::operation_aborted, "stream");
+		throw;
+	}
+	span.finish();
+	co_return total;
+}
+
+// idl1.idsrc, idl1.auth, idl1.uid
+struct HyIdentityRow
+{
+	std::string idsrc;
+	std::string auth;
+	int64_t uid = 0;
+};
+
+template<> struct MySqlRowLayout<HyIdentityRow> : MySqlColumns<&HyIdentityRow::idsrc, &HyIdentityRow::auth, &HyIdentityRow::uid> {};
+
+static std::shared_ptr<const HyIdentitySet> IdentitySetFromSqlResult(std::string_view idsrc, std::string_view auth, const std::vector<boost::mysql::row> &res)
+{
+	auto result = std::make_shared<HyIdentitySet>();
+	for (auto &l : res)
+	{
+		auto row = MySqlRowAs<HyIdentityRow>(l);
+		result->identities.emplace_back(std::move(row.idsrc), std::move(row.auth));
+		result->uid = row.uid;
+	}
+	if (std::none_of(result->identities.begin(), result->identities.end(), [&](const auto &id) { return id.first == idsrc && id.second == auth; }))
+		result->identities.emplace_back(idsrc, auth);
+	return result;
+}
+
+// 前面的固定参数加上每个账号的(idsrc, auth)
+static std::vector<boost::mysql::value> IdentitySetParams(const HyIdentitySet &set, std::initializer_list<boost::mysql::value> front = {})
+{
+	std::vector<boost::mysql::value> params(front);
+	params.reserve(front.size() + set.identities.size() * 2);
+	for (auto &[idsrc, auth] : set.identities)
+	{
+		params.emplace_back(std::string_view(idsrc));
+		params.emplace_back(std::string_view(auth));
+	}
+	return params;
+}
+
+// 新连接握手后先把最常用的语句预编译好
+static boost::asio::awaitable<void> PrepareHotStatements(MySqlConnection &conn)
+{
+	for (auto id : { HyStatement::UserAccountDataBySteamID, HyStatement::IdentitiesByAuth, HyStatement::UpsertItemOwn, HyStatement::SubItemOwnAmount })
+		co_await conn.async_prepare(static_cast<uint32_t>(id), StatementSql(id));
+	for (auto id : { HyStatement::UserOwnItemInfoOfSet, HyStatement::ItemAmountsOfSet })
+		co_await async_PrepareDynamic(conn, id, 1);
+}
+
+
+// qqid, name, steamid, xscode, access, tag
+template<> struct MySqlRowLayout<HyUserAccountData> : MySqlColumns<
+	&HyUserAccountData::qqid, &HyUserAccountData::name, &HyUserAccountData::steamid,
+	&HyUserAccountData::xscode, &HyUserAccountData::access, &HyUserAccountData::tag> {};
+
+// `code`, `name`, `desc`, `quantifier`
+template<> struct MySqlRowLayout<HyItemInfo> : MySqlColumns<&HyItemInfo::code, &HyItemInfo::name, &HyItemInfo::desc, &HyItemInfo::quantifier> {};
+
+// `code`, `name`, `desc`, `quantifier`, `amount`
+template<> struct MySqlRowLayout<HyUserOwnItemInfo> : MySqlColumns<&HyUserOwnItemInfo::item, &HyUserOwnItemInfo::amount> {};
+
+// `shopid`, `target_code`, `target_amount`, `exchange_code`, `exchange_amount`
+template<> struct MySqlRowLayout<HyCatalog::shop_row> : MySqlColumns<
+	&HyCatalog::shop_row::shopid, &HyCatalog::shop_row::target_code, &HyCatalog::shop_row::target_amount,
+	&HyCatalog::shop_row::exchange_code, &HyCatalog::shop_row::exchange_amount> {};
+
+static std::optional<HyUserAccountData> UserAccountDataFromSqlResult(const std::vector<boost::mysql::row> &res)
+{
+	if (res.empty())
+		return std::nullopt;
+	return MySqlRowAs<HyUserAccountData>(res[0]);
+}
+
+static HyStatement AccountStatementOf(std::string_view idsrc)
+{
+	return idsrc == "qq" ? HyStatement::UserAccountDataByQQID : HyStatement::UserAccountDataBySteamID;
+}
+
+static int32_t ItemAmountFromSqlResult(const std::vector<boost::mysql::row> &res)
+{
+	if (!res.empty())
+		return MySqlCellAs<int32_t>(res[0].values()[0]);
+	return 0;
+}
+
+// code, amount
+static std::unordered_map<std::string, int32_t> ItemAmountsFromSqlResult(const std::vector<boost::mysql::row> &res)
+{
+	std::unordered_map<std::string, int32_t> result;
+	for (auto &l : res)
+		result.emplace(MySqlCellAs<std::string>(l.values()[0]), MySqlCellAs<int32_t>(l.values()[1]));
+	return result;
+}
+
+static int32_t AmountOf(const std::unordered_map<std::string, int32_t> &amounts, const std::string &code)
+{
+	auto iter = amounts.find(code);
+	return iter != amounts.end() ? iter->second : 0;
+}
+
+HyMySqlBackend::HyMySqlBackend(const DatabaseConfig &config) :
+	pool(config),
+	replicas(config.replicas),
+	recent_writes(config.read_your_writes),
+	replica_cache_ttl(config.read_your_writes)
+{
+	pool.set_session_setup(PrepareHotStatements);
+	replicas.set_session_setup(PrepareHotStatements);
+}
+
+void HyMySqlBackend::Start()
+{
+	pool.start();
+	replicas.start();
+}
+
+void HyMySqlBackend::Hibernate()
+{
+	pool.hibernate();
+	replicas.hibernate();
+}
+
+void HyMySqlBackend::SetQueryTrace(MySqlQueryTraceOptions options)
+{
+	tracer.configure(std::move(options));
+}
+
+MySqlQueryTraceSnapshot HyMySqlBackend::QueryTrace()
+{
+	return tracer.snapshot();
+}
+
+MySqlPoolSnapshot HyMySqlBackend::Metrics()
+{
+	auto result = pool.metrics();
+	result += replicas.metrics();
+	return result;
+}
+
+bool HyMySqlBackend::ReadFromReplica(HyAccess access, std::string_view idsrc, std::string_view auth)
+{
+	if (access != HyAccess::read || !replicas.available())
+		return false;
+	return idsrc.empty() || !recent_writes.get(HyIdentityKey(idsrc, auth));
+}
+
+// 副本全部不可用时回到主库
+auto HyMySqlBackend::Acquire(const char *caller, HyAccess access, std::string_view idsrc, std::string_view auth) -> connection_ptr
+{
+	const auto start = std::chrono::steady_clock::now();
+	const bool replica = ReadFromReplica(access, idsrc, auth);
+	connection_ptr conn;
+	try
+	{
+		conn = replica ? replicas.acquire() : pool.acquire();
+	}
+	catch (const boost::system::system_error &e)
+	{
+		// 排队超时和语句超时一样给出MySqlTimeoutError
+		if (e.code() == boost::asio::error::timed_out)
+			throw MySqlTimeoutError();
+		throw;
+	}
+	Trace(*conn, caller, replica, idsrc, auth, start);
+	return conn;
+}
+
+auto HyMySqlBackend::async_Acquire(const char *caller, HyAccess access, std::string_view idsrc, std::string_view auth) -> boost::asio::awaitable<connection_ptr>
+{
+	const auto start = std::chrono::steady_clock::now();
+	const bool replica = ReadFromReplica(access, idsrc, auth);
+	connection_ptr conn;
+	try
+	{
+		conn = replica ? co_await replicas.async_acquire(boost::asio::use_awaitable) : co_await pool.async_acquire(boost::asio::use_awaitable);
+	}
+	catch (const boost::system::system_error &e)
+	{
+		if (e.code() == boost::asio::error::timed_out)
+			throw MySqlTimeoutError();
+		throw;
+	}
+	Trace(*conn, caller, replica, idsrc, auth, start);
+	co_return conn;
+}
+
+// 上一次取出时留下的上下文一定要覆盖掉
+void HyMySqlBackend::Trace(MySqlConnection &conn, const char *caller, bool replica, std::string_view idsrc, std::string_view auth, std::chrono::steady_clock::time_point start)
+{
+	if (!tracer.enabled())
+	{
+		conn.trace = {};
+		conn.trace.replica = replica; // 不跟踪时也要记下，缓存要区分结果是不是从副本读的
+		return;
+	}
+	conn.trace.tracer = &tracer;
+	conn.trace.caller = caller;
+	conn.trace.account.clear();
+	if (!idsrc.empty())
+		conn.trace.account.append(idsrc).append(":").append(auth);
+	conn.trace.replica = replica;
+	conn.trace.queue_time = std::chrono::steady_clock::now() - start;
+}
+
+// 查询道具时会合并绑定账号，所以已知的绑定账号也一起标记
+void HyMySqlBackend::NoteWrite(std::string_view idsrc, std::string_view auth)
+{
+	if (!replicas.size())
+		return;
+	auto key = HyIdentityKey(idsrc, auth);
+	if (auto ids = identity_cache.get(key))
+		for (auto &[linked_idsrc, linked_auth] : (*ids)->identities)
+			recent_writes.put(HyIdentityKey(linked_idsrc, linked_auth), true);
+	recent_writes.put(key, true);
+}
+
+std::optional<HyUserAccountData> HyMySqlBackend::Account(std::string_view idsrc, const std::string &auth)
+{
+	return UserAccountDataFromSqlResult(Query(*Acquire("Account", HyAccess::read, idsrc, auth), AccountStatementOf(idsrc), auth));
+}
+
+boost::asio::awaitable<std::optional<HyUserAccountData>> HyMySqlBackend::async_Account(std::string_view idsrc, std::string auth)
+{
+	auto conn = co_await async_Acquire("async_Account", HyAccess::read, idsrc, auth);
+	co_return UserAccountDataFromSqlResult(co_await async_Query(*conn, AccountStatementOf(idsrc), auth));
+}
+
+bool HyMySqlBackend::UpdateXSCode(int64_t qqid, int32_t xscode)
+{
+	const std::string qq = std::to_string(qqid);
+	NoteWrite("qq", qq);
+	auto res1 = Execute(*Acquire("UpdateXSCode", HyAccess::write), HyStatement::UpdateXSCodeByQQID, int64_t(xscode), qq).affected_rows();
+	return res1 == 1;
+}
+
+// 找到qqid对应的uid，没有注册过就先注册，在事务里调用
+static int64_t QueryOrRegisterUidByQQID(MySqlConnection &conn, const std::string &auth)
+{
+	auto res = Query(conn, HyStatement::UidByAuth, std::string_view("qq"), auth);
+	if (res.empty())
+	{
+		//没有注册过，插入新的uid
+		Execute(conn, HyStatement::InsertIdLink, std::string_view("qq"), auth);
+		Execute(conn, HyStatement::InsertQQLogin, auth);
+		res = Query(conn, HyStatement::UidByAuth, std::string_view("qq"), auth);
+		if (res.empty())
+			throw std::runtime_error("idlink insert failed");
+	}
+	return MySqlCellAs<int64_t>(res[0].values()[0]);
+}
+
+// 查找、注册、绑定、删除注册记录全部在一个事务里完成
+std::optional<HyBindResult> HyMySqlBackend::BindByRegCode(int64_t qqid, std::string_view idsrc, int32_t regcode)
+{
+	const bool steam = idsrc == "steam";
+	const HyStatement find_reg = steam ? HyStatement::CSGORegSteamIDByGOCode : HyStatement::CS16RegNameByXSCode;
+	const HyStatement delete_reg = steam ? HyStatement::DeleteCSGORegBySteamID : HyStatement::DeleteCS16RegByName;
+	const std::string qq = std::to_string(qqid);
+	auto conn = Acquire("BindByRegCode", HyAccess::write);
+	NoteWrite("qq", qq);
+	auto bound = MySqlTransact(*conn, [&](MySqlTransaction &tx) -> std::optional<HyBindResult> {
+		auto res = Query(*conn, find_reg, int64_t(regcode));
+		if (res.empty())
+		{
+			tx.set_rollback_only();
+			return std::nullopt;
+		}
+		HyBindResult result;
+		result.auth = MySqlCellAs<std::string>(res[0].values()[0]);
+		result.uid = QueryOrRegisterUidByQQID(*conn, qq);
+		result.linked = Execute(*conn, HyStatement::InsertIdLinkWithUid, idsrc, result.auth, result.uid).affected_rows() == 1;
+		//删掉注册表项，绑定成不成功都无所谓了
+		Execute(*conn, delete_reg, result.auth);
+		return result;
+	});
+	if (bound)
+	{
+		// 绑定关系变化后，这个uid下所有账号缓存的集合都过时了，新绑定的账号之前可能被缓存成单独一个
+		// 绑定的账号在事务里才知道，只能事后标记
+		InvalidateIdentities(bound->uid, { { "qq", qq }, { std::string(idsrc), bound->auth } });
+		NoteWrite(idsrc, bound->auth);
+	}
+	return bound;
+}
+
+// 旧的注册码只删一次，新的注册码和别人重复时只重试插入；都失败的话回滚，保留旧的注册码
+boost::asio::awaitable<int32_t> HyMySqlBackend::async_StartRegistration(std::string steamid)
+{
+	auto conn = co_await async_Acquire("async_StartRegistration", HyAccess::write);
+	HyGoCodeGenerator codes(steamid);
+	co_return co_await async_MySqlTransact(*conn, [&](MySqlTransaction &tx) -> boost::asio::awaitable<int32_t> {
+		co_await async_Execute(*conn, HyStatement::DeleteCSGORegBySteamID, steamid);
+		for (int iTries = 0; iTries < 9; ++iTries)
+		{
+			const std::string gocode = codes.next();
+			if ((co_await async_Execute(*conn, HyStatement::InsertCSGOReg, steamid, gocode)).affected_rows() == 1)
+				co_return std::stoi(gocode);
+		}
+		tx.set_rollback_only();
+		co_return 0;
+	});
+}
+
+auto HyMySqlBackend::LoadCatalog(bool latest) -> catalog_rows
+{
+	auto conn = Acquire("LoadCatalog", latest ? HyAccess::write : HyAccess::read);
+	catalog_rows result;
+	result.items = MySqlRowsAs<HyItemInfo>(Query(*conn, HyStatement::AllItemInfo));
+	result.shop = MySqlRowsAs<HyCatalog::shop_row>(Query(*conn, HyStatement::AllShopEntry));
+	return result;
+}
+
+auto HyMySqlBackend::async_LoadCatalog() -> boost::asio::awaitable<catalog_rows>
+{
+	auto conn = co_await async_Acquire("async_LoadCatalog", HyAccess::read);
+	catalog_rows result;
+	result.items = MySqlRowsAs<HyItemInfo>(co_await async_Query(*conn, HyStatement::AllItemInfo));
+	result.shop = MySqlRowsAs<HyCatalog::shop_row>(co_await async_Query(*conn, HyStatement::AllShopEntry));
+	co_return result;
+}
+
+size_t HyMySqlBackend::StreamAllItemInfo(const item_rows &on_rows, size_t batch)
+{
+	auto conn = Acquire("StreamAllItemInfo", HyAccess::read);
+	const std::vector<boost::mysql::value> no_params;
+	return StreamRows(*conn, StatementSql(HyStatement::AllItemInfo), Prepare(*conn, HyStatement::AllItemInfo), no_params, batch, on_rows);
+}
+
+boost::asio::awaitable<size_t> HyMySqlBackend::async_StreamAllItemInfo(const item_rows &on_rows, size_t batch)
+{
+	auto conn = co_await async_Acquire("async_StreamAllItemInfo", HyAccess::read);
+	auto stmt = co_await conn->async_prepare(static_cast<uint32_t>(HyStatement::AllItemInfo), StatementSql(HyStatement::AllItemInfo));
+	const std::vector<boost::mysql::value> no_params;
+	co_return co_await async_StreamRows(*conn, StatementSql(HyStatement::AllItemInfo), *stmt, no_params, batch, on_rows);
+}
+
+std::shared_ptr<const HyIdentitySet> HyMySqlBackend::Identities(MySqlConnection &conn, std::string_view idsrc, const std::string &auth)
+{
+	auto key = HyIdentityKey(idsrc, auth);
+	if (auto cached = identity_cache.get(key))
+		return *cached;
+	auto result = IdentitySetFromSqlResult(idsrc, auth, Query(conn, HyStatement::IdentitiesByAuth, idsrc, auth));
+	CacheIdentities(conn, key, result);
+	return result;
+}
+
+boost::asio::awaitable<std::shared_ptr<const HyIdentitySet>> HyMySqlBackend::async_Identities(MySqlConnection &conn, std::string_view idsrc, const std::string &auth)
+{
+	auto key = HyIdentityKey(idsrc, auth);
+	if (auto cached = identity_cache.get(key))
+		co_return *cached;
+	auto result = IdentitySetFromSqlResult(idsrc, auth, co_await async_Query(conn, HyStatement::IdentitiesByAuth, idsrc, auth));
+	CacheIdentities(conn, key, result);
+	co_return result;
+}
+
+// 副本可能还没同步到刚发生的绑定，从副本读到的只缓存和读自己写入的窗口一样长的时间
+void HyMySqlBackend::CacheIdentities(const MySqlConnection &conn, const std::string &key, const std::shared_ptr<const HyIdentitySet> &ids)
+{
+	if (conn.trace.replica)
+		identity_cache.put(key, ids, replica_cache_ttl);
+	else
+		identity_cache.put(key, ids);
+}
+
+// 缓存命中时不需要连接
+std::shared_ptr<const HyIdentitySet> HyMySqlBackend::Identities(std::string_view idsrc, const std::string &auth)
+{
+	if (auto cached = identity_cache.get(HyIdentityKey(idsrc, auth)))
+		return *cached;
+	return Identities(*Acquire("Identities", HyAccess::read, idsrc, auth), idsrc, auth);
+}
+
+boost::asio::awaitable<std::shared_ptr<const HyIdentitySet>> HyMySqlBackend::async_Identities(std::string_view idsrc, std::string auth)
+{
+	if (auto cached = identity_cache.get(HyIdentityKey(idsrc, auth)))
+		co_return *cached;
+	auto conn = co_await async_Acquire("async_Identities", HyAccess::read, idsrc, auth);
+	co_return co_await async_Identities(*conn, idsrc, auth);
+}
+
+void HyMySqlBackend::InvalidateIdentities(int64_t uid, std::initializer_list<std::pair<std::string, std::string>> also)
+{
+	identity_cache.erase_if([uid](const std::string &, const std::shared_ptr<const HyIdentitySet> &ids) { return ids->uid == uid; });
+	for (auto &[idsrc, auth] : also)
+		identity_cache.erase(HyIdentityKey(idsrc, auth));
+}
+
+// 结果会放进CHyDatabase的道具缓存，缓存时间远长于读自己写入的窗口，只读主库
+auto HyMySqlBackend::ItemAmounts(std::string_view idsrc, const std::string &auth, const HyIdentitySet &ids) -> amount_map
+{
+	return ItemAmountsFromSqlResult(QueryDynamic(*Acquire("ItemAmounts", HyAccess::write, idsrc, auth), HyStatement::ItemAmountsOfSet, ids.identities.size(), IdentitySetParams(ids)));
+}
+
+auto HyMySqlBackend::async_ItemAmounts(std::string_view idsrc, std::string auth, const HyIdentitySet &ids) -> boost::asio::awaitable<amount_map>
+{
+	auto conn = co_await async_Acquire("async_ItemAmounts", HyAccess::write, idsrc, auth);
+	const auto params = IdentitySetParams(ids);
+	co_return ItemAmountsFromSqlResult(co_await async_QueryDynamic(*conn, HyStatement::ItemAmountsOfSet, ids.identities.size(), params));
+}
+
+std::vector<HyUserOwnItemInfo> HyMySqlBackend::UserOwnItemInfo(std::string_view idsrc, const std::string &auth)
+{
+	auto conn = Acquire("UserOwnItemInfo", HyAccess::read, idsrc, auth);
+	auto ids = Identities(*conn, idsrc, auth);
+	return MySqlRowsAs<HyUserOwnItemInfo>(QueryDynamic(*conn, HyStatement::UserOwnItemInfoOfSet, ids->identities.size(), IdentitySetParams(*ids)));
+}
+
+boost::asio::awaitable<std::vector<HyUserOwnItemInfo>> HyMySqlBackend::async_UserOwnItemInfo(std::string_view idsrc, std::string auth)
+{
+	auto conn = co_await async_Acquire("async_UserOwnItemInfo", HyAccess::read, idsrc, auth);
+	auto ids = co_await async_Identities(*conn, idsrc, auth);
+	const auto params = IdentitySetParams(*ids);
+	co_return MySqlRowsAs<HyUserOwnItemInfo>(co_await async_QueryDynamic(*conn, HyStatement::UserOwnItemInfoOfSet, ids->identities.size(), params));
+}
+
+size_t HyMySqlBackend::StreamUserOwnItemInfo(std::string_view idsrc, const std::string &auth, const own_item_rows &on_rows, size_t batch)
+{
+	auto conn = Acquire("StreamUserOwnItemInfo", HyAccess::read, idsrc, auth);
+	auto ids = Identities(*conn, idsrc, auth);
+	const size_t n = ids->identities.size();
+	return StreamRows(*conn, DynamicStatementSql(HyStatement::UserOwnItemInfoOfSet, n), PrepareDynamic(*conn, HyStatement::UserOwnItemInfoOfSet, n), IdentitySetParams(*ids), batch, on_rows);
+}
+
+boost::asio::awaitable<size_t> HyMySqlBackend::async_StreamUserOwnItemInfo(std::string_view idsrc, std::string auth, const own_item_rows &on_rows, size_t batch)
+{
+	auto conn = co_await async_Acquire("async_StreamUserOwnItemInfo", HyAccess::read, idsrc, auth);
+	auto ids = co_await async_Identities(*conn, idsrc, auth);
+	const auto params = IdentitySetParams(*ids);
+	const size_t n = ids->identities.size();
+	auto stmt = co_await async_PrepareDynamic(*conn, HyStatement::UserOwnItemInfoOfSet, n);
+	co_return co_await async_StreamRows(*conn, DynamicStatementSql(HyStatement::UserOwnItemInfoOfSet, n), *stmt, params, batch, on_rows);
+}
+
+// 一条语句完成插入或累加，依赖itemown上(idsrc, auth, code)的唯一键
+bool HyMySqlBackend::GiveItem(std::string_view idsrc, const std::string &auth, const std::string &code, int add_amount)
+{
+	NoteWrite(idsrc, auth);
+	return Execute(*Acquire("GiveItem", HyAccess::write, idsrc, auth), HyStatement::UpsertItemOwn, idsrc, auth, code, int64_t(add_amount)).affected_rows() > 0;
+}
+
+boost::asio::awaitable<bool> HyMySqlBackend::async_GiveItem(std::string_view idsrc, std::string auth, std::string code, int add_amount)
+{
+	auto conn = co_await async_Acquire("async_GiveItem", HyAccess::write, idsrc, auth);
+	NoteWrite(idsrc, auth);
+	auto resultset = co_await async_Execute(*conn, HyStatement::UpsertItemOwn, idsrc, auth, code, int64_t(add_amount));
+	co_return resultset.affected_rows() > 0;
+}
+
+// 在一个连接上用几条多行语句写入，服务器拒绝某一条只影响它包含的那几行
+// 其他错误说明连接已经坏了，这一条的结果未知，后面的不再发出
+boost::asio::awaitable<std::vector<HyGrantResult>> HyMySqlBackend::async_GiveItems(std::vector<HyItemGrant> grants)
+{
+	std::vector<HyGrantResult> result(grants.size(), HyGrantResult::failed);
+	if (grants.empty())
+		co_return result;
+
+	auto conn = co_await async_Acquire("async_GiveItems", HyAccess::write);
+	std::vector<boost::mysql::value> params;
+	params.reserve(std::min(grants.size(), max_batch_rows) * 4);
+	for (size_t begin = 0; begin < grants.size();)
+	{
+		// 按2的幂切分，每个连接最多只需要预编译7种行数
+		size_t rows = std::min(std::bit_floor(grants.size() - begin), max_batch_rows);
+		params.clear();
+		for (size_t i = begin; i < begin + rows; ++i)
+		{
+			NoteWrite(grants[i].idsrc, grants[i].auth);
+			params.emplace_back(std::string_view(grants[i].idsrc));
+			params.emplace_back(std::string_view(grants[i].auth));
+			params.emplace_back(std::string_view(grants[i].code));
+			params.emplace_back(int64_t(grants[i].add_amount));
+		}
+
+		HyGrantResult outcome = HyGrantResult::applied;
+		try
+		{
+			co_await async_ExecuteDynamic(*conn, HyStatement::UpsertItemOwnBatch, rows, params);
+		}
+		catch (const boost::system::system_error &e)
+		{
+			if (e.code() == boost::asio::error::operation_aborted)
+				throw;
+			outcome = MySqlIsServerError(e.code()) ? HyGrantResult::failed : HyGrantResult::unknown;
+		}
+		for (size_t i = begin; i < begin + rows; ++i)
+			result[i] = outcome;
+		begin += rows;
+		if (outcome == HyGrantResult::unknown)
+			break; // 剩下的保持failed
+	}
+	co_return result;
+}
+
+// 当前账号自己的道具不够扣，但加上绑定账号的够：在事务里锁住所有绑定账号的这种道具，合并到当前账号后再扣
+// 只有这条少见的路径需要多次往返
+static std::optional<int32_t> ConsumeFromLinked(MySqlConnection &conn, const HyIdentitySet &ids, std::string_view idsrc, const std::string &auth, const std::string &code, int sub_amount)
+{
+	const size_t n = ids.identities.size();
+	const auto params = IdentitySetParams(ids, { std::string_view(code) });
+	return MySqlTransact(conn, [&](MySqlTransaction &tx) -> std::optional<int32_t> {
+		int32_t total = ItemAmountFromSqlResult(QueryDynamic(conn, HyStatement::LockItemAmountOfSet, n, params));
+		if (total < sub_amount)
+		{
+			tx.set_rollback_only();
+			return std::nullopt;
+		}
+		ExecuteDynamic(conn, HyStatement::DeleteItemOwnOfSet, n, params);
+		Execute(conn, HyStatement::UpsertItemOwn, idsrc, auth, code, int64_t(total - sub_amount));
+		return total - sub_amount;
+	});
+}
+
+static boost::asio::awaitable<std::optional<int32_t>> async_ConsumeFromLinked(MySqlConnection &conn, const HyIdentitySet &ids, std::string_view idsrc, const std::string &auth, const std::string &code, int sub_amount)
+{
+	const size_t n = ids.identities.size();
+	const auto params = IdentitySetParams(ids, { std::string_view(code) });
+	co_return co_await async_MySqlTransact(conn, [&](MySqlTransaction &tx) -> boost::asio::awaitable<std::optional<int32_t>> {
+		int32_t total = ItemAmountFromSqlResult(co_await async_QueryDynamic(conn, HyStatement::LockItemAmountOfSet, n, params));
+		if (total < sub_amount)
+		{
+			tx.set_rollback_only();
+			co_return std::nullopt;
+		}
+		co_await async_ExecuteDynamic(conn, HyStatement::DeleteItemOwnOfSet, n, params);
+		co_await async_Execute(conn, HyStatement::UpsertItemOwn, idsrc, auth, code, int64_t(total - sub_amount));
+		co_return total - sub_amount;
+	});
+}
+
+// 常见情况一条UPDATE完成
+std::optional<HyConsumeResult> HyMySqlBackend::ConsumeItem(std::string_view idsrc, const std::string &auth, const std::string &code, int sub_amount)
+{
+	auto conn = Acquire("ConsumeItem", HyAccess::write, idsrc, auth);
+	NoteWrite(idsrc, auth);
+	auto resultset = Execute(*conn, HyStatement::SubItemOwnAmount, int64_t(sub_amount), idsrc, auth, code, int64_t(sub_amount));
+	if (resultset.affected_rows() == 1)
+		return HyConsumeResult{ static_cast<int32_t>(resultset.last_insert_id()), false };
+	auto ids = Identities(*conn, idsrc, auth);
+	if (auto remain = ConsumeFromLinked(*conn, *ids, idsrc, auth, code, sub_amount))
+		return HyConsumeResult{ *remain, true };
+	return std::nullopt;
+}
+
+boost::asio::awaitable<std::optional<HyConsumeResult>> HyMySqlBackend::async_ConsumeItem(std::string_view idsrc, std::string auth, std::string code, int sub_amount)
+{
+	auto conn = co_await async_Acquire("async_ConsumeItem", HyAccess::write, idsrc, auth);
+	NoteWrite(idsrc, auth);
+	auto resultset = co_await async_Execute(*conn, HyStatement::SubItemOwnAmount, int64_t(sub_amount), idsrc, auth, code, int64_t(sub_amount));
+	if (resultset.affected_rows() == 1)
+		co_return HyConsumeResult{ static_cast<int32_t>(resultset.last_insert_id()), false };
+	auto ids = co_await async_Identities(*conn, idsrc, auth);
+	if (auto remain = co_await async_ConsumeFromLinked(*conn, *ids, idsrc, auth, code, sub_amount))
+		co_return HyConsumeResult{ *remain, true };
+	co_return std::nullopt;
+}
+
+boost::asio::awaitable<int> HyMySqlBackend::async_NextSignRank(MySqlConnection &conn, int64_t today, const std::string &qqid)
+{
+	{
+		std::lock_guard l(sign_rank_m);
+		if (sign_rank_day == today)
+			co_return ++sign_rank_count;
+	}
+	// 新的一天，同时到达的几个请求都会查一次，只有第一个生效
+	int seed = MySqlCellAs<int>((co_await async_Query(conn, HyStatement::TodaySignCount, today, qqid))[0].values()[0]);
+	std::lock_guard l(sign_rank_m);
+	if (sign_rank_day < today)
+	{
+		sign_rank_day = today;
+		sign_rank_count = seed;
+	}
+	else if (sign_rank_day > today)
+	{
+		co_return seed + 1; // 跨过零点之前开始的签到，不影响新一天的计数
+	}
+	co_return ++sign_rank_count;
+}
+
+// 在一个连接上用一个事务完成：锁住签到记录、更新、算名次、抽奖励、一条语句写入所有奖励、读出新的数量
+boost::asio::awaitable<HySignOutcome> HyMySqlBackend::async_DailySign(int64_t qqid_value, bool op)
+{
+	const std::string_view idsrc = "qq";
+	const std::string qqid = std::to_string(qqid_value);
+
+	auto conn = co_await async_Acquire("async_DailySign", HyAccess::write);
+	NoteWrite(idsrc, qqid);
+	auto ids = co_await async_Identities(*conn, idsrc, qqid);
+
+	// 名次计数和随机数在事务以外，死锁重试时沿用第一次的名次和抽到的奖励，不重复占用名次也不重新抽
+	int64_t rank_day = 0;
+	int rank = 0;
+	std::optional<int> picked_for; // 按这个连续签到天数抽的
+	std::map<std::string, int32_t> added;
+	std::vector<HyUserSignGetItemInfo> picked;
+
+	auto outcome = co_await async_MySqlTransact(*conn, [&](MySqlTransaction &tx) -> boost::asio::awaitable<HySignOutcome> {
+		HySignOutcome result; // 死锁重试时重新开始
+		// today, registered, signdelta, signcount
+		auto state = (co_await async_Query(*conn, HyStatement::SignState, qqid))[0].values();
+		const auto today = MySqlCellAs<int64_t>(state[0]);
+		const bool registered = MySqlCellAs<int>(state[1]) != 0;
+		int signcount = 0;
+		if (registered)
+		{
+			if (!state[2].is_null() && MySqlCellAs<int>(state[2]) == 0)
+			{
+				// 已经签到过
+				tx.set_rollback_only();
+				result.type = HyUserSignResultType::failure_already_signed;
+				co_return result;
+			}
+			if (!state[2].is_null() && MySqlCellAs<int>(state[2]) == 1)
+				signcount = MySqlCellAs<int>(state[3]); // 连续签到
+		}
+
+		if (registered)
+			co_await async_Execute(*conn, HyStatement::UpdateSign, int64_t(signcount + 1), qqid);
+		else
+			co_await async_Execute(*conn, HyStatement::InsertSign, qqid);
+		++signcount;
+
+		if (rank_day != today)
+		{
+			rank = co_await async_NextSignRank(*conn, today, qqid);
+			rank_day = today;
+		}
+		const int rewardmultiply = HySignRewardMultiply(rank, op);
+
+		// 随机选择签到奖励，同一种道具合并成一行写入
+		if (picked_for != signcount)
+		{
+			auto awards = MySqlRowsAs<HyUserOwnItemInfo>(co_await async_Query(*conn, HyStatement::SignAwards, int64_t(signcount)));
+			added.clear();
+			picked = HyPickSignAwards(awards, rewardmultiply, added);
+			picked_for = signcount;
+		}
+		auto vecItems = picked;
+
+		if (!added.empty())
+		{
+			std::vector<boost::mysql::value> params;
+			params.reserve(added.size() * 4);
+			for (auto &[code, amount] : added)
+			{
+				params.emplace_back(idsrc);
+				params.emplace_back(std::string_view(qqid));
+				params.emplace_back(std::string_view(code));
+				params.emplace_back(int64_t(amount));
+			}
+			co_await async_ExecuteDynamic(*conn, HyStatement::UpsertItemOwnBatch, added.size(), params);
+
+			// 写入之后绑定账号的合计数量，快照在前面读签到记录时就定下了，要用加锁读才能看到之后别人提交的数量
+			const auto set_params = IdentitySetParams(*ids);
+			auto amounts = ItemAmountsFromSqlResult(co_await async_QueryDynamic(*conn, HyStatement::ShareItemAmountsOfSet, ids->identities.size(), set_params));
+			for (auto &info : vecItems)
+				info.cur_amount = AmountOf(amounts, info.item.code);
+		}
+		result.added = added;
+
+		result.type = HyUserSignResultType::success;
+		result.result = HyUserSignResult{ rank, signcount, rewardmultiply, std::move(vecItems) };
+		co_return result;
+	});
+	co_return outcome;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <chrono>
+#include <initializer_list>
+#include <mutex>
+
+#include "HyBackend.h"
+#include "HyCache.h"
+#include "MySqlReplicaSet.h"
+#include "MySqlShardedPool.h"
+
+class MySqlConnection;
+
+// 每次取连接时标明用途，决定走主库还是副本
+enum class HyAccess
+{
+	read, // 可以读副本，除非这个玩家刚写过
+	write, // 写，或者必须读到最新数据
+};
+
+// MySQL存储：分片连接池加只读副本，语句在每个连接上预编译
+class HyMySqlBackend : public HyBackend
+{
+public:
+	explicit HyMySqlBackend(const DatabaseConfig &config = GetDatabaseConfig());
+
+	void Start() override;
+	void Hibernate() override;
+	MySqlPoolSnapshot Metrics() override; // 主库和副本合计
+	boost::asio::io_context *ContextFor(boost::asio::execution_context &preferred) override { return &pool.context_for(preferred); }
+	void NoteWrite(std::string_view idsrc, std::string_view auth) override;
+	void SetQueryTrace(MySqlQueryTraceOptions options) override;
+	MySqlQueryTraceSnapshot QueryTrace() override;
+
+	std::optional<HyUserAccountData> Account(std::string_view idsrc, const std::string &auth) override;
+	boost::asio::awaitable<std::optional<HyUserAccountData>> async_Account(std::string_view idsrc, std::string auth) override;
+	bool UpdateXSCode(int64_t qqid, int32_t xscode) override;
+	std::optional<HyBindResult> BindByRegCode(int64_t qqid, std::string_view idsrc, int32_t regcode) override;
+	boost::asio::awaitable<int32_t> async_StartRegistration(std::string steamid) override;
+
+	catalog_rows LoadCatalog(bool latest) override;
+	boost::asio::awaitable<catalog_rows> async_LoadCatalog() override;
+	size_t StreamAllItemInfo(const item_rows &on_rows, size_t batch) override;
+	boost::asio::awaitable<size_t> async_StreamAllItemInfo(const item_rows &on_rows, size_t batch) override;
+
+	std::shared_ptr<const HyIdentitySet> Identities(std::string_view idsrc, const std::string &auth) override;
+	boost::asio::awaitable<std::shared_ptr<const HyIdentitySet>> async_Identities(std::string_view idsrc, std::string auth) override;
+
+	amount_map ItemAmounts(std::string_view idsrc, const std::string &auth, const HyIdentitySet &ids) override;
+	boost::asio::awaitable<amount_map> async_ItemAmounts(std::string_view idsrc, std::string auth, const HyIdentitySet &ids) override;
+	std::vector<HyUserOwnItemInfo> UserOwnItemInfo(std::string_view idsrc, const std::string &auth) override;
+	boost::asio::awaitable<std::vector<HyUserOwnItemInfo>> async_UserOwnItemInfo(std::string_view idsrc, std::string auth) override;
+	size_t StreamUserOwnItemInfo(std::string_view idsrc, const std::string &auth, const own_item_rows &on_rows, size_t batch) override;
+	boost::asio::awaitable<size_t> async_StreamUserOwnItemInfo(std::string_view idsrc, std::string auth, const own_item_rows &on_rows, size_t batch) override;
+
+	bool GiveItem(std::string_view idsrc, const std::string &auth, const std::string &code, int add_amount) override;
+	boost::asio::awaitable<bool> async_GiveItem(std::string_view idsrc, std::string auth, std::string code, int add_amount) override;
+	boost::asio::awaitable<std::vector<HyGrantResult>> async_GiveItems(std::vector<HyItemGrant> grants) override;
+	std::optional<HyConsumeResult> ConsumeItem(std::string_view idsrc, const std::string &auth, const std::string &code, int sub_amount) override;
+	boost::asio::awaitable<std::optional<HyConsumeResult>> async_ConsumeItem(std::string_view idsrc, std::string auth, std::string code, int sub_amount) override;
+
+	boost::asio::awaitable<HySignOutcome> async_DailySign(int64_t qqid, bool op) override;
+
+private:
+	using connection_ptr = MySqlShardedPool::connection_ptr;
+
+	bool ReadFromReplica(HyAccess access, std::string_view idsrc, std::string_view auth);
+	// caller是发起的操作名，必须是字面量，取出的连接上执行的语句都记在它名下
+	connection_ptr Acquire(const char *caller, HyAccess access, std::string_view idsrc = {}, std::string_view auth = {});
+	boost::asio::awaitable<connection_ptr> async_Acquire(const char *caller, HyAccess access, std::string_view idsrc = {}, std::string_view auth = {});
+	void Trace(MySqlConnection &conn, const char *caller, bool replica, std::string_view idsrc, std::string_view auth, std::chrono::steady_clock::time_point start);
+
+	// 在已经取到的连接上查，结果缓存
+	std::shared_ptr<const HyIdentitySet> Identities(MySqlConnection &conn, std::string_view idsrc, const std::string &auth);
+	boost::asio::awaitable<std::shared_ptr<const HyIdentitySet>> async_Identities(MySqlConnection &conn, std::string_view idsrc, const std::string &auth);
+	void CacheIdentities(const MySqlConnection &conn, const std::string &key, const std::shared_ptr<const HyIdentitySet> &ids);
+	void InvalidateIdentities(int64_t uid, std::initializer_list<std::pair<std::string, std::string>> also);
+
+	boost::asio::awaitable<int> async_NextSignRank(MySqlConnection &conn, int64_t today, const std::string &qqid);
+
+private:
+	MySqlShardedPool pool;
+	MySqlQueryTracer tracer; // 主库和副本共用
+
+	// 读写分离，玩家写入后的一小段时间内他的读也走主库，避免读不到自己刚写的
+	MySqlReplicaSet replicas;
+	HyTtlCache<std::string, bool> recent_writes;
+	const std::chrono::steady_clock::duration replica_cache_ttl; // 从副本读到的结果最多缓存这么久
+
+	// (idsrc, auth) -> 绑定在一起的所有账号，绑定关系变化时失效
+	HyTtlCache<std::string, std::shared_ptr<const HyIdentitySet>> identity_cache{ std::chrono::minutes(10) };
+
+	// 今天的签到名次计数，日期以数据库为准，每天第一次签到时从数据库读出已签到人数
+	// 假定同一时间只有本进程处理签到，签到事务回滚时用掉的名次不会收回
+	std::mutex sign_rank_m;
+	int64_t sign_rank_day = 0;
+	int sign_rank_count = 0;
+};
@@ -0,0 +1,112 @@
+#include "HyWriteBehind.h"
+
+std::string HyWriteBehindQueue::key_of(std::string_view idsrc, std::string_view auth, std::string_view code)
+{
+	std::string key;
+	key.reserve(idsrc.size() + auth.size() + code.size() + 2);
+	key.append(idsrc).push_back('\0');
+	key.append(auth).push_back('\0');
+	key.append(code);
+	return key;
+}
+
+HyWriteBehindQueue::shard &HyWriteBehindQueue::shard_of(const std::string &key)
+{
+	return shards[std::hash<std::string>()(key) % shard_count];
+}
+
+const HyWriteBehindQueue::shard &HyWriteBehindQueue::shard_of(const std::string &key) const
+{
+	return shards[std::hash<std::string>()(key) % shard_count];
+}
+
+size_t HyWriteBehindQueue::add(const std::string &idsrc, const std::string &auth, const std::string &code, int32_t delta)
+{
+	auto key = key_of(idsrc, auth, code);
+	auto &s = shard_of(key);
+	std::lock_guard l(s.m);
+	auto [iter, inserted] = s.pending.try_emplace(std::move(key));
+	if (inserted)
+	{
+		iter->second = HyItemGrant{ idsrc, auth, code, delta };
+		return count.fetch_add(1, std::memory_order_relaxed) + 1;
+	}
+	iter->second.add_amount += delta;
+	return count.load(std::memory_order_relaxed);
+}
+
+int32_t HyWriteBehindQueue::peek(std::string_view idsrc, std::string_view auth, std::string_view code) const
+{
+	auto key = key_of(idsrc, auth, code);
+	auto &s = shard_of(key);
+	std::lock_guard l(s.m);
+	auto iter = s.pending.find(key);
+	auto flying = s.in_flight.find(key);
+	return (iter != s.pending.end() ? iter->second.add_amount : 0) + (flying != s.in_flight.end() ? flying->second : 0);
+}
+
+int32_t HyWriteBehindQueue::in_flight(std::string_view idsrc, std::string_view auth, std::string_view code) const
+{
+	auto key = key_of(idsrc, auth, code);
+	auto &s = shard_of(key);
+	std::lock_guard l(s.m);
+	auto iter = s.in_flight.find(key);
+	return iter != s.in_flight.end() ? iter->second : 0;
+}
+
+int32_t HyWriteBehindQueue::take(std::string_view idsrc, std::string_view auth, std::string_view code)
+{
+	auto key = key_of(idsrc, auth, code);
+	auto &s = shard_of(key);
+	std::lock_guard l(s.m);
+	auto iter = s.pending.find(key);
+	if (iter == s.pending.end())
+		return 0;
+	int32_t delta = iter->second.add_amount;
+	s.pending.erase(iter);
+	count.fetch_sub(1, std::memory_order_relaxed);
+	return delta;
+}
+
+std::vector<HyItemGrant> HyWriteBehindQueue::drain()
+{
+	std::vector<HyItemGrant> result;
+	result.reserve(size());
+	for (auto &s : shards)
+	{
+		std::unordered_map<std::string, HyItemGrant> pending;
+		{
+			std::lock_guard l(s.m);
+			pending.swap(s.pending);
+			count.fetch_sub(pending.size(), std::memory_order_relaxed);
+			for (auto &[key, grant] : pending)
+				s.in_flight[key] += grant.add_amount;
+		}
+		for (auto &[key, grant] : pending)
+			result.push_back(std::move(grant));
+	}
+	return result;
+}
+
+void HyWriteBehindQueue::settle(const std::vector<HyItemGrant> &grants, const std::vector<bool> &requeue)
+{
+	for (size_t i = 0; i < grants.size(); ++i)
+	{
+		const auto &g = grants[i];
+		auto key = key_of(g.idsrc, g.auth, g.code);
+		auto &s = shard_of(key);
+		std::lock_guard l(s.m);
+		if (auto iter = s.in_flight.find(key); iter != s.in_flight.end() && (iter->second -= g.add_amount) == 0)
+			s.in_flight.erase(iter);
+		if (!requeue[i])
+			continue;
+		auto [iter, inserted] = s.pending.try_emplace(std::move(key));
+		if (inserted)
+		{
+			iter->second = g;
+			count.fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+			iter->second.add_amount += g.add_amount;
+	}
+}
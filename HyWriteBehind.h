@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "HyDatabase.h"
+
+// 道具增量的合并队列，只在内存里
+// 同一个(idsrc, auth, code)的增量累加成一项，按key分片加锁，互不影响
+// drain取出的增量在settle之前还记在正在写入的部分里，查询数量时照样算上
+class HyWriteBehindQueue
+{
+public:
+	// 返回累加之后队列里的项数
+	size_t add(const std::string &idsrc, const std::string &auth, const std::string &code, int32_t delta);
+
+	// 某一项还没写入的增量，包括正在写入的
+	int32_t peek(std::string_view idsrc, std::string_view auth, std::string_view code) const;
+	// 某一项正在批量写入的增量
+	int32_t in_flight(std::string_view idsrc, std::string_view auth, std::string_view code) const;
+	// 取出某一项，调用者负责写入；正在写入的部分不取
+	int32_t take(std::string_view idsrc, std::string_view auth, std::string_view code);
+	// 取出全部，转入正在写入的部分
+	std::vector<HyItemGrant> drain();
+	// drain出来的写完了，requeue为true的放回队列，和从正在写入的部分里去掉在同一次加锁里完成
+	void settle(const std::vector<HyItemGrant> &grants, const std::vector<bool> &requeue);
+
+	size_t size() const { return count.load(std::memory_order_relaxed); }
+
+private:
+	static constexpr size_t shard_count = 16;
+
+	struct shard
+	{
+		mutable std::mutex m;
+		std::unordered_map<std::string, HyItemGrant> pending;
+		std::unordered_map<std::string, int32_t> in_flight;
+	};
+
+	static std::string key_of(std::string_view idsrc, std::string_view auth, std::string_view code);
+	shard &shard_of(const std::string &key);
+	const shard &shard_of(const std::string &key) const;
+
+	std::array<shard, shard_count> shards;
+	std::atomic<size_t> count = 0;
+};
@@ -1,6 +1,33 @@
 #pragma once
 
 #include <boost/mysql.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <functional>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "DatabaseConfig.h"
+#include "MySqlQueryTrace.h"
+
+// 连接的截止时间到了，操作被中断，连接已经被丢弃
+class MySqlTimeoutError : public boost::system::system_error
+{
+public:
+    MySqlTimeoutError() : boost::system::system_error(boost::asio::error::timed_out, "mysql deadline exceeded") {}
+};
+
+// 服务器返回的错误（语法、约束、死锁等），连接本身还能继续用
+// 其他的（EOF、连接重置、协议错误）说明连接已经坏了；客户端错误码从0x10000开始
+inline bool MySqlIsServerError(const boost::system::error_code &ec)
+{
+    static const auto &mysql_category = boost::mysql::make_error_code(boost::mysql::errc::er_lock_deadlock).category();
+    return ec.category() == mysql_category && ec.value() > 0 && ec.value() < 0x10000;
+}
 
 class MySqlConnection : public std::enable_shared_from_this<MySqlConnection>
 {
@@ -9,8 +36,8 @@ public:
         dbc(std::move(config)),
         conn_params(dbc.user, dbc.pass, dbc.schema, boost::mysql::collation::utf8_general_ci, boost::mysql::ssl_mode::disable),
         ioc(std::move(io_context)),
-        resolver(*ioc),
-        connection(*ioc)
+        connection(*ioc),
+        watchdog(*ioc)
     {
 
     }
@@ -26,9 +53,10 @@ public:
     const DatabaseConfig dbc;
     const std::shared_ptr<boost::asio::io_context> ioc;
     boost::mysql::connection_params conn_params;  // MySQL credentials and other connection config
-    boost::asio::ip::tcp::resolver resolver;
     boost::mysql::tcp_connection connection;
-    boost::asio::ip::tcp::endpoint endpoint;
+    boost::asio::steady_timer watchdog; // 截止时间
+    std::mutex socket_m; // 截止时间到期时的shutdown和fail里的close互斥，close之后描述符可能已经被别的socket用了
+    std::vector<boost::asio::ip::tcp::endpoint> endpoints; // 由连接池解析并缓存
 
     enum class Status
     {
@@ -39,33 +67,19 @@ public:
         on_ping
     };
 
-    void start()
+    void start(std::vector<boost::asio::ip::tcp::endpoint> eps)
     {
-        resolver.async_resolve(
-                dbc.host,
-                dbc.port,
-                std::bind(
-                        &MySqlConnection::on_resolve,
-                        this->shared_from_this(),
-                        std::placeholders::_1,
-                        std::placeholders::_2));
-    }
-
-    void on_resolve(
-            boost::system::error_code ec,
-            boost::asio::ip::tcp::resolver::results_type results)
-    {
-        if (ec)
-            return fail(ec, "resolve");
-        boost::asio::async_connect(connection.next_layer(),
-                results.begin(), results.end(),
-                std::bind(&MySqlConnection::on_connect, this->shared_from_this(), std::placeholders::_1)
+        started_at = std::chrono::steady_clock::now();
+        endpoints = std::move(eps);
+        boost::asio::async_connect(connection.next_layer(), endpoints,
+                [sp = this->shared_from_this()](boost::system::error_code ec, const boost::asio::ip::tcp::endpoint &) { sp->on_connect(ec); }
             );
     }
 
     void on_connect(boost::system::error_code ec) {
         if (ec)
             return fail(ec, "connect");
+        connected = true;
 
         connection.async_handshake(conn_params,
                std::bind(&MySqlConnection::on_handshake, this->shared_from_this(), std::placeholders::_1)
@@ -77,50 +91,182 @@ public:
             return fail(ec, "handshake");
         
         assert(status.load() == Status::invalid);
-        status.store(Status::available);
+        if (!setup)
+            return on_idle(shared_from_this()); // 交给连接池，可能直接分配给等待者
 
-        start_ping(ec);
+        // 先做会话初始化（比如预编译语句），完成后才算可用
+        boost::asio::co_spawn(*ioc, setup(*this), [sp = shared_from_this()](std::exception_ptr e) {
+            if (!e)
+                return sp->on_idle(sp);
+            try
+            {
+                std::rethrow_exception(e);
+            }
+            catch (const boost::system::system_error &err)
+            {
+                sp->fail(err.code(), "setup");
+            }
+            catch (...)
+            {
+                sp->fail(boost::asio::error::fault, "setup");
+            }
+        });
     }
 
-    void start_ping(const boost::system::error_code& ec)
+    // 由连接池对空闲太久的连接调用，期间连接不在空闲栈里
+    void ping()
     {
-        if (ec)
-            return fail(ec, "start_ping");
-        using namespace std::chrono_literals;
-        std::shared_ptr<boost::asio::system_timer> st = std::make_shared<boost::asio::system_timer>(*ioc);
-        st->expires_after(20s);
-        st->async_wait([sp = shared_from_this(), st](const boost::system::error_code& ec) { sp->on_ping(ec); });
+        status.store(Status::on_ping);
+        connection.async_query("SELECT 1=1;", [sp = shared_from_this()](const boost::system::error_code &ec, boost::mysql::tcp_resultset &&res) {
+            if (ec)
+                return sp->fail(ec, "ping");
+            std::shared_ptr<boost::mysql::tcp_resultset> pres = std::make_shared<boost::mysql::tcp_resultset>(std::move(res));
+            pres->async_read_all([sp, pres](const boost::system::error_code& ec, std::vector<boost::mysql::row> res) {
+                if (ec)
+                    return sp->fail(ec, "ping");
+                sp->on_idle(sp);
+            });
+        });
     }
 
-    void on_ping(const boost::system::error_code& ec)
+    // 预编译语句缓存，key由调用者决定，第一次用到时才预编译
+    // 连接失败重建后是新的MySqlConnection，缓存自然失效
+    boost::mysql::tcp_prepared_statement &prepare(uint32_t key, std::string_view sql)
     {
-        if (ec)
-            return fail(ec, "on_ping");
-        if (auto desired = Status::available; status.compare_exchange_strong(desired, Status::on_ping))
+        auto iter = statements.find(key);
+        if (iter == statements.end())
+            iter = statements.emplace(key, guard([&] { return connection.prepare_statement(sql); })).first;
+        return iter->second;
+    }
+
+    boost::asio::awaitable<boost::mysql::tcp_prepared_statement *> async_prepare(uint32_t key, std::string_view sql)
+    {
+        auto iter = statements.find(key);
+        if (iter == statements.end())
+            iter = statements.emplace(key, co_await guard(connection.async_prepare_statement(sql, boost::asio::use_awaitable))).first;
+        co_return &iter->second;
+    }
+
+    // 由连接池在取出时设置，为0时不限制；每次guard里的操作单独计时，流式读取时每读一批重新计时
+    void set_deadline(std::chrono::steady_clock::duration timeout)
+    {
+        deadline_timeout = timeout;
+    }
+
+    // 到期时只shutdown让正在进行的操作（包括同步的）返回，socket由持有者在fail里关闭，避免和还在用socket的线程竞争
+    void arm_deadline()
+    {
+        auto generation = ++deadline_generation;
+        if (deadline_timeout <= deadline_timeout.zero())
+            return;
+        watchdog.expires_after(deadline_timeout);
+        watchdog.async_wait([wp = weak_from_this(), generation](const boost::system::error_code &ec) {
+            auto sp = wp.lock();
+            if (ec || !sp)
+                return;
+            // 已经结束或者重新设置过的话，这次到期作废；检查和shutdown之间持有者不能close
+            std::lock_guard l(sp->socket_m);
+            if (sp->deadline_generation.load() != generation || sp->status.load() == Status::failed)
+                return;
+            sp->timed_out.store(true);
+            boost::system::error_code ignored;
+            sp->connection.next_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+        });
+    }
+
+    void disarm_deadline()
+    {
+        ++deadline_generation;
+        if (deadline_timeout > deadline_timeout.zero())
+            watchdog.cancel();
+    }
+
+    // 一次操作的计时，离开作用域时取消
+    struct deadline_scope
+    {
+        explicit deadline_scope(MySqlConnection &conn) : conn(conn) { conn.arm_deadline(); }
+        deadline_scope(const deadline_scope &) = delete;
+        deadline_scope &operator=(const deadline_scope &) = delete;
+        ~deadline_scope() { conn.disarm_deadline(); }
+
+        MySqlConnection &conn;
+    };
+
+    // 除了服务器返回的错误，协议状态都未知，标记为失败，归还时不会再放回空闲栈；超时的换成MySqlTimeoutError
+    // 只能在catch里调用
+    [[noreturn]] void rethrow_failure(const boost::system::error_code &ec)
+    {
+        if (timed_out.load())
         {
-            // unique connection here
-            connection.async_query("SELECT 1=1;", [sp = shared_from_this()](const boost::system::error_code &ec, boost::mysql::tcp_resultset &&res) {
-                std::shared_ptr<boost::mysql::tcp_resultset> pres = std::make_shared<boost::mysql::tcp_resultset>(std::move(res));
-                pres->async_read_all([sp, pres](const boost::system::error_code& ec, std::vector<boost::mysql::row> res) {
-                    assert(sp->status.load() == Status::on_ping);
-                    sp->status.store(Status::available);
-                    sp->start_ping(ec);
-                });
-            });
+            fail(boost::asio::error::timed_out, "deadline");
+            throw MySqlTimeoutError();
         }
-        else
+        if (ec == boost::asio::error::operation_aborted)
+            fail(ec, "cancelled");
+        else if (!MySqlIsServerError(ec))
+            fail(ec, "query");
+        throw;
+    }
+
+    template<class T>
+    boost::asio::awaitable<T> guard(boost::asio::awaitable<T> op)
+    {
+        try
         {
-            start_ping(ec);
+            deadline_scope deadline(*this);
+            co_return co_await std::move(op);
+        }
+        catch (const boost::system::system_error &e)
+        {
+            rethrow_failure(e.code());
         }
     }
 
+    template<class Fn>
+    auto guard(Fn fn) -> decltype(fn())
+    {
+        try
+        {
+            deadline_scope deadline(*this);
+            return fn();
+        }
+        catch (const boost::system::system_error &e)
+        {
+            rethrow_failure(e.code());
+        }
+    }
+
+    // 由持有者调用，连接不会再用，关闭socket；已经失败过的不再重复通知连接池
     void fail(boost::system::error_code ec, const std::string &what) {
-        status.store(Status::failed);
+        if (status.exchange(Status::failed) == Status::failed)
+            return;
         last_error = ec;
+        {
+            std::lock_guard l(socket_m);
+            boost::system::error_code ignored;
+            connection.next_layer().close(ignored);
+        }
+        if (on_failed)
+            on_failed(shared_from_this()); // 由连接池安排重连
     }
 
 public:
     boost::system::error_code last_error;
     std::weak_ptr<void> accessor;
     std::atomic<Status> status = Status::invalid;
+    std::atomic<bool> retired = false;
+    std::atomic<bool> timed_out = false; // 截止时间到了，socket已经shutdown
+    bool connected = false; // TCP连接建立过，失败时连接池据此判断是不是地址连不上
+    std::atomic<uint64_t> deadline_generation = 0;
+    std::chrono::steady_clock::duration deadline_timeout{};
+    uint32_t slot = 0; // 在连接池中的槽位
+    std::atomic<std::chrono::steady_clock::time_point> idle_since{}; // 最近一次归还的时间，trim不取出连接也会读
+    std::chrono::steady_clock::time_point in_use_since; // 最近一次取出的时间
+    std::chrono::steady_clock::time_point started_at; // 发起连接的时间
+    std::function<void(std::shared_ptr<MySqlConnection>)> on_idle; // 连接变为空闲时回调，由连接池设置
+    std::function<void(std::shared_ptr<MySqlConnection>)> on_failed; // 连接失败时回调，由连接池设置
+    std::function<void(boost::system::error_code)> on_ready; // 第一次握手完成或失败时回调一次，预热用
+    std::function<boost::asio::awaitable<void>(MySqlConnection &)> setup; // 握手后的会话初始化
+    std::unordered_map<uint32_t, boost::mysql::tcp_prepared_statement> statements; // 只有持有连接的人能访问
+    MySqlQueryContext trace; // 每次取出时由取连接的人设置，只有持有连接的人能访问
 };
\ No newline at end of file
@@ -5,73 +5,598 @@
 #include "MySqlConnection.h"
 
 #include <mutex>
+#include <random>
+#include <thread>
 
-MySqlConnectionPool::MySqlConnectionPool(const DatabaseConfig & c) : config(c)
+using namespace std::chrono_literals;
+
+// 维护（回收/补充空闲连接）的间隔
+static constexpr auto maintain_interval = 5s;
+
+MySqlConnectionPool::MySqlConnectionPool(const DatabaseConfig & c, std::shared_ptr<boost::asio::io_context> io_context) :
+	idle(std::max<uint32_t>(c.pool.max_size, 1)),
+	options(c.pool),
+	capacity(std::max<uint32_t>(c.pool.max_size, 1)),
+	slots(std::make_unique<std::shared_ptr<MySqlConnection>[]>(capacity)),
+	config(c),
+	ioc(std::move(io_context)),
+	maintain_timer(*ioc),
+	grow_timer(*ioc),
+	resolver(*ioc)
 {
+	// 倒序放入，先用小号槽位
+	for (uint32_t i = capacity; i > 0; --i)
+		free_slots.push_back(i - 1);
+}
 
+MySqlConnectionPool::~MySqlConnectionPool()
+{
+	// 重连定时器、地址解析和比连接池活得久的连接之后到达的回调都不再访问这里
+	std::weak_ptr<void> token = alive;
+	alive.reset();
+	while (!token.expired())
+		std::this_thread::yield();
+
+	std::deque<std::unique_ptr<waiter>> aborted;
+	{
+		std::lock_guard l(m);
+		aborted.swap(waiters);
+		waiting.store(0);
+		maintain_timer.cancel();
+		grow_timer.cancel();
+	}
+	{
+		std::lock_guard l(resolve_m);
+		resolver.cancel();
+		resolving.clear();
+	}
+	for (auto &w : aborted)
+		w->complete(boost::asio::error::operation_aborted, nullptr);
+	clear();
 }
 
-MySqlConnectionPool::~MySqlConnectionPool() = default;
+auto MySqlConnectionPool::acquire() -> connection_ptr
+{
+	// 不再自旋，阻塞在future上等待连接归还
+	return async_acquire(boost::asio::use_future).get();
+}
 
-std::shared_ptr<boost::mysql::tcp_connection> MySqlConnectionPool::acquire()
+auto MySqlConnectionPool::try_acquire() -> connection_ptr
 {
-	reserve(1);
+	if (waiting.load() > 0)
+		return nullptr;
+	if (auto conn = pop_idle())
+		return make_handle(std::move(conn));
+	return nullptr;
+}
+
+void MySqlConnectionPool::set_peers(std::vector<MySqlConnectionPool *> p)
+{
+	peers = std::move(p);
+}
+
+void MySqlConnectionPool::enqueue(std::unique_ptr<waiter> w)
+{
+	if (hibernating.load())
+		hibernating.store(false);
 
-	std::shared_ptr<boost::mysql::tcp_connection> ret = nullptr;
-	while (ret == nullptr)
+	// 没有人排队时直接从空闲栈取，不加锁
+	if (waiting.load() == 0)
 	{
+		if (auto conn = pop_idle())
+			return hand_over(*w, make_handle(std::move(conn)));
+	}
+
+	// 自己的分片用完了，从其他分片借一个，用完归还到原来的分片
+	for (auto peer : peers)
+	{
+		if (auto conn = peer->try_acquire())
 		{
-			std::lock_guard l(m); // 先加锁
-			if (auto iter = std::find_if(v.cbegin(), v.cend(), [](const std::shared_ptr<MySqlConnection>& p) { return p->status.load() == MySqlConnection::Status::available; }); iter != v.cend())
+			MySqlPoolMetrics::add(stats.stolen);
+			return hand_over(*w, std::move(conn));
+		}
+	}
+
+	std::unique_lock l(m); // 先加锁
+	const uint64_t id = w->id = ++next_waiter_id;
+	if (options.query_timeout > options.query_timeout.zero())
+	{
+		w->timer = std::make_unique<boost::asio::steady_timer>(*ioc, options.query_timeout);
+		w->timer->async_wait(guarded([this, id](const boost::system::error_code &ec) {
+			if (!ec)
+				abandon(id, boost::asio::error::timed_out);
+		}));
+	}
+	// 取消槽的回调可能在emit里执行，不在里面完成等待者，投递到io_context
+	w->on_cancel(guarded([this, id] {
+		boost::asio::post(*ioc, guarded([this, id] { abandon(id, boost::asio::error::operation_aborted); }));
+	}));
+	waiters.push_back(std::move(w));
+	waiting.store(waiters.size());
+	MySqlPoolMetrics::add(stats.queued);
+
+	// 一个连接都没有的时候先建立一个，建立完成后会交给队首
+	if (count == 0)
+		grow(1);
+
+	// 开始排队，等待时间超过阈值还没拿到连接就在后台扩容
+	if (waiters.size() == 1)
+	{
+		grow_timer.expires_after(options.grow_after);
+		grow_timer.async_wait(guarded([this](const boost::system::error_code &ec) { on_grow_timer(ec); }));
+	}
+
+	// 入队之后要再检查一次空闲栈，否则可能错过入队前刚归还的连接
+	serve(l);
+}
+
+void MySqlConnectionPool::abandon(uint64_t id, boost::system::error_code ec)
+{
+	std::unique_ptr<waiter> w;
+	{
+		std::lock_guard l(m);
+		auto iter = std::find_if(waiters.begin(), waiters.end(), [id](const std::unique_ptr<waiter> &w) { return w->id == id; });
+		if (iter == waiters.end())
+			return; // 已经拿到连接了
+		w = std::move(*iter);
+		waiters.erase(iter);
+		waiting.store(waiters.size());
+	}
+	w->complete(ec, nullptr);
+}
+
+void MySqlConnectionPool::serve(std::unique_lock<std::mutex> &l)
+{
+	std::vector<std::pair<std::unique_ptr<waiter>, std::shared_ptr<MySqlConnection>>> ready;
+	while (!waiters.empty())
+	{
+		auto conn = pop_idle();
+		if (!conn)
+			break;
+		ready.emplace_back(std::move(waiters.front()), std::move(conn));
+		waiters.pop_front();
+	}
+	waiting.store(waiters.size());
+	l.unlock();
+
+	for (auto &[w, conn] : ready)
+		hand_over(*w, make_handle(std::move(conn)));
+}
+
+void MySqlConnectionPool::hand_over(waiter &w, connection_ptr conn)
+{
+	MySqlPoolMetrics::add(stats.acquires);
+	stats.wait_time.record(std::chrono::steady_clock::now() - w.since);
+	w.complete({}, std::move(conn));
+}
+
+bool MySqlConnectionPool::claim(MySqlConnection &conn)
+{
+	auto expected = MySqlConnection::Status::available;
+	return conn.status.compare_exchange_strong(expected, MySqlConnection::Status::in_use);
+}
+
+std::shared_ptr<MySqlConnection> MySqlConnectionPool::pop_idle()
+{
+	for (uint32_t i; (i = idle.pop()) != MySqlIdleStack::npos;)
+	{
+		// 从栈里取出之后只有自己能访问这个槽位，直接读不会有竞争
+		auto conn = slots[i];
+		if (claim(*conn))
+			return conn;
+	}
+	return nullptr;
+}
+
+void MySqlConnectionPool::release(std::shared_ptr<MySqlConnection> conn)
+{
+	conn->disarm_deadline();
+	if (conn->retired.load())
+	{
+		// 已经被clear，不再放回池中
+		std::lock_guard l(m);
+		free_slot(conn->slot);
+		return;
+	}
+	// socket已经因为超时关闭，但持有者没有再用它，没有发现
+	if (conn->timed_out.load() && conn->status.load() == MySqlConnection::Status::in_use)
+		conn->fail(boost::asio::error::timed_out, "deadline");
+	auto status = conn->status.load();
+	if (status == MySqlConnection::Status::failed)
+		return;
+
+	conn->idle_since = std::chrono::steady_clock::now();
+	if (status == MySqlConnection::Status::invalid)
+	{
+		if (auto on_ready = std::exchange(conn->on_ready, nullptr))
+			on_ready({});
+		consecutive_failures.store(0);
+		MySqlPoolMetrics::add(stats.handshakes);
+		stats.handshake_time.record(conn->idle_since.load() - conn->started_at);
+	}
+	else if (status == MySqlConnection::Status::in_use)
+	{
+		stats.hold_time.record(conn->idle_since.load() - conn->in_use_since);
+	}
+	push_idle(conn);
+}
+
+void MySqlConnectionPool::push_idle(const std::shared_ptr<MySqlConnection> &conn)
+{
+	conn->status.store(MySqlConnection::Status::available);
+	idle.push(conn->slot);
+
+	// 有人在排队的话由归还者负责分配，和enqueue里的检查配对
+	if (waiting.load() > 0)
+	{
+		std::unique_lock l(m);
+		serve(l);
+	}
+}
+
+auto MySqlConnectionPool::make_handle(std::shared_ptr<MySqlConnection> conn) -> connection_ptr
+{
+	auto raw = conn.get();
+	conn->in_use_since = std::chrono::steady_clock::now();
+	conn->set_deadline(options.query_timeout);
+	return connection_ptr(raw, [give_back = guarded([this](std::shared_ptr<MySqlConnection> c) { release(std::move(c)); }), conn = std::move(conn)](MySqlConnection *) mutable {
+		// 持有期间可能因为超时或者读到一半放弃而被标记为失败
+		assert(conn->status.load() == MySqlConnection::Status::in_use || conn->status.load() == MySqlConnection::Status::failed);
+		give_back(conn);
+	});
+}
+
+std::vector<std::shared_ptr<MySqlConnection>> MySqlConnectionPool::grow(size_t delta, std::function<void(boost::system::error_code)> on_ready)
+{
+	std::vector<std::shared_ptr<MySqlConnection>> new_v;
+	for (; delta > 0 && !free_slots.empty(); --delta)
+	{
+		auto conn = make_connection(free_slots.back());
+		conn->on_ready = on_ready;
+		free_slots.pop_back();
+		++count;
+		connect(conn);
+		new_v.push_back(std::move(conn));
+	}
+	return new_v;
+}
+
+void MySqlConnectionPool::connect(std::shared_ptr<MySqlConnection> conn)
+{
+	std::unique_lock l(resolve_m);
+	if (std::chrono::steady_clock::now() < endpoints_expire)
+	{
+		auto eps = endpoints;
+		l.unlock();
+		return conn->start(std::move(eps));
+	}
+
+	// 同一时间只解析一次，其他连接等结果
+	resolving.push_back(std::move(conn));
+	if (resolving.size() == 1)
+	{
+		resolver.async_resolve(config.host, config.port, guarded([this](const boost::system::error_code &ec, boost::asio::ip::tcp::resolver::results_type results) {
+			on_resolve(ec, results);
+		}));
+	}
+}
+
+void MySqlConnectionPool::on_resolve(const boost::system::error_code &ec, const boost::asio::ip::tcp::resolver::results_type &results)
+{
+	std::vector<std::shared_ptr<MySqlConnection>> pending;
+	std::vector<boost::asio::ip::tcp::endpoint> eps;
+	{
+		std::lock_guard l(resolve_m);
+		pending.swap(resolving);
+		if (!ec)
+		{
+			endpoints.clear();
+			for (const auto &entry : results)
+				endpoints.push_back(entry.endpoint());
+			endpoints_expire = std::chrono::steady_clock::now() + options.resolve_ttl;
+			eps = endpoints;
+		}
+	}
+
+	for (auto &conn : pending)
+	{
+		if (ec)
+			conn->fail(ec, "resolve");
+		else
+			conn->start(eps);
+	}
+}
+
+void MySqlConnectionPool::warm_up(size_t n, std::unique_ptr<notifier> done)
+{
+	struct warm_up_state
+	{
+		std::atomic<size_t> remaining = 1; // 多出来的1在所有连接发起之后才减掉
+		std::mutex m;
+		boost::system::error_code ec;
+		std::unique_ptr<notifier> done;
+
+		void finish(boost::system::error_code e)
+		{
+			if (e)
 			{
-				// 有可用连接，设置后返回。
-				auto conn = *iter;
-				auto expected = MySqlConnection::Status::available;
-				if (conn->status.compare_exchange_strong(expected, MySqlConnection::Status::in_use))
-				{
-					std::shared_ptr<MySqlConnection> sp(conn.get(), [](MySqlConnection* p) {
-						assert(p->status.load() == MySqlConnection::Status::in_use);
-						p->status.store(MySqlConnection::Status::available);
-						});
-					ret = std::shared_ptr<boost::mysql::tcp_connection>(sp, &conn->connection);
-					break;
-				}
+				std::lock_guard l(m);
+				if (!ec)
+					ec = e;
 			}
+			if (remaining.fetch_sub(1) == 1)
+				done->complete(ec);
 		}
-		
-		std::this_thread::yield();
-		//continue;
+	};
+	auto state = std::make_shared<warm_up_state>();
+	state->done = std::move(done);
+
+	{
+		std::lock_guard l(m);
+		if (n > count)
+		{
+			state->remaining += std::min<size_t>(n - count, free_slots.size());
+			grow(n - count, [state](boost::system::error_code ec) { state->finish(ec); });
+		}
+	}
+	state->finish({});
+}
+
+std::shared_ptr<MySqlConnection> MySqlConnectionPool::make_connection(uint32_t i)
+{
+	auto conn = std::make_shared<MySqlConnection>(config, ioc);
+	conn->slot = i;
+	conn->on_idle = guarded([this](std::shared_ptr<MySqlConnection> c) { release(std::move(c)); });
+	conn->on_failed = guarded([this](std::shared_ptr<MySqlConnection> c) { on_failed(std::move(c)); });
+	conn->setup = setup;
+	slots[i] = conn;
+	MySqlPoolMetrics::add(stats.opened);
+	return conn;
+}
+
+void MySqlConnectionPool::on_failed(std::shared_ptr<MySqlConnection> conn)
+{
+	MySqlPoolMetrics::add(stats.failures);
+	if (auto on_ready = std::exchange(conn->on_ready, nullptr))
+		on_ready(conn->last_error);
+
+	// 查询超时和调用者取消说明的是这条查询，不是数据库连不上，不算进健康状态
+	const bool caller_side = conn->timed_out.load() || conn->last_error == boost::asio::error::operation_aborted;
+
+	// 缓存的地址都连不上，可能是DNS变了或者主从切换了，下次重连重新解析
+	if (!conn->connected && !caller_side)
+	{
+		std::lock_guard l(resolve_m);
+		endpoints_expire = {};
+	}
+
+	// 连续失败时指数退避，加一点随机避免所有连接同时重连
+	auto failures = std::min<uint32_t>(caller_side ? consecutive_failures.load() : consecutive_failures.fetch_add(1), 16);
+	auto delay = std::min<std::chrono::milliseconds>(options.reconnect_min * (1u << failures), options.reconnect_max);
+	thread_local std::minstd_rand rng(std::random_device{}());
+	delay += std::chrono::milliseconds(std::uniform_int_distribution<int64_t>(0, delay.count() / 4)(rng));
+
+	auto timer = std::make_shared<boost::asio::steady_timer>(*ioc, delay);
+	timer->async_wait(guarded([this, timer, conn = std::move(conn)](const boost::system::error_code &ec) {
+		if (!ec)
+			reconnect(conn);
+	}));
+}
+
+void MySqlConnectionPool::reconnect(const std::shared_ptr<MySqlConnection> &old)
+{
+	std::shared_ptr<MySqlConnection> conn;
+	{
+		std::lock_guard l(m);
+		if (slots[old->slot] != old)
+			return;
+		if (old->retired.load())
+		{
+			free_slot(old->slot);
+			return;
+		}
+		// 在原来的槽位上建立新连接，握手完成后进入空闲栈或交给等待者
+		conn = make_connection(old->slot);
 	}
-	return ret;
+	MySqlPoolMetrics::add(stats.reconnects);
+	connect(std::move(conn));
+}
+
+std::shared_ptr<MySqlConnection> MySqlConnectionPool::free_slot(uint32_t i)
+{
+	free_slots.push_back(i);
+	--count;
+	return std::move(slots[i]);
 }
 
 void MySqlConnectionPool::reserve(size_t n)
 {
-	if (n <= v.size())
+	async_reserve(n, boost::asio::use_future).wait();
+}
+
+void MySqlConnectionPool::set_session_setup(session_setup fn)
+{
+	std::lock_guard l(m);
+	setup = std::move(fn);
+}
+
+void MySqlConnectionPool::start()
+{
+	async_start(boost::asio::use_future).wait();
+}
+
+void MySqlConnectionPool::start_maintenance()
+{
+	std::lock_guard l(m);
+	maintain_timer.expires_after(maintain_interval);
+	maintain_timer.async_wait(guarded([this](const boost::system::error_code &ec) { maintain(ec); }));
+}
+
+void MySqlConnectionPool::hibernate()
+{
+	hibernating.store(true);
+	trim(0, std::chrono::steady_clock::duration::zero());
+}
+
+size_t MySqlConnectionPool::connecting() const
+{
+	return std::count_if(slots.get(), slots.get() + capacity, [](const std::shared_ptr<MySqlConnection> &conn) {
+		if (!conn)
+			return false;
+		auto status = conn->status.load();
+		return status == MySqlConnection::Status::invalid || status == MySqlConnection::Status::failed;
+	});
+}
+
+void MySqlConnectionPool::on_grow_timer(const boost::system::error_code &ec)
+{
+	if (ec)
 		return;
-	auto delta = n - v.size();
-	std::vector<std::shared_ptr<MySqlConnection>> new_v;
-	
-	std::generate_n(std::back_inserter(new_v), delta, [&config = this->config, ioc = GlobalContextSingleton()] {
-		auto conn = std::make_shared<MySqlConnection>(config, ioc);
-		conn->start();
-		return conn;
+
+	std::lock_guard l(m);
+	if (waiters.empty())
+		return;
+
+	// 数据库连不上的时候扩容也没用，等重连
+	if (consecutive_failures.load() > 0)
+		return;
+
+	// 排队的人比正在握手的连接多，补上差额，握手完成后直接交给等待者
+	if (auto pending = connecting(); waiters.size() > pending)
+		grow(waiters.size() - pending);
+
+	grow_timer.expires_after(options.grow_after);
+	grow_timer.async_wait(guarded([this](const boost::system::error_code &ec) { on_grow_timer(ec); }));
+}
+
+void MySqlConnectionPool::trim(size_t keep_idle, std::chrono::steady_clock::duration idle_timeout)
+{
+	// 先不取出，只数一下有几个空闲连接需要断开或者发心跳
+	// 取出期间来借连接的人会扑空去新建连接，没有要处理的就不动空闲栈
+	auto now = std::chrono::steady_clock::now();
+	const auto due_after = std::min<std::chrono::steady_clock::duration>(idle_timeout, options.keepalive_after);
+	size_t available = 0, due = 0;
+	{
+		std::lock_guard l(m);
+		std::for_each(slots.get(), slots.get() + capacity, [&](const std::shared_ptr<MySqlConnection> &conn) {
+			if (!conn || conn->status.load() != MySqlConnection::Status::available)
+				return;
+			++available;
+			if (now - conn->idle_since.load() >= due_after)
+				++due;
 		});
+	}
+	if (!due)
+		return;
+
+	// 越靠近栈底的越久没用过，取到要处理的都出来了就停，下面的不动
+	std::vector<std::shared_ptr<MySqlConnection>> idle_conns;
+	for (uint32_t i; due > 0 && (i = idle.pop()) != MySqlIdleStack::npos;)
+	{
+		auto conn = slots[i];
+		if (!claim(*conn))
+			continue;
+		if (now - conn->idle_since.load() >= due_after)
+			--due;
+		idle_conns.push_back(std::move(conn));
+	}
+	// 还留在栈里的也算在保留的空闲连接里
+	const size_t untouched = available > idle_conns.size() ? available - idle_conns.size() : 0;
+
+	std::vector<std::shared_ptr<MySqlConnection>> dropped; // 在锁外断开连接
+	{
+		std::lock_guard l(m);
+		while (idle_conns.size() + untouched > keep_idle && !idle_conns.empty() && now - idle_conns.back()->idle_since.load() >= idle_timeout)
+		{
+			idle_conns.back()->retired.store(true);
+			dropped.push_back(free_slot(idle_conns.back()->slot));
+			idle_conns.pop_back();
+			MySqlPoolMetrics::add(stats.closed);
+		}
+	}
+
+	// 空闲太久的连接发心跳，心跳完成后归还；其余的按原来的顺序放回去
+	std::for_each(idle_conns.rbegin(), idle_conns.rend(), [this, now](const std::shared_ptr<MySqlConnection> &conn) {
+		if (now - conn->idle_since.load() < options.keepalive_after)
+			return push_idle(conn);
+		MySqlPoolMetrics::add(stats.pings);
+		conn->ping();
+	});
+}
+
+void MySqlConnectionPool::maintain(const boost::system::error_code &ec)
+{
+	if (ec)
+		return;
+
+	// 休眠期间归还的连接也一并断开
+	if (hibernating.load())
+		trim(0, std::chrono::steady_clock::duration::zero());
+	else
+		trim(options.min_idle, options.idle_timeout);
 
-	for (auto& conn : new_v)
+	std::lock_guard l(m);
+	if (!hibernating.load())
 	{
-		while (conn->status.load() != MySqlConnection::Status::available)
-			std::this_thread::yield();
+		// 空闲连接不够时提前在后台建立，高峰期不用在请求路径上握手
+		size_t available = std::count_if(slots.get(), slots.get() + capacity, [](const std::shared_ptr<MySqlConnection> &conn) {
+			return conn && conn->status.load() == MySqlConnection::Status::available;
+		});
+		if (auto ready = available + connecting(); ready < options.min_idle)
+			grow(options.min_idle - ready);
 	}
 
+	maintain_timer.expires_after(maintain_interval);
+	maintain_timer.async_wait(guarded([this](const boost::system::error_code &ec) { maintain(ec); }));
+}
+
+MySqlPoolSnapshot MySqlConnectionPool::metrics()
+{
+	MySqlPoolSnapshot result;
 	{
 		std::lock_guard l(m);
-		std::move(new_v.begin(), new_v.end(), std::back_inserter(v));
+		result.size = count;
+		result.waiting = waiters.size();
+		std::for_each(slots.get(), slots.get() + capacity, [&result](const std::shared_ptr<MySqlConnection> &conn) {
+			if (!conn)
+				return;
+			switch (conn->status.load())
+			{
+			case MySqlConnection::Status::invalid: ++result.connecting; break;
+			case MySqlConnection::Status::available: ++result.available; break;
+			case MySqlConnection::Status::in_use: ++result.in_use; break;
+			case MySqlConnection::Status::on_ping: ++result.on_ping; break;
+			case MySqlConnection::Status::failed: ++result.failed; break;
+			}
+		});
 	}
+	auto load = [](const std::atomic<uint64_t> &counter) { return counter.load(std::memory_order_relaxed); };
+	result.acquires = load(stats.acquires);
+	result.queued = load(stats.queued);
+	result.stolen = load(stats.stolen);
+	result.handshakes = load(stats.handshakes);
+	result.opened = load(stats.opened);
+	result.closed = load(stats.closed);
+	result.failures = load(stats.failures);
+	result.reconnects = load(stats.reconnects);
+	result.pings = load(stats.pings);
+	result.wait_time = stats.wait_time.snapshot();
+	result.hold_time = stats.hold_time.snapshot();
+	result.handshake_time = stats.handshake_time.snapshot();
+	return result;
 }
 
 void MySqlConnectionPool::clear()
 {
+	std::vector<std::shared_ptr<MySqlConnection>> dropped; // 在锁外断开连接
 	std::lock_guard l(m); // 先加锁
-	v.clear();
+	for (uint32_t i = 0; i < capacity; ++i)
+	{
+		if (slots[i])
+			slots[i]->retired.store(true);
+	}
+
+	// 空闲的连接直接释放槽位，正在使用、心跳中和等待重连的在归还或重连时释放
+	for (uint32_t i; (i = idle.pop()) != MySqlIdleStack::npos;)
+		dropped.push_back(free_slot(i));
 }
@@ -3,28 +3,213 @@
 #include <memory>
 #include <string>
 #include <mutex>
+#include <deque>
+#include <atomic>
 
 #include <vector>
+#include <functional>
+#include <boost/asio.hpp>
 #include <boost/mysql.hpp>
+#include <boost/version.hpp>
 #include "DatabaseConfig.h"
+#include "GlobalContext.h"
+#include "MySqlIdleStack.h"
+#include "MySqlPoolMetrics.h"
 
 class MySqlConnection;
 
 class MySqlConnectionPool
 {
 public:
-	MySqlConnectionPool(const DatabaseConfig &c = GetDatabaseConfig());
+	MySqlConnectionPool(const DatabaseConfig &c = GetDatabaseConfig(), std::shared_ptr<boost::asio::io_context> io_context = GlobalContextSingleton());
 	~MySqlConnectionPool();
 
+	using connection_ptr = std::shared_ptr<MySqlConnection>;
+	using acquire_signature = void(boost::system::error_code, connection_ptr);
+	using reserve_signature = void(boost::system::error_code);
+	using session_setup = std::function<boost::asio::awaitable<void>(MySqlConnection &)>;
+
 public:
 	// ensures not nullptr
-	std::shared_ptr<boost::mysql::tcp_connection> acquire();
+	connection_ptr acquire();
+
+	// 异步获取连接，可以co_await也可以传回调
+	// 没有空闲连接时按FIFO排队等待，归还连接时直接交给队首的等待者
+	// 排队最多等query_timeout，超时得到timed_out；Boost 1.77以上取消时得到operation_aborted，都会离开队列
+	template<class CompletionToken>
+	auto async_acquire(CompletionToken &&token)
+	{
+		return boost::asio::async_initiate<CompletionToken, acquire_signature>([this](auto handler) {
+			using handler_type = decltype(handler);
+			enqueue(std::make_unique<completion_impl<handler_type, boost::system::error_code, connection_ptr>>(std::move(handler), ioc->get_executor()));
+		}, token);
+	}
+
+	// 并行建立连接直到总数达到n，所有新连接握手（以及会话初始化）完成或失败后才完成
+	// 有连接失败时返回第一个错误，失败的连接会在后台重连
+	template<class CompletionToken>
+	auto async_reserve(size_t n, CompletionToken &&token)
+	{
+		return boost::asio::async_initiate<CompletionToken, reserve_signature>([this, n](auto handler) {
+			using handler_type = decltype(handler);
+			warm_up(n, std::make_unique<completion_impl<handler_type, boost::system::error_code>>(std::move(handler), ioc->get_executor()));
+		}, token);
+	}
+
+	// 开始定期维护，并预热min_idle个连接
+	template<class CompletionToken>
+	auto async_start(CompletionToken &&token)
+	{
+		start_maintenance();
+		return async_reserve(options.min_idle, std::forward<CompletionToken>(token));
+	}
+
+	// 只取空闲连接，没有或者已经有人排队时返回nullptr
+	connection_ptr try_acquire();
+
+	// 自己没有空闲连接时，排队之前先从这些连接池里借
+	void set_peers(std::vector<MySqlConnectionPool *> p);
+
+	// 当前状态和累计统计
+	MySqlPoolSnapshot metrics();
+
+	// 最近一次建立连接成功了，或者还没有失败过
+	bool healthy() const { return consecutive_failures.load() == 0; }
+
+	// 连接都在这个io_context上运行
+	boost::asio::io_context &context() { return *ioc; }
+
+	// 每个新连接握手后都会先执行这个协程，之后才能被取出，需要在start之前设置
+	void set_session_setup(session_setup fn);
+
 	void clear();
 	void reserve(size_t n);
 
+	// 建立min_idle个连接并开始定期维护（回收空闲连接、补充空闲连接）
+	void start();
+	// 断开所有空闲连接，直到下一次acquire之前不再补充
+	void hibernate();
+
+private:
+	template<class... Args>
+	struct completion
+	{
+		virtual ~completion() = default;
+		virtual void complete(Args... args) = 0;
+		// 调用者取消时执行fn，只在排队时设置；handler没有关联取消槽时什么都不做
+		virtual void on_cancel(std::function<void()> fn) {}
+
+		const std::chrono::steady_clock::time_point since = std::chrono::steady_clock::now();
+		uint64_t id = 0; // 排队时分配，超时和取消按id找，不用可能已经被释放的指针
+		std::unique_ptr<boost::asio::steady_timer> timer; // 排队的超时，随等待者一起销毁时取消
+	};
+
+	template<class Handler, class... Args>
+	struct completion_impl : completion<Args...>
+	{
+		completion_impl(Handler h, boost::asio::io_context::executor_type ex) :
+			handler(std::move(h)),
+			work(boost::asio::make_work_guard(boost::asio::get_associated_executor(handler, ex)))
+		{
+
+		}
+
+		void on_cancel(std::function<void()> fn) override
+		{
+#if BOOST_VERSION >= 107700
+			auto slot = boost::asio::get_associated_cancellation_slot(handler);
+			if (slot.is_connected())
+				slot.assign([fn = std::move(fn)](boost::asio::cancellation_type) { fn(); });
+#endif
+		}
+
+		void complete(Args... args) override
+		{
+#if BOOST_VERSION >= 107700
+			// 在恢复调用者之前清掉，之后调用者的下一个操作会用同一个取消槽
+			auto slot = boost::asio::get_associated_cancellation_slot(handler);
+			if (slot.is_connected())
+				slot.clear();
+#endif
+			// 不在归还连接的线程里直接执行等待者
+			boost::asio::post(work.get_executor(), [h = std::move(handler), ...args = std::move(args)]() mutable {
+				h(std::move(args)...);
+			});
+			work.reset();
+		}
+
+		Handler handler;
+		boost::asio::executor_work_guard<boost::asio::associated_executor_t<Handler, boost::asio::io_context::executor_type>> work;
+	};
+
+	// 异步回调和连接上的回调都通过这个包装，连接池析构之后什么都不做
+	template<class Fn>
+	auto guarded(Fn fn)
+	{
+		return [token = std::weak_ptr<void>(alive), fn = std::move(fn)](auto &&...args) mutable {
+			if (auto hold = token.lock())
+				fn(std::forward<decltype(args)>(args)...);
+		};
+	}
+
+	using waiter = completion<boost::system::error_code, connection_ptr>;
+	using notifier = completion<boost::system::error_code>;
+
+	void enqueue(std::unique_ptr<waiter> w);
+	void abandon(uint64_t id, boost::system::error_code ec); // 排队超时或者被取消
+	void hand_over(waiter &w, connection_ptr conn);
+	void release(std::shared_ptr<MySqlConnection> conn);
+	connection_ptr make_handle(std::shared_ptr<MySqlConnection> conn);
+	std::shared_ptr<MySqlConnection> pop_idle();
+	static bool claim(MySqlConnection &conn);
+	void serve(std::unique_lock<std::mutex> &l); // 需要持有m，返回时已解锁
+	std::vector<std::shared_ptr<MySqlConnection>> grow(size_t delta, std::function<void(boost::system::error_code)> on_ready = nullptr); // 需要持有m
+	void warm_up(size_t n, std::unique_ptr<notifier> done);
+	void connect(std::shared_ptr<MySqlConnection> conn);
+	void on_resolve(const boost::system::error_code &ec, const boost::asio::ip::tcp::resolver::results_type &results);
+	void start_maintenance();
+	std::shared_ptr<MySqlConnection> make_connection(uint32_t i); // 需要持有m
+	std::shared_ptr<MySqlConnection> free_slot(uint32_t i); // 需要持有m
+	void on_failed(std::shared_ptr<MySqlConnection> conn);
+	void reconnect(const std::shared_ptr<MySqlConnection> &old);
+	void push_idle(const std::shared_ptr<MySqlConnection> &conn);
+	void trim(size_t keep_idle, std::chrono::steady_clock::duration idle_timeout);
+	void maintain(const boost::system::error_code &ec);
+	void on_grow_timer(const boost::system::error_code &ec);
+	size_t connecting() const; // 需要持有m，包括等待重连的
+
 private:
+	// 空闲连接栈，取出和归还都不加锁
+	MySqlIdleStack idle;
+	std::atomic<size_t> waiting = 0;
+	std::atomic<bool> hibernating = false;
+	std::atomic<uint32_t> consecutive_failures = 0;
+	std::vector<MySqlConnectionPool *> peers;
+	MySqlPoolMetrics stats;
+
+	// 以下成员受m保护，只有建立/释放连接和排队时才需要加锁
 	std::mutex m;
-	std::vector<std::shared_ptr<MySqlConnection>> v;
+	const DatabasePoolOptions options;
+	const uint32_t capacity;
+	std::unique_ptr<std::shared_ptr<MySqlConnection>[]> slots;
+	std::vector<uint32_t> free_slots;
+	size_t count = 0;
+	std::deque<std::unique_ptr<waiter>> waiters;
+	uint64_t next_waiter_id = 0;
+	session_setup setup;
 	DatabaseConfig config;
+	std::shared_ptr<boost::asio::io_context> ioc;
+	boost::asio::steady_timer maintain_timer;
+	boost::asio::steady_timer grow_timer;
+
+	// 地址解析结果，所有连接共用，受resolve_m保护
+	std::mutex resolve_m;
+	boost::asio::ip::tcp::resolver resolver;
+	std::vector<boost::asio::ip::tcp::endpoint> endpoints;
+	std::chrono::steady_clock::time_point endpoints_expire;
+	std::vector<std::shared_ptr<MySqlConnection>> resolving; // 等待解析结果的连接
+
+	// 回调执行期间持有一份引用，析构时放掉自己的这份并等它们结束
+	std::shared_ptr<void> alive = std::make_shared<char>();
 };
 
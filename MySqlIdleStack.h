@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// 空闲连接的无锁栈（Treiber栈）
+// 节点是连接池的槽位下标，next放在单独的数组里，栈顶带版本号防止ABA
+// push和pop都只需要一次CAS
+class MySqlIdleStack
+{
+public:
+	static constexpr uint32_t npos = UINT32_MAX;
+
+	explicit MySqlIdleStack(uint32_t capacity) :
+		next(std::make_unique<std::atomic<uint32_t>[]>(capacity)),
+		head(pack(0, npos))
+	{
+
+	}
+
+	void push(uint32_t index)
+	{
+		uint64_t old_head = head.load();
+		do
+		{
+			next[index].store(index_of(old_head), std::memory_order_relaxed);
+		} while (!head.compare_exchange_weak(old_head, pack(tag_of(old_head) + 1, index)));
+	}
+
+	// 空的时候返回npos
+	uint32_t pop()
+	{
+		uint64_t old_head = head.load();
+		while (index_of(old_head) != npos)
+		{
+			// 这里读到的next可能已经过期，但那样栈顶的版本号也变了，CAS会失败
+			uint32_t new_top = next[index_of(old_head)].load(std::memory_order_relaxed);
+			if (head.compare_exchange_weak(old_head, pack(tag_of(old_head) + 1, new_top)))
+				return index_of(old_head);
+		}
+		return npos;
+	}
+
+private:
+	static constexpr uint64_t pack(uint32_t tag, uint32_t index) { return (uint64_t(tag) << 32) | index; }
+	static constexpr uint32_t tag_of(uint64_t v) { return uint32_t(v >> 32); }
+	static constexpr uint32_t index_of(uint64_t v) { return uint32_t(v); }
+
+	std::unique_ptr<std::atomic<uint32_t>[]> next;
+	alignas(64) std::atomic<uint64_t> head;
+};
@@ -0,0 +1,101 @@
+#include "MySqlPoolMetrics.h"
+
+#include <algorithm>
+#include <sstream>
+
+LatencySnapshot &LatencySnapshot::operator+=(const LatencySnapshot &other)
+{
+	if (buckets.size() < other.buckets.size())
+		buckets.resize(other.buckets.size());
+	for (size_t i = 0; i < other.buckets.size(); ++i)
+		buckets[i] += other.buckets[i];
+	count += other.count;
+	sum += other.sum;
+	max = std::max(max, other.max);
+	return *this;
+}
+
+uint64_t LatencySnapshot::percentile(double q) const
+{
+	if (count == 0)
+		return 0;
+	auto rank = static_cast<uint64_t>(q * count);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < buckets.size(); ++i)
+	{
+		seen += buckets[i];
+		if (seen > rank)
+			return std::min(LatencyHistogram::value_of(i), max);
+	}
+	return max;
+}
+
+LatencySnapshot LatencyHistogram::snapshot() const
+{
+	LatencySnapshot result;
+	result.buckets.reserve(bucket_count);
+	for (auto &b : buckets)
+		result.buckets.push_back(b.load(std::memory_order_relaxed));
+	result.count = count.load(std::memory_order_relaxed);
+	result.sum = sum.load(std::memory_order_relaxed);
+	result.max = max.load(std::memory_order_relaxed);
+	return result;
+}
+
+MySqlPoolSnapshot &MySqlPoolSnapshot::operator+=(const MySqlPoolSnapshot &other)
+{
+	size += other.size;
+	connecting += other.connecting;
+	available += other.available;
+	in_use += other.in_use;
+	on_ping += other.on_ping;
+	failed += other.failed;
+	waiting += other.waiting;
+	acquires += other.acquires;
+	queued += other.queued;
+	stolen += other.stolen;
+	handshakes += other.handshakes;
+	opened += other.opened;
+	closed += other.closed;
+	failures += other.failures;
+	reconnects += other.reconnects;
+	pings += other.pings;
+	wait_time += other.wait_time;
+	hold_time += other.hold_time;
+	handshake_time += other.handshake_time;
+	return *this;
+}
+
+static void DumpLatency(std::ostream &os, const char *name, const LatencySnapshot &s)
+{
+	for (double q : { 0.5, 0.9, 0.99, 0.999 })
+		os << name << "{quantile=\"" << q << "\"} " << s.percentile(q) << '\n';
+	os << name << "_max " << s.max << '\n';
+	os << name << "_sum " << s.sum << '\n';
+	os << name << "_count " << s.count << '\n';
+}
+
+std::string MySqlPoolSnapshot::to_string() const
+{
+	std::ostringstream os;
+	os << "hydb_pool_connections " << size << '\n';
+	os << "hydb_pool_connections{state=\"connecting\"} " << connecting << '\n';
+	os << "hydb_pool_connections{state=\"available\"} " << available << '\n';
+	os << "hydb_pool_connections{state=\"in_use\"} " << in_use << '\n';
+	os << "hydb_pool_connections{state=\"on_ping\"} " << on_ping << '\n';
+	os << "hydb_pool_connections{state=\"failed\"} " << failed << '\n';
+	os << "hydb_pool_waiting " << waiting << '\n';
+	os << "hydb_pool_acquires_total " << acquires << '\n';
+	os << "hydb_pool_queued_total " << queued << '\n';
+	os << "hydb_pool_stolen_total " << stolen << '\n';
+	os << "hydb_pool_opened_total " << opened << '\n';
+	os << "hydb_pool_handshakes_total " << handshakes << '\n';
+	os << "hydb_pool_closed_total " << closed << '\n';
+	os << "hydb_pool_failures_total " << failures << '\n';
+	os << "hydb_pool_reconnects_total " << reconnects << '\n';
+	os << "hydb_pool_pings_total " << pings << '\n';
+	DumpLatency(os, "hydb_pool_wait_us", wait_time);
+	DumpLatency(os, "hydb_pool_hold_us", hold_time);
+	DumpLatency(os, "hydb_pool_handshake_us", handshake_time);
+	return os.str();
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// 直方图的快照，可以累加（合并多个分片）
+struct LatencySnapshot
+{
+	std::vector<uint64_t> buckets;
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	uint64_t max = 0;
+
+	LatencySnapshot &operator+=(const LatencySnapshot &other);
+	uint64_t percentile(double q) const;
+	double mean() const { return count ? double(sum) / count : 0; }
+};
+
+// 对数-线性分桶的延迟直方图（HDR风格），单位微秒
+// 每个2的幂区间再平分成16格，相对误差约6%，记录一次只需要几次relaxed原子加
+class LatencyHistogram
+{
+public:
+	static constexpr unsigned sub_bits = 4;
+	static constexpr unsigned max_bits = 40; // 超过约12天的按最大值算
+	static constexpr size_t bucket_count = size_t(max_bits - sub_bits + 1) << sub_bits;
+
+	void record(std::chrono::steady_clock::duration d)
+	{
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+		record(static_cast<uint64_t>(us > 0 ? us : 0));
+	}
+
+	void record(uint64_t v)
+	{
+		buckets[index_of(v)].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(v, std::memory_order_relaxed);
+		for (auto old = max.load(std::memory_order_relaxed); old < v && !max.compare_exchange_weak(old, v, std::memory_order_relaxed);)
+			;
+	}
+
+	LatencySnapshot snapshot() const;
+
+	static size_t index_of(uint64_t v)
+	{
+		if (v < (uint64_t(1) << sub_bits))
+			return v;
+		unsigned group = std::min<unsigned>(std::bit_width(v) - sub_bits, max_bits - sub_bits);
+		uint64_t sub = std::min<uint64_t>((v >> (group - 1)) - (uint64_t(1) << sub_bits), (uint64_t(1) << sub_bits) - 1);
+		return (size_t(group) << sub_bits) + sub;
+	}
+
+	// 桶的上界，报告分位数时用
+	static uint64_t value_of(size_t index)
+	{
+		size_t group = index >> sub_bits;
+		uint64_t sub = index & ((uint64_t(1) << sub_bits) - 1);
+		if (group == 0)
+			return sub;
+		return ((sub + (uint64_t(1) << sub_bits) + 1) << (group - 1)) - 1;
+	}
+
+private:
+	std::array<std::atomic<uint64_t>, bucket_count> buckets = {};
+	std::atomic<uint64_t> count = 0;
+	std::atomic<uint64_t> sum = 0;
+	std::atomic<uint64_t> max = 0;
+};
+
+// 连接池的计数器，全部是relaxed原子操作
+struct MySqlPoolMetrics
+{
+	std::atomic<uint64_t> acquires = 0; // 成功取得连接的次数
+	std::atomic<uint64_t> queued = 0; // 其中需要排队的次数
+	std::atomic<uint64_t> stolen = 0; // 从其他分片借来的次数
+	std::atomic<uint64_t> handshakes = 0; // 新建连接完成握手的次数
+	std::atomic<uint64_t> opened = 0; // 发起新建连接的次数
+	std::atomic<uint64_t> closed = 0; // 因空闲或休眠断开的次数
+	std::atomic<uint64_t> failures = 0; // 连接失败（握手或心跳）的次数
+	std::atomic<uint64_t> reconnects = 0; // 失败后重建连接的次数
+	std::atomic<uint64_t> pings = 0; // 发出心跳的次数
+
+	LatencyHistogram wait_time; // 从请求到拿到连接
+	LatencyHistogram hold_time; // 从拿到连接到归还
+	LatencyHistogram handshake_time; // 从发起连接到握手完成
+
+	static void add(std::atomic<uint64_t> &counter, uint64_t n = 1) { counter.fetch_add(n, std::memory_order_relaxed); }
+};
+
+// 某一时刻的连接池状态，可以累加（合并多个分片）
+struct MySqlPoolSnapshot
+{
+	// 当前各状态的连接数
+	uint64_t size = 0;
+	uint64_t connecting = 0;
+	uint64_t available = 0;
+	uint64_t in_use = 0;
+	uint64_t on_ping = 0;
+	uint64_t failed = 0;
+	uint64_t waiting = 0;
+
+	// 累计值
+	uint64_t acquires = 0;
+	uint64_t queued = 0;
+	uint64_t stolen = 0;
+	uint64_t handshakes = 0;
+	uint64_t opened = 0;
+	uint64_t closed = 0;
+	uint64_t failures = 0;
+	uint64_t reconnects = 0;
+	uint64_t pings = 0;
+
+	LatencySnapshot wait_time;
+	LatencySnapshot hold_time;
+	LatencySnapshot handshake_time;
+
+	MySqlPoolSnapshot &operator+=(const MySqlPoolSnapshot &other);
+
+	// 文本格式，每行一个指标
+	std::string to_string() const;
+};
@@ -0,0 +1,361 @@
+#include "MySqlQueryTrace.h"
+#include "MySqlConnection.h"
+
+#include <algorithm>
+#include <cctype>
+#include <ctime>
+#include <sstream>
+
+static bool IsIdentifierChar(char c)
+{
+	return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+}
+
+static void ReplaceAll(std::string &s, std::string_view from, std::string_view to)
+{
+	for (size_t pos = s.find(from); pos != std::string::npos; pos = s.find(from, pos))
+		s.replace(pos, from.size(), to);
+}
+
+std::string MySqlQueryFingerprint(std::string_view sql)
+{
+	std::string result;
+	result.reserve(sql.size());
+	bool space = false;
+	for (size_t i = 0; i < sql.size();)
+	{
+		const char c = sql[i];
+		if (std::isspace(static_cast<unsigned char>(c)))
+		{
+			space = !result.empty();
+			++i;
+			continue;
+		}
+		if (c == '-' && sql.substr(i, 2) == "--")
+		{
+			i = std::min(sql.find('\n', i), sql.size());
+			continue;
+		}
+		if (c == '/' && sql.substr(i, 2) == "/*")
+		{
+			auto end = sql.find("*/", i + 2);
+			i = end == std::string_view::npos ? sql.size() : end + 2;
+			continue;
+		}
+		if (space)
+		{
+			result.push_back(' ');
+			space = false;
+		}
+		if (c == '\'' || c == '"')
+		{
+			// 字符串字面量，支持反斜杠转义和两个引号连写
+			for (++i; i < sql.size(); ++i)
+			{
+				if (sql[i] == '\\')
+					++i;
+				else if (sql[i] == c && (i + 1 >= sql.size() || sql[i + 1] != c))
+					break;
+				else if (sql[i] == c)
+					++i;
+			}
+			++i;
+			result.push_back('?');
+		}
+		else if (c == '`')
+		{
+			// 标识符原样保留
+			auto end = std::min(sql.find('`', i + 1), sql.size() - 1);
+			result.append(sql.substr(i, end - i + 1));
+			i = end + 1;
+		}
+		else if (std::isdigit(static_cast<unsigned char>(c)) && (result.empty() || !IsIdentifierChar(result.back())))
+		{
+			while (i < sql.size() && (IsIdentifierChar(sql[i]) || sql[i] == '.'))
+				++i;
+			result.push_back('?');
+		}
+		else
+		{
+			result.push_back(c);
+			++i;
+		}
+	}
+	// 参数个数不固定的语句：(?, ?, ?)合并成(?)，多行(?), (?)合并成一行
+	for (size_t size = 0; size != result.size();)
+	{
+		size = result.size();
+		ReplaceAll(result, "?, ?", "?");
+		ReplaceAll(result, "?,?", "?");
+		ReplaceAll(result, "(?), (?)", "(?)");
+		ReplaceAll(result, "(?),(?)", "(?)");
+	}
+	return result;
+}
+
+uint64_t MySqlRowBytes(const std::vector<boost::mysql::row> &rows)
+{
+	uint64_t bytes = 0;
+	for (auto &r : rows)
+	{
+		for (auto &v : r.values())
+		{
+			if (v.is<std::string_view>())
+				bytes += v.get<std::string_view>().size();
+			else if (!v.is_null())
+				bytes += 8;
+		}
+	}
+	return bytes;
+}
+
+std::string MySqlSlowQuery::to_string() const
+{
+	char time[32] = {};
+	std::time_t t = std::chrono::system_clock::to_time_t(at);
+	std::tm tm = {};
+#ifdef _WIN32
+	localtime_s(&tm, &t);
+#else
+	localtime_r(&t, &tm);
+#endif
+	std::strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S", &tm);
+
+	std::ostringstream os;
+	os << time << " caller=" << caller;
+	if (!account.empty())
+		os << " account=" << account;
+	os << (replica ? " replica" : " primary");
+	if (failed)
+		os << " failed";
+	os << " queue_us=" << queue_time.count() << " exec_us=" << exec_time.count() << " rows=" << rows << " bytes=" << bytes;
+	os << " sql=" << sql;
+	return os.str();
+}
+
+static std::string Label(std::string_view fingerprint)
+{
+	std::string result = "{fingerprint=\"";
+	for (char c : fingerprint)
+	{
+		if (c == '"' || c == '\\')
+			result.push_back('\\');
+		result.push_back(c);
+	}
+	return result + "\"";
+}
+
+static void DumpLatency(std::ostream &os, const char *name, const std::string &label, const LatencySnapshot &s)
+{
+	for (double q : { 0.5, 0.9, 0.99 })
+		os << name << label << ",quantile=\"" << q << "\"} " << s.percentile(q) << '\n';
+	os << name << "_max" << label << "} " << s.max << '\n';
+	os << name << "_sum" << label << "} " << s.sum << '\n';
+}
+
+std::string MySqlQueryTraceSnapshot::to_string() const
+{
+	std::ostringstream os;
+	os << "hydb_query_sample_every " << sample_every << '\n';
+	os << "hydb_query_total " << queries << '\n';
+	os << "hydb_query_slow_total " << slow << '\n';
+	for (auto &f : fingerprints)
+	{
+		auto label = Label(f.fingerprint);
+		os << "hydb_query_sampled_total" << label << "} " << f.count << '\n';
+		os << "hydb_query_errors_total" << label << "} " << f.errors << '\n';
+		os << "hydb_query_rows_total" << label << "} " << f.rows << '\n';
+		os << "hydb_query_bytes_total" << label << "} " << f.bytes << '\n';
+		DumpLatency(os, "hydb_query_queue_us", label, f.queue_time);
+		DumpLatency(os, "hydb_query_exec_us", label, f.exec_time);
+	}
+	for (auto &q : slow_log)
+		os << "# slow " << q.to_string() << '\n';
+	return os.str();
+}
+
+MySqlQueryTracer::MySqlQueryTracer()
+{
+	configure({});
+}
+
+void MySqlQueryTracer::configure(MySqlQueryTraceOptions options)
+{
+	is_enabled = options.enabled;
+	sample_every = options.sample_every;
+	slow_threshold = std::chrono::duration_cast<std::chrono::steady_clock::duration>(options.slow_threshold);
+	std::lock_guard l(slow_m);
+	slow_log_size = options.slow_log_size;
+	while (slow_log.size() > slow_log_size)
+		slow_log.pop_front();
+	on_slow = std::move(options.on_slow);
+}
+
+// 每个线程一个xorshift，按1/every的概率随机采样
+// 不能按顺序计数，否则反复执行固定几条语句的线程（比如BEGIN/SELECT/UPDATE/COMMIT）总是采到同一个位置
+bool MySqlQueryTracer::sample()
+{
+	const uint32_t every = sample_every.load(std::memory_order_relaxed);
+	if (every <= 1)
+		return every == 1;
+	thread_local uint64_t x = (std::chrono::steady_clock::now().time_since_epoch().count() ^ reinterpret_cast<uintptr_t>(&x)) | 1;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x % every == 0;
+}
+
+auto MySqlQueryTracer::stats_of(const char *caller, std::string_view sql) -> stats &
+{
+	const auto site = std::make_pair(reinterpret_cast<uintptr_t>(caller), reinterpret_cast<uintptr_t>(sql.data()));
+	{
+		std::shared_lock l(m);
+		if (auto iter = by_site.find(site); iter != by_site.end())
+			return *iter->second;
+	}
+	// 每个调用位置只算一次指纹
+	auto fingerprint = MySqlQueryFingerprint(sql);
+	std::unique_lock l(m);
+	auto [iter, inserted] = by_site.try_emplace(site, nullptr);
+	if (!inserted)
+		return *iter->second;
+	auto f = by_fingerprint.find(fingerprint);
+	if (f == by_fingerprint.end())
+	{
+		f = by_fingerprint.emplace(fingerprint, std::make_unique<stats>()).first;
+		f->second->fingerprint = std::move(fingerprint);
+	}
+	auto &callers = f->second->callers;
+	if (std::none_of(callers.begin(), callers.end(), [caller](const char *c) { return std::string_view(c) == caller; }))
+		callers.push_back(caller);
+	iter->second = f->second.get();
+	return *f->second;
+}
+
+void MySqlQueryTracer::record(const MySqlQueryContext &context, std::string_view sql, bool sampled, bool failed,
+	std::chrono::steady_clock::duration queue_time, std::chrono::steady_clock::duration exec_time, uint64_t rows, uint64_t bytes)
+{
+	queries.fetch_add(1, std::memory_order_relaxed);
+	if (sampled)
+	{
+		auto &s = stats_of(context.caller, sql);
+		s.count.fetch_add(1, std::memory_order_relaxed);
+		if (failed)
+			s.errors.fetch_add(1, std::memory_order_relaxed);
+		s.rows.fetch_add(rows, std::memory_order_relaxed);
+		s.bytes.fetch_add(bytes, std::memory_order_relaxed);
+		s.queue_time.record(queue_time);
+		s.exec_time.record(exec_time);
+	}
+
+	const auto threshold = slow_threshold.load(std::memory_order_relaxed);
+	if (threshold <= std::chrono::steady_clock::duration::zero() || exec_time < threshold)
+		return;
+	slow.fetch_add(1, std::memory_order_relaxed);
+	MySqlSlowQuery q;
+	q.at = std::chrono::system_clock::now();
+	q.caller = context.caller;
+	q.account = context.account;
+	q.replica = context.replica;
+	q.failed = failed;
+	q.fingerprint = stats_of(context.caller, sql).fingerprint;
+	q.sql = sql;
+	q.queue_time = std::chrono::duration_cast<std::chrono::microseconds>(queue_time);
+	q.exec_time = std::chrono::duration_cast<std::chrono::microseconds>(exec_time);
+	q.rows = rows;
+	q.bytes = bytes;
+
+	std::function<void(const MySqlSlowQuery &)> callback;
+	{
+		std::lock_guard l(slow_m);
+		if (slow_log_size)
+		{
+			slow_log.push_back(q);
+			if (slow_log.size() > slow_log_size)
+				slow_log.pop_front();
+		}
+		callback = on_slow;
+	}
+	if (callback)
+		callback(q);
+}
+
+MySqlQueryTraceSnapshot MySqlQueryTracer::snapshot() const
+{
+	MySqlQueryTraceSnapshot result;
+	result.sample_every = sample_every.load(std::memory_order_relaxed);
+	result.queries = queries.load(std::memory_order_relaxed);
+	result.slow = slow.load(std::memory_order_relaxed);
+	{
+		std::shared_lock l(m);
+		for (auto &[fingerprint, s] : by_fingerprint)
+		{
+			if (!s->count.load(std::memory_order_relaxed))
+				continue;
+			MySqlQueryStatsSnapshot f;
+			f.fingerprint = fingerprint;
+			f.callers.assign(s->callers.begin(), s->callers.end());
+			f.count = s->count.load(std::memory_order_relaxed);
+			f.errors = s->errors.load(std::memory_order_relaxed);
+			f.rows = s->rows.load(std::memory_order_relaxed);
+			f.bytes = s->bytes.load(std::memory_order_relaxed);
+			f.queue_time = s->queue_time.snapshot();
+			f.exec_time = s->exec_time.snapshot();
+			result.fingerprints.push_back(std::move(f));
+		}
+	}
+	std::sort(result.fingerprints.begin(), result.fingerprints.end(), [](const auto &a, const auto &b) { return a.exec_time.sum > b.exec_time.sum; });
+	std::lock_guard l(slow_m);
+	result.slow_log.assign(slow_log.begin(), slow_log.end());
+	return result;
+}
+
+MySqlQuerySpan::MySqlQuerySpan(MySqlConnection &conn, std::string_view sql) : conn(conn), sql(sql)
+{
+	auto *t = conn.trace.tracer;
+	if (!t || !t->enabled())
+		return;
+	tracer = t;
+	sampled = t->sample();
+	queue_time = std::exchange(conn.trace.queue_time, {});
+	started = std::chrono::steady_clock::now();
+}
+
+MySqlQuerySpan::~MySqlQuerySpan()
+{
+	if (tracer && !done)
+		record(true);
+}
+
+void MySqlQuerySpan::add_rows(const std::vector<boost::mysql::row> &r)
+{
+	if (!tracer)
+		return;
+	rows += r.size();
+	bytes += MySqlRowBytes(r);
+}
+
+void MySqlQuerySpan::pause()
+{
+	if (tracer)
+		paused_at = std::chrono::steady_clock::now();
+}
+
+void MySqlQuerySpan::resume()
+{
+	if (tracer)
+		paused += std::chrono::steady_clock::now() - paused_at;
+}
+
+void MySqlQuerySpan::finish()
+{
+	if (tracer && !done)
+		record(false);
+}
+
+void MySqlQuerySpan::record(bool failed)
+{
+	done = true;
+	auto exec_time = std::chrono::steady_clock::now() - started - paused;
+	tracer->record(conn.trace, sql, sampled, failed, queue_time, exec_time, rows, bytes);
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "MySqlPoolMetrics.h"
+
+namespace boost::mysql { class row; }
+class MySqlConnection;
+class MySqlQueryTracer;
+
+// 语句指纹：去掉字面量换成?，合并空白，连续的占位符和多行VALUES合并成一个
+// 参数个数不同的同一种语句得到同一个指纹
+std::string MySqlQueryFingerprint(std::string_view sql);
+
+// 结果里字符串按长度算，其他非空的值按8字节算，和网络上的字节数接近但不精确
+uint64_t MySqlRowBytes(const std::vector<boost::mysql::row> &rows);
+
+// 一条慢查询和它的上下文
+struct MySqlSlowQuery
+{
+	std::chrono::system_clock::time_point at;
+	std::string caller; // 发起查询的操作
+	std::string account; // 查询针对的账号(idsrc:auth)，没有时为空
+	bool replica = false; // 在只读副本上执行
+	bool failed = false;
+	std::string fingerprint;
+	std::string sql; // 原始语句，参数是占位符
+	std::chrono::microseconds queue_time{}; // 等连接的时间，只算在取出连接后的第一条语句上
+	std::chrono::microseconds exec_time{}; // 从发出语句到读完结果，不包括流式读取时回调的时间
+	uint64_t rows = 0;
+	uint64_t bytes = 0;
+
+	std::string to_string() const;
+};
+
+struct MySqlQueryTraceOptions
+{
+	bool enabled = true;
+	uint32_t sample_every = 16; // 平均每多少条语句随机完整记录一条（进指纹统计），1表示全部，0表示不采样
+	std::chrono::milliseconds slow_threshold{ 200 }; // 超过这个时间的语句都记为慢查询，不受采样影响，0表示不记录
+	size_t slow_log_size = 64; // 保留最近多少条慢查询
+	std::function<void(const MySqlSlowQuery &)> on_slow; // 在执行查询的线程上调用，不要阻塞
+};
+
+// 一种指纹的统计，只包括采样到的语句
+struct MySqlQueryStatsSnapshot
+{
+	std::string fingerprint;
+	std::vector<std::string> callers; // 用过这种语句的操作
+	uint64_t count = 0;
+	uint64_t errors = 0;
+	uint64_t rows = 0;
+	uint64_t bytes = 0;
+	LatencySnapshot queue_time;
+	LatencySnapshot exec_time;
+};
+
+struct MySqlQueryTraceSnapshot
+{
+	uint32_t sample_every = 0;
+	uint64_t queries = 0; // 所有语句，包括没有采样的
+	uint64_t slow = 0;
+	std::vector<MySqlQueryStatsSnapshot> fingerprints; // 按采样到的总执行时间从大到小
+	std::vector<MySqlSlowQuery> slow_log; // 从旧到新
+
+	// 文本格式，先是每种指纹的指标，然后是慢查询
+	std::string to_string() const;
+};
+
+// 取出连接时设置到连接上，这次取出期间执行的语句都记到这个上下文里
+struct MySqlQueryContext
+{
+	MySqlQueryTracer *tracer = nullptr; // 为空时不跟踪
+	const char *caller = ""; // 必须是字面量
+	std::string account;
+	bool replica = false;
+	std::chrono::steady_clock::duration queue_time{};
+};
+
+// 查询跟踪，开启时每条语句多两次取时间，采样到的语句再加一次共享锁下的查找和几次relaxed原子加
+class MySqlQueryTracer
+{
+public:
+	MySqlQueryTracer();
+
+	void configure(MySqlQueryTraceOptions options);
+	bool enabled() const { return is_enabled.load(std::memory_order_relaxed); }
+	MySqlQueryTraceSnapshot snapshot() const;
+
+private:
+	friend class MySqlQuerySpan;
+
+	struct stats
+	{
+		std::string fingerprint;
+		std::vector<const char *> callers; // 受m保护
+		std::atomic<uint64_t> count = 0;
+		std::atomic<uint64_t> errors = 0;
+		std::atomic<uint64_t> rows = 0;
+		std::atomic<uint64_t> bytes = 0;
+		LatencyHistogram queue_time;
+		LatencyHistogram exec_time;
+	};
+
+	bool sample();
+	// sql和caller的地址一直有效（字面量或者不会释放的缓存），直接用地址做key
+	stats &stats_of(const char *caller, std::string_view sql);
+	void record(const MySqlQueryContext &context, std::string_view sql, bool sampled, bool failed,
+		std::chrono::steady_clock::duration queue_time, std::chrono::steady_clock::duration exec_time, uint64_t rows, uint64_t bytes);
+
+	std::atomic<bool> is_enabled;
+	std::atomic<uint32_t> sample_every;
+	std::atomic<std::chrono::steady_clock::duration> slow_threshold;
+	std::atomic<uint64_t> queries = 0;
+	std::atomic<uint64_t> slow = 0;
+
+	mutable std::shared_mutex m;
+	std::map<std::pair<uintptr_t, uintptr_t>, stats *> by_site; // (caller, sql)的地址 -> 统计
+	std::map<std::string, std::unique_ptr<stats>, std::less<>> by_fingerprint;
+
+	mutable std::mutex slow_m;
+	std::deque<MySqlSlowQuery> slow_log;
+	size_t slow_log_size = 0;
+	std::function<void(const MySqlSlowQuery &)> on_slow;
+};
+
+// 一条语句从发出到读完结果，析构时记录；没有调用finish就析构的算失败
+// 连接上没有开启跟踪时什么都不做
+class MySqlQuerySpan
+{
+public:
+	MySqlQuerySpan(MySqlConnection &conn, std::string_view sql);
+	MySqlQuerySpan(const MySqlQuerySpan &) = delete;
+	MySqlQuerySpan &operator=(const MySqlQuerySpan &) = delete;
+	~MySqlQuerySpan();
+
+	void add_rows(const std::vector<boost::mysql::row> &rows);
+	// 流式读取时把结果交给回调的时间不算在执行时间里
+	void pause();
+	void resume();
+	void finish();
+
+private:
+	void record(bool failed);
+
+	MySqlConnection &conn;
+	std::string_view sql;
+	MySqlQueryTracer *tracer = nullptr;
+	bool sampled = false;
+	bool done = false;
+	std::chrono::steady_clock::duration queue_time{};
+	std::chrono::steady_clock::time_point started;
+	std::chrono::steady_clock::time_point paused_at;
+	std::chrono::steady_clock::duration paused{};
+	uint64_t rows = 0;
+	uint64_t bytes = 0;
+};
@@ -0,0 +1,107 @@
+#include "MySqlReplicaSet.h"
+
+#include <future>
+
+MySqlReplicaSet::MySqlReplicaSet(const std::vector<DatabaseConfig> &configs, std::shared_ptr<boost::asio::io_context> io_context) :
+	ioc(std::move(io_context))
+{
+	for (auto &c : configs)
+	{
+		auto r = std::make_unique<replica>();
+		r->pool = std::make_unique<MySqlConnectionPool>(c, ioc);
+		replicas.push_back(std::move(r));
+	}
+}
+
+MySqlReplicaSet::~MySqlReplicaSet() = default;
+
+bool MySqlReplicaSet::available() const
+{
+	for (auto &r : replicas)
+		if (r->pool->healthy())
+			return true;
+	return false;
+}
+
+auto MySqlReplicaSet::pick() -> replica &
+{
+	// 从轮转的位置开始比较，请求数相同时分散到不同副本
+	const size_t start = next.fetch_add(1, std::memory_order_relaxed);
+	replica *best = nullptr;
+	bool best_healthy = false;
+	for (size_t i = 0; i < replicas.size(); ++i)
+	{
+		auto &r = *replicas[(start + i) % replicas.size()];
+		const bool healthy = r.pool->healthy();
+		if (!best || (healthy && !best_healthy) || (healthy == best_healthy && r.outstanding.load() < best->outstanding.load()))
+		{
+			best = &r;
+			best_healthy = healthy;
+		}
+	}
+	best->outstanding.fetch_add(1);
+	return *best;
+}
+
+auto MySqlReplicaSet::track(replica &r, connection_ptr conn) -> connection_ptr
+{
+	if (!conn)
+	{
+		r.outstanding.fetch_sub(1);
+		return nullptr;
+	}
+	auto raw = conn.get();
+	return connection_ptr(raw, [&r, conn = std::move(conn)](MySqlConnection *) mutable {
+		conn.reset(); // 先还给副本的连接池
+		r.outstanding.fetch_sub(1);
+	});
+}
+
+auto MySqlReplicaSet::acquire() -> connection_ptr
+{
+	auto &r = pick();
+	try
+	{
+		return track(r, r.pool->acquire());
+	}
+	catch (...)
+	{
+		r.outstanding.fetch_sub(1);
+		throw;
+	}
+}
+
+void MySqlReplicaSet::set_session_setup(MySqlConnectionPool::session_setup fn)
+{
+	for (auto &r : replicas)
+		r->pool->set_session_setup(fn);
+}
+
+MySqlPoolSnapshot MySqlReplicaSet::metrics()
+{
+	MySqlPoolSnapshot result;
+	for (auto &r : replicas)
+		result += r->pool->metrics();
+	return result;
+}
+
+void MySqlReplicaSet::clear()
+{
+	for (auto &r : replicas)
+		r->pool->clear();
+}
+
+void MySqlReplicaSet::start()
+{
+	std::vector<std::future<void>> warm_ups;
+	for (auto &r : replicas)
+		warm_ups.push_back(r->pool->async_start(boost::asio::use_future));
+	for (auto &f : warm_ups)
+		f.wait();
+}
+
+void MySqlReplicaSet::hibernate()
+{
+	for (auto &r : replicas)
+		r->pool->hibernate();
+}
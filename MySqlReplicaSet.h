@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "MySqlConnectionPool.h"
+
+// 只读副本，每个副本一个连接池
+// 取连接时选择正在进行的请求（包括排队等连接的）最少的副本，连接失败过还没恢复的副本只在都不可用时才选
+class MySqlReplicaSet
+{
+public:
+	explicit MySqlReplicaSet(const std::vector<DatabaseConfig> &configs, std::shared_ptr<boost::asio::io_context> io_context = GlobalContextSingleton());
+	~MySqlReplicaSet();
+
+	using connection_ptr = MySqlConnectionPool::connection_ptr;
+
+public:
+	// 至少有一个健康的副本，否则调用者应该改用主库
+	bool available() const;
+
+	// 需要available()，连接归还时才算请求结束
+	connection_ptr acquire();
+
+	template<class CompletionToken>
+	auto async_acquire(CompletionToken &&token)
+	{
+		return boost::asio::async_initiate<CompletionToken, MySqlConnectionPool::acquire_signature>([this](auto handler) {
+			auto &r = pick();
+			auto ex = boost::asio::get_associated_executor(handler, ioc->get_executor());
+#if BOOST_VERSION >= 107700
+			// 包装之后取消槽要单独传下去，否则排队时取消不了
+			auto slot = boost::asio::get_associated_cancellation_slot(handler);
+			r.pool->async_acquire(boost::asio::bind_cancellation_slot(slot, boost::asio::bind_executor(ex, [this, &r, handler = std::move(handler)](boost::system::error_code ec, connection_ptr conn) mutable {
+				std::move(handler)(ec, track(r, std::move(conn)));
+			})));
+#else
+			r.pool->async_acquire(boost::asio::bind_executor(ex, [this, &r, handler = std::move(handler)](boost::system::error_code ec, connection_ptr conn) mutable {
+				std::move(handler)(ec, track(r, std::move(conn)));
+			}));
+#endif
+		}, token);
+	}
+
+	void set_session_setup(MySqlConnectionPool::session_setup fn);
+
+	// 所有副本合计
+	MySqlPoolSnapshot metrics();
+
+	void clear();
+	void start();
+	void hibernate();
+
+	size_t size() const { return replicas.size(); }
+
+private:
+	struct replica
+	{
+		std::unique_ptr<MySqlConnectionPool> pool;
+		std::atomic<uint32_t> outstanding = 0;
+	};
+
+	replica &pick(); // outstanding已经加一
+	static connection_ptr track(replica &r, connection_ptr conn);
+
+private:
+	std::shared_ptr<boost::asio::io_context> ioc;
+	std::vector<std::unique_ptr<replica>> replicas;
+	std::atomic<size_t> next = 0;
+};
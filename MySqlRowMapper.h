@@ -0,0 +1,132 @@
+#pragma once
+
+#include <charconv>
+#include <concepts>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include <boost/mysql.hpp>
+
+// 把一行结果直接解码成结构体，列的顺序在编译期用成员指针声明：
+//   template<> struct MySqlRowLayout<Foo> : MySqlColumns<&Foo::a, &Foo::b> {};
+// 成员本身也声明了布局的话，会按顺序占用它的那几列
+
+template<class T>
+struct MySqlRowLayout;
+
+template<class T>
+concept MySqlMapped = requires { MySqlRowLayout<T>::width; };
+
+// 单元格转换，整数用from_chars解析文本协议的结果，NULL变成0或者空字符串
+template<class T>
+T MySqlCellAs(const boost::mysql::value &v)
+{
+	if constexpr (std::is_same_v<T, std::string>)
+	{
+		if (v.is<std::string_view>())
+			return std::string(v.get<std::string_view>());
+		if (v.is<std::int64_t>())
+			return std::to_string(v.get<std::int64_t>());
+		if (v.is<std::uint64_t>())
+			return std::to_string(v.get<std::uint64_t>());
+		if (v.is_null())
+			return {};
+		throw std::bad_variant_access();
+	}
+	else if constexpr (std::is_integral_v<T>)
+	{
+		if (v.is<std::int64_t>())
+			return static_cast<T>(v.get<std::int64_t>());
+		if (v.is<std::uint64_t>())
+			return static_cast<T>(v.get<std::uint64_t>());
+		if (v.is<std::string_view>())
+		{
+			auto s = v.get<std::string_view>();
+			T result = {};
+			std::from_chars(s.data(), s.data() + s.size(), result);
+			return result;
+		}
+		if (v.is_null())
+			return {};
+		throw std::bad_variant_access();
+	}
+	else if constexpr (std::is_floating_point_v<T>)
+	{
+		if (v.is<double>())
+			return static_cast<T>(v.get<double>());
+		if (v.is<float>())
+			return static_cast<T>(v.get<float>());
+		return static_cast<T>(MySqlCellAs<std::int64_t>(v));
+	}
+	else
+	{
+		static_assert(!sizeof(T), "unsupported column type");
+	}
+}
+
+template<class T>
+struct MySqlMemberType;
+
+template<class C, class M>
+struct MySqlMemberType<M C::*>
+{
+	using type = M;
+};
+
+template<class T>
+constexpr size_t MySqlColumnWidth()
+{
+	if constexpr (MySqlMapped<T>)
+		return MySqlRowLayout<T>::width;
+	else
+		return 1;
+}
+
+template<auto... Members>
+struct MySqlColumns
+{
+	static constexpr size_t width = (MySqlColumnWidth<typename MySqlMemberType<decltype(Members)>::type>() + ... + 0);
+
+	template<class T>
+	static void read(T &out, const std::vector<boost::mysql::value> &cells, size_t first)
+	{
+		(read_member(out.*Members, cells, first), ...);
+	}
+
+private:
+	template<class M>
+	static void read_member(M &member, const std::vector<boost::mysql::value> &cells, size_t &i)
+	{
+		if constexpr (MySqlMapped<M>)
+		{
+			MySqlRowLayout<M>::read(member, cells, i);
+			i += MySqlRowLayout<M>::width;
+		}
+		else
+		{
+			member = MySqlCellAs<M>(cells[i++]);
+		}
+	}
+};
+
+template<class T>
+T MySqlRowAs(const boost::mysql::row &row)
+{
+	T result = {};
+	MySqlRowLayout<T>::read(result, row.values(), 0);
+	return result;
+}
+
+template<class T>
+std::vector<T> MySqlRowsAs(const std::vector<boost::mysql::row> &rows)
+{
+	std::vector<T> result;
+	result.reserve(rows.size());
+	for (auto &row : rows)
+		result.push_back(MySqlRowAs<T>(row));
+	return result;
+}
@@ -0,0 +1,118 @@
+#include "MySqlShardedPool.h"
+#include "GlobalContext.h"
+
+#include <atomic>
+#include <future>
+
+// 把连接数上下限平均分给每个分片
+static DatabaseConfig ShardConfig(DatabaseConfig c, size_t n)
+{
+	c.pool.min_idle = static_cast<uint32_t>((c.pool.min_idle + n - 1) / n);
+	c.pool.max_size = static_cast<uint32_t>((c.pool.max_size + n - 1) / n);
+	return c;
+}
+
+MySqlShardedPool::MySqlShardedPool(const DatabaseConfig &c)
+{
+	if (c.pool.shards == 1)
+	{
+		shards.push_back(std::make_unique<MySqlConnectionPool>(c, GlobalContextSingleton()));
+		return;
+	}
+
+	size_t n = c.pool.shards ? c.pool.shards : ShardedContextCount();
+	auto shard_config = ShardConfig(c, n);
+	for (size_t i = 0; i < n; ++i)
+		shards.push_back(std::make_unique<MySqlConnectionPool>(shard_config, ShardedContextSingleton(i)));
+
+	// 从相邻的分片开始借，避免所有分片都先去抢0号
+	for (size_t i = 0; i < n; ++i)
+	{
+		std::vector<MySqlConnectionPool *> peers;
+		for (size_t j = 1; j < n; ++j)
+			peers.push_back(shards[(i + j) % n].get());
+		shards[i]->set_peers(std::move(peers));
+	}
+}
+
+MySqlShardedPool::~MySqlShardedPool() = default;
+
+MySqlConnectionPool &MySqlShardedPool::local()
+{
+	return *shards[index_of(nullptr)];
+}
+
+boost::asio::io_context &MySqlShardedPool::context_for(boost::asio::execution_context &preferred)
+{
+	return shards[index_of(&preferred)]->context();
+}
+
+size_t MySqlShardedPool::index_of(const boost::asio::execution_context *preferred)
+{
+	if (shards.size() == 1)
+		return 0;
+
+	for (size_t i = 0; preferred && i < shards.size(); ++i)
+	{
+		if (&shards[i]->context() == preferred)
+			return i;
+	}
+
+	// 分片线程用自己的分片，其他线程（比如游戏主线程）固定分配一个
+	if (auto shard = CurrentContextShard(); shard != SIZE_MAX)
+		return shard % shards.size();
+
+	static std::atomic<size_t> next = 0;
+	thread_local size_t mine = next++;
+	return mine % shards.size();
+}
+
+auto MySqlShardedPool::acquire() -> connection_ptr
+{
+	return local().acquire();
+}
+
+MySqlPoolSnapshot MySqlShardedPool::metrics()
+{
+	MySqlPoolSnapshot result;
+	for (auto &shard : shards)
+		result += shard->metrics();
+	return result;
+}
+
+void MySqlShardedPool::clear()
+{
+	for (auto &shard : shards)
+		shard->clear();
+}
+
+void MySqlShardedPool::set_session_setup(MySqlConnectionPool::session_setup fn)
+{
+	for (auto &shard : shards)
+		shard->set_session_setup(fn);
+}
+
+void MySqlShardedPool::reserve(size_t n)
+{
+	// 所有分片同时握手，最后一起等
+	std::vector<std::future<void>> warm_ups;
+	for (auto &shard : shards)
+		warm_ups.push_back(shard->async_reserve((n + shards.size() - 1) / shards.size(), boost::asio::use_future));
+	for (auto &f : warm_ups)
+		f.wait();
+}
+
+void MySqlShardedPool::start()
+{
+	std::vector<std::future<void>> warm_ups;
+	for (auto &shard : shards)
+		warm_ups.push_back(shard->async_start(boost::asio::use_future));
+	for (auto &f : warm_ups)
+		f.wait();
+}
+
+void MySqlShardedPool::hibernate()
+{
+	for (auto &shard : shards)
+		shard->hibernate();
+}
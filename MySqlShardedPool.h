@@ -0,0 +1,52 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "MySqlConnectionPool.h"
+
+// 按io_context分片的连接池
+// 每个分片的连接只在自己的io_context上运行，调用者优先使用自己所在分片的连接，
+// 用完了才去其他分片借
+class MySqlShardedPool
+{
+public:
+	MySqlShardedPool(const DatabaseConfig &c = GetDatabaseConfig());
+	~MySqlShardedPool();
+
+	using connection_ptr = MySqlConnectionPool::connection_ptr;
+
+public:
+	// ensures not nullptr
+	connection_ptr acquire();
+
+	template<class CompletionToken>
+	auto async_acquire(CompletionToken &&token)
+	{
+		return local().async_acquire(std::forward<CompletionToken>(token));
+	}
+
+	// 调用者应该在哪个分片的io_context上运行，之后取连接时local()就是这个分片，socket操作不用跨线程
+	// preferred是某个分片的io_context时用它，否则用当前线程所在的分片，都不是时固定分配一个
+	boost::asio::io_context &context_for(boost::asio::execution_context &preferred);
+
+	// 每个分片的每个新连接握手后都会执行
+	void set_session_setup(MySqlConnectionPool::session_setup fn);
+
+	// 所有分片合计
+	MySqlPoolSnapshot metrics();
+
+	void clear();
+	void reserve(size_t n);
+	void start();
+	void hibernate();
+
+	size_t size() const { return shards.size(); }
+
+private:
+	MySqlConnectionPool &local();
+	size_t index_of(const boost::asio::execution_context *preferred);
+
+private:
+	std::vector<std::unique_ptr<MySqlConnectionPool>> shards;
+};
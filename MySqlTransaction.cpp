@@ -0,0 +1,84 @@
+#include "MySqlTransaction.h"
+#include "MySqlConnection.h"
+
+#include <boost/asio/use_awaitable.hpp>
+
+MySqlTransaction::~MySqlTransaction()
+{
+	if (active)
+		conn.fail(boost::asio::error::operation_aborted, "transaction");
+}
+
+static constexpr std::string_view begin_sql = "START TRANSACTION";
+static constexpr std::string_view commit_sql = "COMMIT";
+static constexpr std::string_view rollback_sql = "ROLLBACK";
+
+void MySqlTransaction::begin()
+{
+	MySqlQuerySpan span(conn, begin_sql);
+	conn.guard([this] { return conn.connection.query(begin_sql); });
+	span.finish();
+	active = true;
+}
+
+void MySqlTransaction::finish(bool commit)
+{
+	if (!active)
+		return;
+	const auto sql = commit ? commit_sql : rollback_sql;
+	MySqlQuerySpan span(conn, sql);
+	conn.guard([this, sql] { return conn.connection.query(sql); });
+	span.finish();
+	active = false;
+}
+
+boost::asio::awaitable<void> MySqlTransaction::async_begin()
+{
+	MySqlQuerySpan span(conn, begin_sql);
+	co_await conn.guard(conn.connection.async_query(begin_sql, boost::asio::use_awaitable));
+	span.finish();
+	active = true;
+}
+
+boost::asio::awaitable<void> MySqlTransaction::async_finish(bool commit)
+{
+	if (!active)
+		co_return;
+	const auto sql = commit ? commit_sql : rollback_sql;
+	MySqlQuerySpan span(conn, sql);
+	co_await conn.guard(conn.connection.async_query(sql, boost::asio::use_awaitable));
+	span.finish();
+	active = false;
+}
+
+bool MySqlTransaction::rollback() noexcept
+{
+	try
+	{
+		finish(false);
+		return true;
+	}
+	catch (...)
+	{
+		return false;
+	}
+}
+
+boost::asio::awaitable<bool> MySqlTransaction::async_rollback()
+{
+	try
+	{
+		co_await async_finish(false);
+	}
+	catch (...)
+	{
+		co_return false;
+	}
+	co_return true;
+}
+
+bool MySqlIsRetryableError(const boost::system::error_code &ec)
+{
+	return ec == boost::mysql::make_error_code(boost::mysql::errc::er_lock_deadlock) ||
+		ec == boost::mysql::make_error_code(boost::mysql::errc::er_lock_wait_timeout);
+}
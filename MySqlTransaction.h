@@ -0,0 +1,101 @@
+#pragma once
+
+#include <exception>
+#include <type_traits>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/mysql.hpp>
+#include <boost/system/system_error.hpp>
+
+class MySqlConnection;
+
+// 连接上的一个事务，由MySqlTransact/async_MySqlTransact开始和结束
+// 还没结束就被析构（比如协程被销毁）时无法等待ROLLBACK，把连接标记为失败，断开后服务器会自动回滚
+class MySqlTransaction
+{
+public:
+	explicit MySqlTransaction(MySqlConnection &conn) : conn(conn) {}
+	MySqlTransaction(const MySqlTransaction &) = delete;
+	MySqlTransaction &operator=(const MySqlTransaction &) = delete;
+	~MySqlTransaction();
+
+	MySqlConnection &connection() const { return conn; }
+
+	// 正常返回时也回滚，用于检查之后发现条件不满足的情况
+	void set_rollback_only() { rollback_only = true; }
+	bool is_rollback_only() const { return rollback_only; }
+
+	void begin();
+	void finish(bool commit);
+	boost::asio::awaitable<void> async_begin();
+	boost::asio::awaitable<void> async_finish(bool commit);
+	// 出错之后回滚，ROLLBACK本身失败时不抛出，返回false，连接在析构时标记为失败
+	bool rollback() noexcept;
+	boost::asio::awaitable<bool> async_rollback();
+
+private:
+	MySqlConnection &conn;
+	bool active = false;
+	bool rollback_only = false;
+};
+
+// 死锁和等锁超时，回滚后重新执行整个事务通常就能成功
+bool MySqlIsRetryableError(const boost::system::error_code &ec);
+
+// 在事务里执行fn(tx)并返回它的结果，正常返回时提交（除非set_rollback_only），抛出异常时回滚并抛出原来的异常
+// 死锁或等锁超时时整个重新执行，最多attempts次，所以fn里不要有事务以外的副作用，有的话要保证重复执行结果一样
+template<class Fn>
+auto MySqlTransact(MySqlConnection &conn, Fn fn, int attempts = 3) -> std::invoke_result_t<Fn &, MySqlTransaction &>
+{
+	for (int i = 1;; ++i)
+	{
+		MySqlTransaction tx(conn);
+		tx.begin();
+		try
+		{
+			auto result = fn(tx);
+			tx.finish(!tx.is_rollback_only());
+			return result;
+		}
+		catch (const boost::system::system_error &err)
+		{
+			if (!tx.rollback() || i >= attempts || !MySqlIsRetryableError(err.code()))
+				throw;
+		}
+		catch (...)
+		{
+			tx.rollback();
+			throw;
+		}
+	}
+}
+
+// fn(tx)返回awaitable<T>
+template<class Fn>
+auto async_MySqlTransact(MySqlConnection &conn, Fn fn, int attempts = 3) -> std::invoke_result_t<Fn &, MySqlTransaction &>
+{
+	for (int i = 1;; ++i)
+	{
+		MySqlTransaction tx(conn);
+		co_await tx.async_begin();
+		std::exception_ptr e;
+		bool retry = false;
+		try
+		{
+			auto result = co_await fn(tx);
+			co_await tx.async_finish(!tx.is_rollback_only());
+			co_return result;
+		}
+		catch (const boost::system::system_error &err)
+		{
+			e = std::current_exception();
+			retry = i < attempts && MySqlIsRetryableError(err.code());
+		}
+		catch (...)
+		{
+			e = std::current_exception();
+		}
+		if (!co_await tx.async_rollback() || !retry)
+			std::rethrow_exception(e);
+	}
+}
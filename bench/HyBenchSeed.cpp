@@ -0,0 +1,207 @@
+#include "HyBenchSeed.h"
+#include "MySqlConnection.h"
+#include "HyMemoryBackend.h"
+
+#include <algorithm>
+#include <random>
+
+static constexpr int64_t bench_qqid_base = 900000000000;
+static constexpr int32_t bench_shopid_base = 900000;
+
+int64_t BenchQQID(size_t i)
+{
+	return bench_qqid_base + static_cast<int64_t>(i);
+}
+
+std::string BenchSteamID(size_t i)
+{
+	return "STEAM_9:0:" + std::to_string(i);
+}
+
+std::string BenchItemCode(size_t i)
+{
+	return "bench_" + std::to_string(i);
+}
+
+static void Run(MySqlConnection &conn, const std::string &sql)
+{
+	conn.guard([&] { return conn.connection.query(sql); });
+}
+
+// 把很多行拼成几条多行INSERT，值都是生成的，不需要转义
+class BenchInserter
+{
+public:
+	BenchInserter(MySqlConnection &conn, std::string head) : conn(conn), head(std::move(head)) {}
+
+	void row(const std::string &values)
+	{
+		sql.append(rows ? ", (" : head + " VALUES (").append(values).push_back(')');
+		if (++rows >= max_rows)
+			flush();
+	}
+
+	void flush()
+	{
+		if (!rows)
+			return;
+		Run(conn, sql);
+		sql.clear();
+		rows = 0;
+	}
+
+private:
+	static constexpr size_t max_rows = 1000;
+
+	MySqlConnection &conn;
+	std::string head;
+	std::string sql;
+	size_t rows = 0;
+};
+
+static std::string Quote(const std::string &s)
+{
+	return "'" + s + "'";
+}
+
+static void CreateTables(MySqlConnection &conn)
+{
+	Run(conn, "CREATE TABLE IF NOT EXISTS qqlogin (`qqid` BIGINT NOT NULL PRIMARY KEY, `xscode` INT NOT NULL DEFAULT 0, "
+		"`access` VARCHAR(32) NOT NULL DEFAULT '', `tag` VARCHAR(32) NOT NULL DEFAULT '')");
+	Run(conn, "CREATE TABLE IF NOT EXISTS idlink (`uid` INT NOT NULL AUTO_INCREMENT, `idsrc` VARCHAR(16) NOT NULL, `auth` VARCHAR(64) NOT NULL, "
+		"PRIMARY KEY (`idsrc`, `auth`), KEY (`uid`))");
+	Run(conn, "CREATE TABLE IF NOT EXISTS cs16reg (`name` VARCHAR(64) NOT NULL PRIMARY KEY, `xscode` INT NOT NULL, KEY (`xscode`))");
+	Run(conn, "CREATE TABLE IF NOT EXISTS csgoreg (`steamid` VARCHAR(64) NOT NULL PRIMARY KEY, `gocode` INT NOT NULL, UNIQUE KEY (`gocode`))");
+	Run(conn, "CREATE TABLE IF NOT EXISTS iteminfo (`code` VARCHAR(32) NOT NULL PRIMARY KEY, `name` VARCHAR(64) NOT NULL, "
+		"`desc` VARCHAR(255) NOT NULL DEFAULT '', `quantifier` VARCHAR(16) NOT NULL DEFAULT '')");
+	Run(conn, "CREATE TABLE IF NOT EXISTS itemown (`idsrc` VARCHAR(16) NOT NULL, `auth` VARCHAR(64) NOT NULL, `code` VARCHAR(32) NOT NULL, "
+		"`amount` INT NOT NULL DEFAULT 0, PRIMARY KEY (`idsrc`, `auth`, `code`))");
+	Run(conn, "CREATE TABLE IF NOT EXISTS itemshop (`shopid` INT NOT NULL PRIMARY KEY, `target_code` VARCHAR(32) NOT NULL, `target_amount` INT NOT NULL, "
+		"`exchange_code` VARCHAR(32) NOT NULL, `exchange_amount` INT NOT NULL)");
+	Run(conn, "CREATE TABLE IF NOT EXISTS itemaward (`code` VARCHAR(32) NOT NULL, `amount` INT NOT NULL, `minfrags` INT NOT NULL, `maxfrags` INT NOT NULL)");
+	Run(conn, "CREATE TABLE IF NOT EXISTS qqevent (`qqid` BIGINT NOT NULL PRIMARY KEY, `signdate` DATETIME NOT NULL, `signcount` INT NOT NULL DEFAULT 0, "
+		"KEY (`signdate`))");
+}
+
+// 只删除测试区间里的数据
+static void DeleteBenchRows(MySqlConnection &conn)
+{
+	const std::string qq_auth = "`idsrc` = 'qq' AND `auth` LIKE '9%' AND CHAR_LENGTH(`auth`) = 12";
+	const std::string steam_auth = "`idsrc` = 'steam' AND `auth` LIKE 'STEAM\\_9:%'";
+	Run(conn, "DELETE FROM itemown WHERE (" + qq_auth + ") OR (" + steam_auth + ") OR `code` LIKE 'bench\\_%'");
+	Run(conn, "DELETE FROM idlink WHERE `uid` IN (SELECT `uid` FROM (SELECT `uid` FROM idlink WHERE " + steam_auth + ") AS t)");
+	Run(conn, "DELETE FROM idlink WHERE " + qq_auth);
+	Run(conn, "DELETE FROM csgoreg WHERE `steamid` LIKE 'STEAM\\_9:%'");
+	Run(conn, "DELETE FROM qqlogin WHERE `qqid` >= " + std::to_string(bench_qqid_base));
+	Run(conn, "DELETE FROM qqevent WHERE `qqid` >= " + std::to_string(bench_qqid_base));
+	Run(conn, "DELETE FROM itemshop WHERE `shopid` >= " + std::to_string(bench_shopid_base));
+	Run(conn, "DELETE FROM itemaward WHERE `code` LIKE 'bench\\_%'");
+	Run(conn, "DELETE FROM iteminfo WHERE `code` LIKE 'bench\\_%'");
+}
+
+void SeedBenchSchema(MySqlConnection &conn, const HyBenchSizes &sizes)
+{
+	CreateTables(conn);
+	DeleteBenchRows(conn);
+
+	const size_t items = std::max<size_t>(sizes.items, 3);
+	BenchInserter iteminfo(conn, "INSERT INTO iteminfo(`code`, `name`, `desc`, `quantifier`)");
+	for (size_t i = 0; i < items; ++i)
+		iteminfo.row(Quote(BenchItemCode(i)) + ", 'Bench item " + std::to_string(i) + "', 'generated by hydb_bench', 'x'");
+	iteminfo.flush();
+
+	// bench_0当作货币，签到奖励和商店都用它
+	Run(conn, "INSERT INTO itemaward(`code`, `amount`, `minfrags`, `maxfrags`) VALUES "
+		"('bench_0', 10, 0, 1000000), ('bench_1', 1, 7, 1000000), ('bench_2', 1, 30, 1000000)");
+
+	BenchInserter itemshop(conn, "INSERT INTO itemshop(`shopid`, `target_code`, `target_amount`, `exchange_code`, `exchange_amount`)");
+	for (size_t i = 0; i < sizes.shop_entries; ++i)
+		itemshop.row(std::to_string(bench_shopid_base + static_cast<int32_t>(i)) + ", " + Quote(BenchItemCode(1 + i % (items - 1))) + ", 1, 'bench_0', " + std::to_string(10 + i));
+	itemshop.flush();
+
+	BenchInserter qqlogin(conn, "INSERT INTO qqlogin(`qqid`, `xscode`, `tag`)");
+	BenchInserter idlink(conn, "INSERT INTO idlink(`idsrc`, `auth`)");
+	for (size_t i = 0; i < sizes.users; ++i)
+	{
+		qqlogin.row(std::to_string(BenchQQID(i)) + ", " + std::to_string(i) + ", 'bench'");
+		idlink.row("'qq', " + Quote(std::to_string(BenchQQID(i))));
+	}
+	qqlogin.flush();
+	idlink.flush();
+
+	// 用qq账号自增得到的uid绑定steam账号和名字
+	const std::string bench_qq = "`idsrc` = 'qq' AND `auth` LIKE '9%' AND CHAR_LENGTH(`auth`) = 12";
+	const std::string index = "(CAST(`auth` AS UNSIGNED) - " + std::to_string(bench_qqid_base) + ")";
+	Run(conn, "INSERT INTO idlink(`idsrc`, `auth`, `uid`) SELECT 'steam', CONCAT('STEAM_9:0:', " + index + "), `uid` FROM idlink WHERE " + bench_qq);
+	if (sizes.named_every)
+		Run(conn, "INSERT INTO idlink(`idsrc`, `auth`, `uid`) SELECT 'name', CONCAT('bench_player_', " + index + "), `uid` FROM idlink WHERE " + bench_qq +
+			" AND MOD(" + index + ", " + std::to_string(sizes.named_every) + ") = 0");
+
+	// 每个玩家一段连续的道具，每4个里有1个在qq账号上，查询时需要合并
+	std::mt19937_64 rng(20200426);
+	const size_t owned = std::min(sizes.owned_per_user, items);
+	BenchInserter itemown(conn, "INSERT INTO itemown(`idsrc`, `auth`, `code`, `amount`)");
+	for (size_t i = 0; i < sizes.users; ++i)
+	{
+		const size_t first = rng() % items;
+		for (size_t k = 0; k < owned; ++k)
+		{
+			const std::string owner = k % 4 == 3 ? "'qq', " + Quote(std::to_string(BenchQQID(i))) : "'steam', " + Quote(BenchSteamID(i));
+			itemown.row(owner + ", " + Quote(BenchItemCode((first + k) % items)) + ", " + std::to_string(1 + rng() % 100));
+		}
+	}
+	itemown.flush();
+
+	if (sizes.signed_every)
+	{
+		BenchInserter qqevent(conn, "INSERT INTO qqevent(`qqid`, `signdate`, `signcount`)");
+		for (size_t i = 0; i < sizes.users; i += sizes.signed_every)
+			qqevent.row(std::to_string(BenchQQID(i)) + ", NOW() - INTERVAL 1 DAY, " + std::to_string(1 + i % 30));
+		qqevent.flush();
+	}
+}
+
+void SeedBenchMemory(HyMemoryBackend &backend, const HyBenchSizes &sizes)
+{
+	const size_t items = std::max<size_t>(sizes.items, 3);
+	for (size_t i = 0; i < items; ++i)
+		backend.PutItemInfo({ BenchItemCode(i), "Bench item " + std::to_string(i), "generated by hydb_bench", "x" });
+
+	backend.PutSignAward("bench_0", 10, 0, 1000000);
+	backend.PutSignAward("bench_1", 1, 7, 1000000);
+	backend.PutSignAward("bench_2", 1, 30, 1000000);
+
+	for (size_t i = 0; i < sizes.shop_entries; ++i)
+		backend.PutShopEntry({ bench_shopid_base + static_cast<int32_t>(i), BenchItemCode(1 + i % (items - 1)), 1, "bench_0", static_cast<int32_t>(10 + i) });
+
+	for (size_t i = 0; i < sizes.users; ++i)
+	{
+		const int64_t uid = backend.PutAccount(BenchQQID(i), static_cast<int32_t>(i), "", "bench");
+		backend.PutIdLink("steam", BenchSteamID(i), uid);
+		if (sizes.named_every && i % sizes.named_every == 0)
+			backend.PutIdLink("name", "bench_player_" + std::to_string(i), uid);
+	}
+
+	// 和SeedBenchSchema用同一个种子，道具分布完全一样
+	std::mt19937_64 rng(20200426);
+	const size_t owned = std::min(sizes.owned_per_user, items);
+	for (size_t i = 0; i < sizes.users; ++i)
+	{
+		const size_t first = rng() % items;
+		for (size_t k = 0; k < owned; ++k)
+		{
+			const int32_t amount = static_cast<int32_t>(1 + rng() % 100);
+			if (k % 4 == 3)
+				backend.PutItemOwn("qq", std::to_string(BenchQQID(i)), BenchItemCode((first + k) % items), amount);
+			else
+				backend.PutItemOwn("steam", BenchSteamID(i), BenchItemCode((first + k) % items), amount);
+		}
+	}
+
+	if (sizes.signed_every)
+	{
+		const int64_t yesterday = HyMemoryBackend::Today() - 1;
+		for (size_t i = 0; i < sizes.users; i += sizes.signed_every)
+			backend.PutSignEvent(BenchQQID(i), yesterday, static_cast<int32_t>(1 + i % 30));
+	}
+}
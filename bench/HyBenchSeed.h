@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class MySqlConnection;
+class HyMemoryBackend;
+
+// 测试数据的规模，默认值接近线上一个服的量级
+struct HyBenchSizes
+{
+	size_t users = 20000; // 每个玩家有qq和steam两个绑定的账号
+	size_t named_every = 4; // 每隔几个玩家有一个CS1.6名字
+	size_t items = 200;
+	size_t owned_per_user = 16; // 大部分挂在steam账号上，少部分在qq账号上
+	size_t shop_entries = 64;
+	size_t signed_every = 2; // 每隔几个玩家昨天签到过，其余的从没签到过
+};
+
+// 测试玩家和道具使用固定的区间，不会和真实数据重叠，重新生成时只删除这些
+int64_t BenchQQID(size_t i); // 12位，超过真实qq号的长度
+std::string BenchSteamID(size_t i);
+std::string BenchItemCode(size_t i);
+
+// 建表（已经存在时不动），删除旧的测试数据后重新生成
+// 之后昨天签到过的玩家都可以再签到一次，所以每次测签到之前都需要重新生成
+void SeedBenchSchema(MySqlConnection &conn, const HyBenchSizes &sizes);
+
+// 在内存存储里生成同样的数据，不需要MySQL
+void SeedBenchMemory(HyMemoryBackend &backend, const HyBenchSizes &sizes);
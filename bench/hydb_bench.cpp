@@ -0,0 +1,346 @@
+#include "HyBenchSeed.h"
+#include "HyDatabase.h"
+#include "MySqlConnection.h"
+#include "MySqlConnectionPool.h"
+#include "GlobalContext.h"
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/use_future.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// 用法：HYDB_HOST=127.0.0.1 HYDB_SCHEMA=hybench hydb_bench --seed --concurrency=64 --ops=20000
+// 或者：hydb_bench --memory --concurrency=64 --ops=20000，每次都在内存里重新生成数据，不需要MySQL
+// 场景：
+//   login 开服后大量玩家同时进服，按顺序查不同玩家（缓存都是冷的）的账号和道具
+//   sign  零点签到，按顺序给不同玩家签到，同一天里重复跑只会得到“已签到”，需要重新--seed
+//   round 回合结束，每回合给round_players个随机玩家批量发道具，再单独给MVP发一个
+//   shop  浏览商店，查目录和余额后用bench_0兑换
+
+using namespace std::chrono_literals;
+
+struct BenchOptions
+{
+	HyBenchSizes sizes;
+	bool seed = false;
+	bool memory = false;
+	bool write_behind = false;
+	size_t concurrency = 64;
+	size_t ops = 20000; // 每个场景的操作次数
+	size_t round_players = 32;
+	std::vector<std::string> scenarios = { "login", "sign", "round", "shop" };
+};
+
+// 一个接口的统计，失败的调用不计入延迟
+struct BenchApi
+{
+	LatencyHistogram latency;
+	std::atomic<uint64_t> errors = 0;
+};
+
+class BenchReport
+{
+public:
+	BenchApi &api(const std::string &name)
+	{
+		std::lock_guard l(m);
+		return apis.try_emplace(name).first->second;
+	}
+
+	void print(const std::string &scenario, size_t ops, std::chrono::steady_clock::duration elapsed)
+	{
+		const double seconds = std::chrono::duration<double>(elapsed).count();
+		std::printf("== %s: %zu ops in %.2f s, %.1f ops/s\n", scenario.c_str(), ops, seconds, ops / seconds);
+		std::printf("%-32s %9s %7s %10s %9s %9s %9s %9s\n", "api", "count", "errors", "calls/s", "p50(ms)", "p99(ms)", "p999(ms)", "max(ms)");
+		std::lock_guard l(m);
+		for (auto &[name, api] : apis)
+		{
+			auto s = api.latency.snapshot();
+			std::printf("%-32s %9llu %7llu %10.1f %9.2f %9.2f %9.2f %9.2f\n", name.c_str(),
+				static_cast<unsigned long long>(s.count), static_cast<unsigned long long>(api.errors.load()), s.count / seconds,
+				s.percentile(0.5) / 1000.0, s.percentile(0.99) / 1000.0, s.percentile(0.999) / 1000.0, s.max / 1000.0);
+		}
+		std::printf("\n");
+	}
+
+private:
+	std::mutex m;
+	std::map<std::string, BenchApi> apis;
+};
+
+using BenchOp = std::function<boost::asio::awaitable<void>(BenchReport &report, size_t i, std::mt19937_64 &rng)>;
+
+// fn返回awaitable<bool>，false和异常都算失败
+template<class Fn>
+static boost::asio::awaitable<bool> Timed(BenchApi &api, Fn fn)
+{
+	auto start = std::chrono::steady_clock::now();
+	bool ok = false;
+	try
+	{
+		ok = co_await fn();
+	}
+	catch (...)
+	{
+		ok = false;
+	}
+	if (!ok)
+	{
+		api.errors.fetch_add(1, std::memory_order_relaxed);
+		co_return false;
+	}
+	api.latency.record(std::chrono::steady_clock::now() - start);
+	co_return true;
+}
+
+static boost::asio::awaitable<void> LoginStorm(const BenchOptions &options, BenchReport &report, size_t i, std::mt19937_64 &)
+{
+	auto &db = HyDatabase();
+	const std::string steamid = BenchSteamID(i % options.sizes.users);
+	if (!co_await Timed(report.api("QueryUserAccountDataBySteamID"), [&]() -> boost::asio::awaitable<bool> {
+		co_await db.async_QueryUserAccountDataBySteamID(steamid);
+		co_return true;
+	}))
+		co_return;
+	co_await Timed(report.api("QueryUserOwnItemInfoBySteamID"), [&]() -> boost::asio::awaitable<bool> {
+		co_await db.async_QueryUserOwnItemInfoBySteamID(steamid);
+		co_return true;
+	});
+	co_await Timed(report.api("GetItemAmountBySteamID"), [&]() -> boost::asio::awaitable<bool> {
+		co_await db.async_GetItemAmountBySteamID(steamid, BenchItemCode(0), boost::asio::use_awaitable);
+		co_return true;
+	});
+}
+
+static boost::asio::awaitable<void> SignRush(const BenchOptions &options, BenchReport &report, size_t i, std::mt19937_64 &)
+{
+	auto &db = HyDatabase();
+	const int64_t qqid = BenchQQID(i % options.sizes.users);
+	HyUserAccountData account;
+	if (!co_await Timed(report.api("QueryUserAccountDataByQQID"), [&]() -> boost::asio::awaitable<bool> {
+		account = co_await db.async_QueryUserAccountDataByQQID(qqid);
+		co_return true;
+	}))
+		co_return;
+	co_await Timed(report.api("DoUserDailySign"), [&]() -> boost::asio::awaitable<bool> {
+		auto result = co_await db.async_DoUserDailySign(account);
+		co_return result.first != HyUserSignResultType::failure_unknown;
+	});
+}
+
+static boost::asio::awaitable<void> RoundEnd(const BenchOptions &options, BenchReport &report, size_t, std::mt19937_64 &rng)
+{
+	auto &db = HyDatabase();
+	std::vector<HyItemGrant> grants;
+	for (size_t p = 0; p < options.round_players; ++p)
+	{
+		const std::string steamid = BenchSteamID(rng() % options.sizes.users);
+		for (size_t n = 1 + rng() % 3; n > 0; --n)
+			grants.push_back({ "steam", steamid, BenchItemCode(rng() % options.sizes.items), static_cast<int32_t>(1 + rng() % 5) });
+	}
+	co_await Timed(report.api("GiveItemsBatch"), [&]() -> boost::asio::awaitable<bool> {
+		auto result = co_await db.async_GiveItemsBatch(grants, boost::asio::use_awaitable);
+		co_return std::all_of(result.begin(), result.end(), [](bool b) { return b; });
+	});
+	const std::string mvp = grants.empty() ? BenchSteamID(0) : grants.front().auth;
+	co_await Timed(report.api("GiveItemBySteamID"), [&]() -> boost::asio::awaitable<bool> {
+		co_return co_await db.async_GiveItemBySteamID(mvp, BenchItemCode(0), 10, boost::asio::use_awaitable);
+	});
+}
+
+static boost::asio::awaitable<void> ShopBrowse(const BenchOptions &options, BenchReport &report, size_t, std::mt19937_64 &rng)
+{
+	auto &db = HyDatabase();
+	const std::string steamid = BenchSteamID(rng() % options.sizes.users);
+	std::vector<HyShopEntry> entries;
+	co_await Timed(report.api("QueryShopEntry"), [&]() -> boost::asio::awaitable<bool> {
+		entries = co_await db.async_QueryShopEntry();
+		co_return true;
+	});
+	co_await Timed(report.api("AllItemInfoAvailable"), [&]() -> boost::asio::awaitable<bool> {
+		co_await db.async_AllItemInfoAvailable();
+		co_return true;
+	});
+	if (entries.empty())
+		co_return;
+	const auto &entry = entries[rng() % entries.size()];
+	co_await Timed(report.api("GetItemAmountBySteamID"), [&]() -> boost::asio::awaitable<bool> {
+		co_await db.async_GetItemAmountBySteamID(steamid, entry.exchange_item.code, boost::asio::use_awaitable);
+		co_return true;
+	});
+	// 余额不够时扣除失败是正常结果，不算错误
+	bool bought = false;
+	co_await Timed(report.api("ConsumeItemBySteamID"), [&]() -> boost::asio::awaitable<bool> {
+		bought = co_await db.async_ConsumeItemBySteamID(steamid, entry.exchange_item.code, entry.exchange_amount, boost::asio::use_awaitable);
+		co_return true;
+	});
+	if (bought)
+	{
+		co_await Timed(report.api("GiveItemBySteamID"), [&]() -> boost::asio::awaitable<bool> {
+			co_return co_await db.async_GiveItemBySteamID(steamid, entry.target_item.code, entry.target_amount, boost::asio::use_awaitable);
+		});
+	}
+}
+
+static boost::asio::awaitable<void> Worker(const BenchOp &op, BenchReport &report, std::atomic<size_t> &next, size_t ops, uint64_t seed)
+{
+	std::mt19937_64 rng(seed);
+	for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < ops;)
+		co_await op(report, i, rng);
+}
+
+// concurrency个协程共用一个计数器，一共做ops次op
+static void RunScenario(const std::string &name, const BenchOptions &options, const BenchOp &op)
+{
+	BenchReport report;
+	std::atomic<size_t> next = 0;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::future<void>> workers;
+	for (size_t w = 0; w < options.concurrency; ++w)
+		workers.push_back(boost::asio::co_spawn(*GlobalContextSingleton(), Worker(op, report, next, options.ops, w + 1), boost::asio::use_future));
+	for (auto &f : workers)
+		f.get();
+	report.print(name, options.ops, std::chrono::steady_clock::now() - start);
+}
+
+static bool ParseSize(std::string_view arg, std::string_view key, size_t &out)
+{
+	if (!arg.starts_with(key))
+		return false;
+	out = std::strtoull(std::string(arg.substr(key.size())).c_str(), nullptr, 10);
+	return true;
+}
+
+static bool ParseOptions(int argc, char *argv[], BenchOptions &options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string_view arg = argv[i];
+		if (arg == "--seed")
+			options.seed = true;
+		else if (arg == "--memory")
+			options.memory = true;
+		else if (arg == "--write-behind")
+			options.write_behind = true;
+		else if (arg.starts_with("--scenarios="))
+		{
+			options.scenarios.clear();
+			auto list = arg.substr(std::string_view("--scenarios=").size());
+			for (size_t pos = 0; pos <= list.size();)
+			{
+				size_t end = std::min(list.find(',', pos), list.size());
+				if (end > pos)
+					options.scenarios.emplace_back(list.substr(pos, end - pos));
+				pos = end + 1;
+			}
+		}
+		else if (!ParseSize(arg, "--users=", options.sizes.users) &&
+			!ParseSize(arg, "--items=", options.sizes.items) &&
+			!ParseSize(arg, "--owned-per-user=", options.sizes.owned_per_user) &&
+			!ParseSize(arg, "--shop-entries=", options.sizes.shop_entries) &&
+			!ParseSize(arg, "--concurrency=", options.concurrency) &&
+			!ParseSize(arg, "--ops=", options.ops) &&
+			!ParseSize(arg, "--round-players=", options.round_players))
+			return false;
+	}
+	return options.sizes.users > 0 && options.sizes.items > 0 && options.concurrency > 0;
+}
+
+// 连接参数只从环境变量读，库里内置的服务器不受影响
+static std::optional<DatabaseConfig> BenchDatabaseConfig()
+{
+	const char *host = std::getenv("HYDB_HOST");
+	if (!host)
+		return std::nullopt;
+	auto env = [](const char *name, const char *fallback) -> std::string {
+		const char *v = std::getenv(name);
+		return v ? v : fallback;
+	};
+	DatabaseConfig config;
+	config.host = host;
+	config.port = env("HYDB_PORT", "3306");
+	config.user = env("HYDB_USER", "root");
+	config.pass = env("HYDB_PASS", "");
+	config.schema = env("HYDB_SCHEMA", "hybench");
+	return config;
+}
+
+int main(int argc, char *argv[])
+{
+	BenchOptions options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		std::fprintf(stderr, "usage: hydb_bench [--seed | --memory] [--write-behind] [--scenarios=login,sign,round,shop]\n"
+			"                  [--users=N] [--items=N] [--owned-per-user=N] [--shop-entries=N]\n"
+			"                  [--concurrency=N] [--ops=N] [--round-players=N]\n"
+			"connection is taken from HYDB_HOST, HYDB_PORT, HYDB_USER, HYDB_PASS, HYDB_SCHEMA\n");
+		return 2;
+	}
+	// 生成数据会删表里的东西，不允许连内置的服务器
+	const auto config = BenchDatabaseConfig();
+	if (!options.memory && !config)
+	{
+		std::fprintf(stderr, "HYDB_HOST is not set, refusing to run against the built-in server\n");
+		return 2;
+	}
+
+	if (options.seed && !options.memory)
+	{
+		auto start = std::chrono::steady_clock::now();
+		MySqlConnectionPool pool(*config);
+		auto conn = pool.acquire();
+		SeedBenchSchema(*conn, options.sizes);
+		std::printf("seeded %zu users in %.2f s\n\n", options.sizes.users, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	auto &db = HyDatabase();
+	if (options.write_behind)
+		db.EnableWriteBehind();
+	if (options.memory)
+	{
+		auto start = std::chrono::steady_clock::now();
+		db.Start(HyBackendType::memory);
+		SeedBenchMemory(*db.MemoryBackend(), options.sizes);
+		db.RefreshCatalog();
+		std::printf("seeded %zu users in memory in %.2f s\n\n", options.sizes.users, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+	else
+	{
+		db.Start(*config);
+	}
+
+	const std::map<std::string, BenchOp> scenarios = {
+		{ "login", [&](BenchReport &report, size_t i, std::mt19937_64 &rng) { return LoginStorm(options, report, i, rng); } },
+		{ "sign", [&](BenchReport &report, size_t i, std::mt19937_64 &rng) { return SignRush(options, report, i, rng); } },
+		{ "round", [&](BenchReport &report, size_t i, std::mt19937_64 &rng) { return RoundEnd(options, report, i, rng); } },
+		{ "shop", [&](BenchReport &report, size_t i, std::mt19937_64 &rng) { return ShopBrowse(options, report, i, rng); } },
+	};
+	for (auto &name : options.scenarios)
+	{
+		auto iter = scenarios.find(name);
+		if (iter == scenarios.end())
+		{
+			std::fprintf(stderr, "unknown scenario %s\n", name.c_str());
+			return 2;
+		}
+		RunScenario(name, options, iter->second);
+	}
+
+	db.FlushWriteBehind();
+	std::printf("%s\n", db.PoolMetrics().to_string().c_str());
+	return 0;
+}
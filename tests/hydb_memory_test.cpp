@@ -0,0 +1,123 @@
+#include "HyDatabase.h"
+#include "HyMemoryBackend.h"
+#include "GlobalContext.h"
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/use_future.hpp>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// 用内存存储走一遍签到、绑定和扣除合并，不需要MySQL
+// CHyDatabase是单例，所有检查按顺序在一个进程里完成，后面的依赖前面的结果
+
+static int failures = 0;
+
+#define HYDB_CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			++failures; \
+		} \
+	} while (0)
+
+template<class T>
+static T Run(boost::asio::awaitable<T> task)
+{
+	return boost::asio::co_spawn(*GlobalContextSingleton(), std::move(task), boost::asio::use_future).get();
+}
+
+static const int64_t qqid = 10001;
+static const std::string steamid = "STEAM_0:1:10001";
+
+static void TestSign(CHyDatabase &db)
+{
+	auto account = db.QueryUserAccountDataByQQID(qqid);
+	auto [type, result] = Run(db.async_DoUserDailySign(account));
+	HYDB_CHECK(type == HyUserSignResultType::success);
+	HYDB_CHECK(result.has_value());
+	if (!result)
+		return;
+	HYDB_CHECK(result->iRank == 1);
+	HYDB_CHECK(result->iContinuouslyKeepDays == 1);
+	HYDB_CHECK(result->vecItems.size() == 1);
+	if (result->vecItems.size() == 1)
+	{
+		auto &item = result->vecItems[0];
+		HYDB_CHECK(item.item.code == "coin");
+		HYDB_CHECK(item.add_amount == 10 * result->iMultiply);
+		HYDB_CHECK(item.cur_amount == item.add_amount);
+		// 签到写入的奖励要反映到道具缓存里
+		HYDB_CHECK(db.GetItemAmountByQQID(qqid, "coin") == item.cur_amount);
+	}
+
+	auto [again, again_result] = Run(db.async_DoUserDailySign(account));
+	HYDB_CHECK(again == HyUserSignResultType::failure_already_signed);
+	HYDB_CHECK(!again_result.has_value());
+}
+
+static void TestBind(CHyDatabase &db)
+{
+	const int32_t gocode = Run(db.async_StartRegistrationWithSteamID(steamid));
+	HYDB_CHECK(gocode != 0);
+	HYDB_CHECK(!db.BindQQToSteamID(qqid, gocode + 1)); // 没有这个注册码
+	HYDB_CHECK(db.BindQQToSteamID(qqid, gocode));
+	HYDB_CHECK(db.QueryUserAccountDataBySteamID(steamid).qqid == qqid);
+	// 绑定之后两个账号看到的是同一个合计数量
+	HYDB_CHECK(db.GetItemAmountBySteamID(steamid, "coin") == db.GetItemAmountByQQID(qqid, "coin"));
+}
+
+static void TestConsumeMerge(CHyDatabase &db)
+{
+	const int32_t signed_amount = db.GetItemAmountByQQID(qqid, "coin");
+	HYDB_CHECK(db.GiveItemBySteamID(steamid, "coin", 5));
+	HYDB_CHECK(db.GetItemAmountBySteamID(steamid, "coin") == signed_amount + 5);
+
+	// steam自己只有5个，扣7个要先把qq名下的合并过来
+	HYDB_CHECK(db.ConsumeItemBySteamID(steamid, "coin", 7));
+	HYDB_CHECK(db.GetItemAmountBySteamID(steamid, "coin") == signed_amount - 2);
+	HYDB_CHECK(db.GetItemAmountByQQID(qqid, "coin") == signed_amount - 2);
+	HYDB_CHECK(!db.ConsumeItemBySteamID(steamid, "coin", signed_amount));
+
+	// 没有这种道具的账号扣除失败，也不应该留下空的一行
+	HYDB_CHECK(!db.ConsumeItemBySteamID("STEAM_0:0:404", "coin", 1));
+	HYDB_CHECK(db.GetItemAmountBySteamID("STEAM_0:0:404", "coin") == 0);
+}
+
+static void TestGiveItems(HyMemoryBackend &backend)
+{
+	// 和GiveItem一样，已有的一行加0算没有变化
+	auto result = Run(backend.async_GiveItems({
+		{ "steam", steamid, "coin", 0 },
+		{ "steam", steamid, "gem", 0 },
+		{ "qq", std::to_string(qqid), "coin", 1 },
+	}));
+	HYDB_CHECK((result == std::vector<HyGrantResult>{ HyGrantResult::unchanged, HyGrantResult::applied, HyGrantResult::applied }));
+}
+
+int main()
+{
+	auto &db = HyDatabase();
+	db.Start(HyBackendType::memory);
+	auto &backend = *db.MemoryBackend();
+	backend.PutItemInfo({ "coin", "硬币", "", "个" });
+	backend.PutItemInfo({ "gem", "宝石", "", "颗" });
+	backend.PutSignAward("coin", 10, 0, 1000);
+	backend.PutAccount(qqid);
+	db.RefreshCatalog();
+
+	TestSign(db);
+	TestBind(db);
+	TestConsumeMerge(db);
+	TestGiveItems(backend);
+
+	if (failures)
+	{
+		std::fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	std::printf("all checks passed\n");
+	return 0;
+}